@@ -17,3 +17,27 @@ void audio_update(uint8_t *buf, uint32_t bufpos, uint32_t bufsize) {
   }
   
 }
+
+// output stage: half of the synth mix bus (15 fractional bits) plus half of the USB stream,
+// saturated straight into the DMA buffer; a NULL mix outputs the USB stream alone
+void audio_mix(uint8_t *buf, uint32_t bufpos, uint32_t bufsize, const int32_t *mix) {
+  int16_t *in = (int16_t *)audio_buffer_getptr(bufpos, bufsize);
+  int16_t *out = (int16_t *)&buf[0] + bufpos / 2;
+
+  int blkCnt = (bufsize / 2) >> 2;
+  if (mix) {
+    while (blkCnt--) {
+      *out++ = __SSAT((*mix++ >> 16) + (*in++ >> 1), 16);
+      *out++ = __SSAT((*mix++ >> 16) + (*in++ >> 1), 16);
+      *out++ = __SSAT((*mix++ >> 16) + (*in++ >> 1), 16);
+      *out++ = __SSAT((*mix++ >> 16) + (*in++ >> 1), 16);
+    }
+  } else {
+    while (blkCnt--) {
+      *out++ = *in++ >> 1;
+      *out++ = *in++ >> 1;
+      *out++ = *in++ >> 1;
+      *out++ = *in++ >> 1;
+    }
+  }
+}
@@ -5,5 +5,6 @@
 
 void audio_init(void);
 void audio_update(uint8_t *buf, uint32_t bufpos, uint32_t bufsize);
+void audio_mix(uint8_t *buf, uint32_t bufpos, uint32_t bufsize, const int32_t *mix);
 
 #endif
\ No newline at end of file
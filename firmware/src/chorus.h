@@ -217,4 +217,14 @@ int chorus_process(chorus_t *chorus, int32_t *in, int32_t *out, uint32_t samples
 	return 1;
 }
 
+/*
+ * Advance over samples without processing them, for a delay line holding
+ * only silence the output would be the dry signal.
+ */
+void chorus_skip(chorus_t *chorus, uint32_t samples)
+{
+	chorus->counter = (chorus->counter + samples) % chorus->maxsamples;
+	chorus->phase = (chorus->phase + samples) % chorus->length;
+}
+
 #endif
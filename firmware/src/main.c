@@ -11,43 +11,47 @@ static void CPU_CACHE_Enable(void);
 
 #ifdef USE_FREERTOS
 
-osThreadId_t led_handle, synth_handle, midi_handle;
+osThreadId_t led_handle, synth_handle, midi_handle, loader_handle;
 osSemaphoreId_t synth_sem;
 osMutexId_t synth_mutex;
 
 osMessageQueueId_t midi_queue;
 
-uint8_t synthesized = 0;
-#else
-uint8_t synthesized = 1;
+// DMA buffer halves played and not rendered again yet
+volatile uint8_t synth_pending[2] = { 0, 0 };
 #endif
 
 uint8_t global_buf[AUDIO_BUF_SIZE];
 
-void BSP_AUDIO_OUT_HalfTransfer_CallBack(void)
+#ifdef USE_FREERTOS
+// the DMA finished playing half and moves on to the other one: if that one is still pending the synth task
+// was late, play it silent rather than what it held a buffer ago, and don't render into it while it plays
+static void synth_half_played(uint32_t half)
 {
-  if(synthesized) 
-  {
-    synth_update(global_buf, 0, AUDIO_BUF_SIZE / 2);
-    audio_update(global_buf, 0, AUDIO_BUF_SIZE / 2);
-  } else {
-    // skip half/frame
-    memset(&global_buf[0], 0, AUDIO_BUF_SIZE / 2);
+  if (synth_pending[half ^ 1]) {
+    synth_pending[half ^ 1] = 0;
+    memset(&global_buf[0] + (half ^ 1) * (AUDIO_BUF_SIZE / 2), 0, AUDIO_BUF_SIZE / 2);
   }
+  synth_pending[half] = 1;
+  osSemaphoreRelease(synth_sem);
 }
+#endif
 
-void BSP_AUDIO_OUT_TransferComplete_CallBack(void)
+void BSP_AUDIO_OUT_HalfTransfer_CallBack(void)
 {
-  if(synthesized) {
-    synth_update(global_buf, AUDIO_BUF_SIZE / 2, AUDIO_BUF_SIZE / 2);
-    audio_update(global_buf, AUDIO_BUF_SIZE / 2, AUDIO_BUF_SIZE / 2);
-  } else {
-    // skip half/frame
-    memset(&global_buf[0] + AUDIO_BUF_SIZE / 2, 0, AUDIO_BUF_SIZE / 2);
-  }
+#ifdef USE_FREERTOS
+  synth_half_played(0);
+#else
+  synth_update(global_buf, 0, AUDIO_BUF_SIZE / 2);
+#endif
+}
 
+void BSP_AUDIO_OUT_TransferComplete_CallBack(void)
+{
 #ifdef USE_FREERTOS
-  osSemaphoreRelease(synth_sem);
+  synth_half_played(1);
+#else
+  synth_update(global_buf, AUDIO_BUF_SIZE / 2, AUDIO_BUF_SIZE / 2);
 #endif
 }
 
@@ -97,15 +101,31 @@ void midi_task(void *argument)
   }
 }
 
+// loads the presets selected by program changes, a note before that is dropped
+void loader_task(void *argument)
+{
+  while (1) {
+    synth_load_pending();
+    osDelay(2);
+  }
+}
+
 void synth_task(void *argument)
 {
+  uint32_t half;
+  uint8_t pending;
+
   while (1) {
     osSemaphoreAcquire(synth_sem, osWaitForever);
-    synthesized = 0;
-    synth_render(0, AUDIO_BUF_SIZE/2);
-    synthesized = 1;
-    synth_render(AUDIO_BUF_SIZE/2, AUDIO_BUF_SIZE/2);
-    synthesized = 2;
+    // render the halves the DMA finished playing, claimed before the callback can silence them
+    for (half = 0; half < 2; half++) {
+      taskENTER_CRITICAL();
+      pending = synth_pending[half];
+      synth_pending[half] = 0;
+      taskEXIT_CRITICAL();
+      if (pending)
+        synth_update(global_buf, half * (AUDIO_BUF_SIZE / 2), AUDIO_BUF_SIZE / 2);
+    }
     osThreadYield();
   }
 }
@@ -192,7 +212,6 @@ int main(void)
   usb_init();
 
   synth_init();
-  synth_buffer_init();
 
 #ifdef USE_FREERTOS
   osKernelInitialize();
@@ -212,6 +231,10 @@ int main(void)
     .stack_size = 4096
   };
 #endif
+  osThreadAttr_t loader_thr_attr = {
+    .priority = osPriorityBelowNormal,
+    .stack_size = 2048
+  };
   osThreadAttr_t synth_thr_attr = {
     .priority = osPriorityRealtime,
     .stack_size = 4096
@@ -222,6 +245,7 @@ int main(void)
   midi_handle = osThreadNew(midi_task, NULL, &midi_thr_attr);
 #endif
   synth_handle = osThreadNew(synth_task, NULL, &synth_thr_attr);
+  loader_handle = osThreadNew(loader_task, NULL, &loader_thr_attr);
 
   osKernelStart();
 #else
@@ -230,6 +254,9 @@ int main(void)
 
   while (1)
   {
+#ifndef USE_FREERTOS
+    synth_load_pending();
+#endif
     __WFI();
   }
 }
@@ -36,6 +36,9 @@ THIS SOFTWARE.
 #define MAX_NUM_COMBS 4
 #define MAX_NUM_APS 3
 
+/* two interleaved comb samples loaded at once */
+typedef int32_t __attribute__((__may_alias__)) reverb_pair_t;
+
 #ifndef M_PI
 #    define M_PI 3.14159265358979323846
 #endif
@@ -60,8 +63,9 @@ typedef struct {
 
     uint32_t comb_pos;             /* position within comb filter */
     uint32_t ap_pos;               /* position within allpass filter */
+    int32_t peak;                  /* wet output magnitudes of the last block or'ed together */
 
-    int16_t comb[NUM_COMBS][COMB_SIZE];   /* buffers for comb filters */
+    int16_t comb[NUM_COMBS / 2][COMB_SIZE * 2];   /* buffers for comb filters, two interleaved combs per buffer */
     int16_t ap[NUM_APS][AP_SIZE];        /* buffers for ap filters */
 } reverb_t;
 
@@ -139,7 +143,8 @@ void reverb_init(reverb_t *rev) {
     rev->a0 = (int16_t)(a0 * 32768.0f);
     rev->b1 = (int16_t)(b1 * 32768.0f);
 
-    memset(rev->comb, 0, sizeof(int16_t) * COMB_SIZE * NUM_COMBS);
+    rev->peak = 0;
+    memset(rev->comb, 0, sizeof(rev->comb));
     memset(rev->ap, 0, sizeof(int16_t) * AP_SIZE * NUM_APS);
 
     reverb_set_colour(rev, 0.0f);
@@ -147,60 +152,106 @@ void reverb_init(reverb_t *rev) {
     reverb_set_decay(rev, 0.0f);
 }
 
-void reverb_process(reverb_t *rev, int32_t *in, int32_t *out, unsigned int samples) {
-    // handle the actual processing
-    uint32_t pos;
-    uint32_t comb_pos = rev->comb_pos;
-    uint32_t ap_pos = rev->ap_pos;
-
-    int c;
-
-    int32_t * input = in;
-    int32_t * output = out;
+/* samples until the first of the read and write positions reaches the end of its buffer */
+static inline unsigned int reverb_run(unsigned int samples, uint32_t pos, uint32_t size) {
+    return (size - pos < samples ? size - pos : samples);
+}
 
-    int32_t in_s, in_s1, temp;
-    int32_t out_m;
-    int32_t out_l, out_r;
+#define REVERB_RUN 64
+
+/* one comb pair over a run: both read with one load, each written at its own tap */
+static inline void reverb_comb_pair(int16_t *buf, uint32_t pos, uint32_t w0, uint32_t w1, int32_t gains,
+        const int32_t *in_s1, int32_t *temp, int first, unsigned int run) {
+    const reverb_pair_t *r = (const reverb_pair_t *)&buf[pos * 2];
+    int16_t *o0 = &buf[w0 * 2], *o1 = &buf[w1 * 2 + 1];
+    unsigned int i;
+
+    for (i = 0; i < run; i++) {
+        int32_t v = r[i];
+        o0[i * 2] = __SSAT((int32_t)__SMLABB(gains, v, in_s1[i]) >> 15, 16);
+        o1[i * 2] = __SSAT((int32_t)__SMLATT(gains, v, in_s1[i]) >> 15, 16);
+        /* summed in comb order, saturating after each comb */
+        if (first) temp[i] = __SSAT((int32_t)__SMUAD(v, 0x00010001), 16);
+        else temp[i] = __SSAT(__SSAT(temp[i] + (int16_t)v, 16) + (v >> 16), 16);
+    }
+}
 
-    /* loop around the buffer */
-    for (pos = 0; pos < samples; pos++) {
-        /* loop around the comb filters */
-        temp = 0;
-        in_s = __SSAT(((input[pos]) >> 15)/4, 16);
+static inline void reverb_allpass(int16_t *buf, uint32_t pos, uint32_t w, int32_t gain, int32_t d1, int32_t *temp, unsigned int run) {
+    const int16_t *r = &buf[pos];
+    int16_t *o = &buf[w];
+    unsigned int i;
 
-        rev->lpo = ((int32_t)rev->a0 * (int32_t)in_s + (int32_t)rev->b1 * (int32_t)rev->lpo) >> 15;
-        in_s1 = (in_s << 15) + (int32_t)rev->gl * (int32_t)rev->lpo + (int32_t)rev->gh * (int32_t)(in_s - rev->lpo);
+    for (i = 0; i < run; i++) {
+        int32_t v = r[i], t = temp[i];
+        o[i] = __SSAT(((t << 15) + gain * v) >> 15, 16);
+        temp[i] = __SSAT(((d1 * t) >> 15) + v, 16);
+    }
+}
 
-        for (c = 0; c < NUM_COMBS; c++) {
-            int32_t v = (int32_t)rev->comb[c][comb_pos];
-            rev->comb[c][(comb_pos + rev->tap[c]) & COMB_MASK] = __SSAT((in_s1 + (int32_t)rev->comp_gain[c] * v) >> 15, 16);
-            temp = __SSAT(temp + v, 16);
-        }
+/*
+The stages run one after the other over runs of up to REVERB_RUN samples, which end where the first comb
+or allpass position meets the end of its buffer, so nothing is wrapped inside a run. The combs are read at
+the same position, comb pairs share a word and a load and their feedback gains are packed.
+*/
+void reverb_process(reverb_t *rev, int32_t *in, int32_t *out, unsigned int samples) {
+    uint32_t comb_pos = rev->comb_pos;
+    uint32_t ap_pos = rev->ap_pos;
+    uint32_t comb_w[NUM_COMBS], ap_w[NUM_APS];
+    int32_t in_s1[REVERB_RUN], temp[REVERB_RUN];
+
+    int32_t gain01 = __PKHBT(rev->comp_gain[0], rev->comp_gain[1], 16);
+    int32_t gain23 = __PKHBT(rev->comp_gain[2], rev->comp_gain[3], 16);
+    int32_t a0b1 = __PKHBT(rev->a0, rev->b1, 16);
+    int32_t gl = rev->gl, gh = rev->gh, d2 = rev->d2;
+    int16_t lpo = rev->lpo;
+    int32_t peak = 0;
+    int c;
 
-        /* loop around the allpass filters */
-        for (c = 0; c < NUM_APS; c++) {
-            int32_t v = (int32_t)rev->ap[c][ap_pos];
-            rev->ap[c][(ap_pos + rev->ap_tap[c]) & AP_MASK] = __SSAT(((temp << 15) + ((int32_t)rev->ap_gain * (int32_t)v)) >> 15, 16);
-            temp = __SSAT((((int32_t)rev->d1 * temp) >> 15) + v, 16);
+    for (c = 0; c < NUM_COMBS; c++)
+        comb_w[c] = (comb_pos + rev->tap[c]) & COMB_MASK;
+    for (c = 0; c < NUM_APS; c++)
+        ap_w[c] = (ap_pos + rev->ap_tap[c]) & AP_MASK;
+
+    while (samples) {
+        unsigned int i, run = reverb_run(samples < REVERB_RUN ? samples : REVERB_RUN, comb_pos, COMB_SIZE);
+
+        for (c = 0; c < NUM_COMBS; c++)
+            run = reverb_run(run, comb_w[c], COMB_SIZE);
+        run = reverb_run(run, ap_pos, AP_SIZE);
+        for (c = 0; c < NUM_APS; c++)
+            run = reverb_run(run, ap_w[c], AP_SIZE);
+
+        /* tone filter */
+        for (i = 0; i < run; i++) {
+            int32_t in_s = __SSAT((in[i] >> 15)/4, 16);
+            lpo = (int16_t)((int32_t)__SMUAD(a0b1, __PKHBT(in_s, lpo, 16)) >> 15);
+            in_s1[i] = (in_s << 15) + gl * lpo + gh * (in_s - lpo);
         }
 
-        out_m = ((int32_t)rev->d2 * temp) >> 15;
-
-        out_l = *output++ >> 15;
-        out_r = *output++ >> 15;
-
-        output -= 2;
+        reverb_comb_pair(rev->comb[0], comb_pos, comb_w[0], comb_w[1], gain01, in_s1, temp, 1, run);
+        reverb_comb_pair(rev->comb[1], comb_pos, comb_w[2], comb_w[3], gain23, in_s1, temp, 0, run);
+        for (c = 0; c < NUM_APS; c++)
+            reverb_allpass(rev->ap[c], ap_pos, ap_w[c], rev->ap_gain, rev->d1, temp, run);
 
-        *output++ = (out_m + out_l * 3/4) << 15;
-        *output++ = (out_m + out_r * 3/4) << 15;
+        for (i = 0; i < run; i++) {
+            int32_t out_m = (d2 * temp[i]) >> 15;
+            peak |= out_m ^ (out_m >> 31);
+            out[i * 2] = (out_m + (out[i * 2] >> 15) * 3/4) << 15;
+            out[i * 2 + 1] = (out_m + (out[i * 2 + 1] >> 15) * 3/4) << 15;
+        }
 
-        comb_pos++;
-        comb_pos &= COMB_MASK; /* increment and wrap buffer */
-        ap_pos++;
-        ap_pos &= AP_MASK; /* increment and wrap buffer */
+        in += run, out += run * 2, samples -= run;
+        comb_pos = (comb_pos + run) & COMB_MASK;
+        for (c = 0; c < NUM_COMBS; c++)
+            comb_w[c] = (comb_w[c] + run) & COMB_MASK;
+        ap_pos = (ap_pos + run) & AP_MASK;
+        for (c = 0; c < NUM_APS; c++)
+            ap_w[c] = (ap_w[c] + run) & AP_MASK;
     }
 
+    rev->peak = peak;
+    rev->lpo = lpo;
     rev->comb_pos = comb_pos;
     rev->ap_pos = ap_pos;
 }
-#endif
\ No newline at end of file
+#endif
@@ -1,6 +1,7 @@
 #include "synth.h"
 #include "config.h"
 #include "qspi_wrapper.h"
+#include "audio.h"
 
 #ifdef TSF_SYNTH
 #define TSF_RENDER_EFFECTSAMPLEBLOCK 512
@@ -9,6 +10,8 @@
 //#define TSF_NO_LOWPASS
 //#define TSF_NO_REVERB
 //#define TSF_NO_CHORUS
+// SRAM copies of sample attacks and short loops, off until a QSPI measurement shows they render faster
+//#define TSF_SAMPLE_CACHE (32 * 1024)
 
 #define TSF_FILE QSPI_FILE
 #define TSF_MMAP(p,s,f) QSPI_mmap(0,s,f)
@@ -21,31 +24,45 @@
 #define TSF_REALLOC MB_REALLOC
 #define TSF_FREE MB_FREE
 
-#ifdef QUEUED_MIDI_MESSAGES
+// the preset loader runs below the audio and MIDI interrupts (or the tasks they wake), hold them off
+// while it evicts, compacts or publishes a preset; a note-on taken in the USB interrupt preempts the
+// render in the SAI DMA one, each holds the other off while it changes the voice and fade lists
+#ifdef USE_FREERTOS
+// masks the SAI DMA and USB interrupts (priority 5 and below) and task switches
+#define TSF_CRITICAL_ENTER() taskENTER_CRITICAL()
+#define TSF_CRITICAL_EXIT() taskEXIT_CRITICAL()
+#else
+static uint32_t synth_critical_depth = 0;
 
-void synth_mutex_lock(osMutexId_t mutex) {
-  osMutexAcquire(mutex, osWaitForever);
+static void synth_critical_enter(void) {
+  HAL_NVIC_DisableIRQ(AUDIO_OUT_SAIx_DMAx_IRQ);
+  HAL_NVIC_DisableIRQ(OTG_FS_IRQn);
+  __DSB();
+  __ISB();
+  synth_critical_depth++;
 }
 
-void synth_mutex_unlock(osMutexId_t mutex) {
-  osMutexRelease(mutex);
+static void synth_critical_exit(void) {
+  if (--synth_critical_depth == 0) {
+    HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
+    HAL_NVIC_EnableIRQ(AUDIO_OUT_SAIx_DMAx_IRQ);
+  }
 }
 
-#define TSF_MUTEX_TYPEDEF osMutexId_t
-#define TSF_MUTEX_INIT osMutexNew(NULL)
-#define TSF_MUTEX_DEINIT osMutexDelete
-#define TSF_MUTEX_LOCK synth_mutex_lock
-#define TSF_MUTEX_UNLOCK synth_mutex_unlock
+#define TSF_CRITICAL_ENTER synth_critical_enter
+#define TSF_CRITICAL_EXIT synth_critical_exit
 #endif
 
 #define TSF_IMPLEMENTATION
 #include "tsf.h"
 #else
 #include "efluidsynth.h"
+// only taken to replay the MIDI held behind a reset
+#define TSF_CRITICAL_ENTER __disable_irq
+#define TSF_CRITICAL_EXIT __enable_irq
 #endif
 
-uint8_t synth_buf[AUDIO_BUF_SIZE];
-uint8_t initialized = 0;
+volatile uint8_t initialized = 0;
 
 #ifdef USE_FREERTOS
 extern osMutexId_t synth_mutex;
@@ -57,10 +74,18 @@ tsf* synth = NULL;
 fluid_synth_t* synth = NULL;
 #endif
 
+// reset asked by a sysex, done by synth_load_pending()
+static volatile uint8_t synth_reset_request = 0;
+
+// MIDI that came after the reset in the stream, played by synth_load_pending() once the reset is done
+#define SYNTH_HELD_MESSAGES 32
+static struct midi_message synth_held[SYNTH_HELD_MESSAGES];
+static volatile uint32_t synth_held_num = 0;
+
 /* SYSEX callbacks */
 void midi_sysex_reset(void) {
 #ifndef QUEUED_MIDI_MESSAGES // FIXME
-  synth_reset();
+  synth_reset_request = 1;
 #endif
 }
 
@@ -120,16 +145,35 @@ void midi_sysex_set_chorus_type(uint8_t chorus_type) {
 }
 #endif
 
-void synth_buffer_init(void) {
-  memset(synth_buf, 0, AUDIO_BUF_SIZE);
+#ifdef TSF_SYNTH
+// render cost source for the tsf load governor
+static uint32_t synth_cycles(void) {
+  return DWT->CYCCNT;
+}
+
+static void synth_cycles_init(void) {
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->LAR = 0xC5ACCE55; // unlock on the M7
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 }
+#endif
 
 void synth_init() {
 #ifdef TSF_SYNTH
-  synth = tsf_load_filename(NULL);
+  // a native font compiled by sf2native is mapped as is, a SF2 is parsed
+  if (memcmp(QSPI_addr(), "TSFN", 4) == 0)
+    synth = tsf_load_native(QSPI_addr(), QSPI_flash_size());
+  else
+    synth = tsf_load_filename(NULL);
   if (synth) {
     tsf_set_max_voices(synth, POLYPHONY);
     tsf_set_output(synth, TSF_STEREO_INTERLEAVED, SAMPLE_RATE, 0.0f);
+    // degrade before a DMA half gets zeroed for being late
+    synth_cycles_init();
+    tsf_set_governor(synth, synth_cycles, SystemCoreClock / SAMPLE_RATE);
+    // program changes only select, the presets are parsed by synth_load_pending()
+    tsf_set_preset_loader(synth, 1);
     tsf_channel_set_presetnumber(synth, 0, 0, 0);
     initialized = 1;
   }
@@ -171,10 +215,10 @@ void synth_set_volume(float vol) {
 #endif
 }
 
-// reset synthesizer if ROM was updated
+// reset synthesizer if ROM was updated, the audio interrupt does not render it meanwhile
 void synth_reset_updated() {
-  QSPI_readonly_mode();
-  if (QSPI_wrote_get()) {
+  if (QSPI_wrote_get() && QSPI_ready()) {
+    QSPI_readonly_mode();
     synth_reset();
     QSPI_wrote_clear();
     QSPI_clear_writing();
@@ -185,46 +229,69 @@ uint8_t synth_available() {
   return (initialized && QSPI_ready());
 }
 
+// a message behind a pending reset is held, it must neither reach the synth being closed nor be undone by the reset
 void synth_midi_process(uint8_t *msg, uint32_t len) {
-  midi_process(synth, msg, len);
+  if (synth_reset_request) {
+    if (synth_held_num < SYNTH_HELD_MESSAGES && len <= MAX_MIDI_LEN) {
+      memcpy(synth_held[synth_held_num].data, msg, len);
+      synth_held[synth_held_num].len = len;
+      synth_held_num++;
+    }
+    return;
+  }
+  if (synth_available())
+    midi_process(synth, msg, len);
 }
 
-#ifdef USE_FREERTOS
-void synth_render (uint32_t bufpos, uint32_t bufsize) {
-  if (synth_available()) {
-    synth_reset_updated();
-//    osMutexAcquire(synth_mutex, osWaitForever);
-    tsf_render_short(synth, (int16_t *)&synth_buf[bufpos], bufsize / 4, 0);
-//    osMutexRelease(synth_mutex);
+// play what was held behind the reset, up to a further reset that holds the rest again
+static void synth_held_replay() {
+  uint32_t i;
+
+  TSF_CRITICAL_ENTER();
+  synth_reset_request = 0;
+  for (i = 0; i < synth_held_num && !synth_reset_request; i++) {
+    if (synth_available())
+      midi_process(synth, synth_held[i].data, synth_held[i].len);
   }
+  memmove(&synth_held[0], &synth_held[i], (synth_held_num - i) * sizeof(synth_held[0]));
+  synth_held_num -= i;
+  TSF_CRITICAL_EXIT();
 }
+
+// reset and parse the presets channels switched to, outside of the MIDI and audio interrupts
+void synth_load_pending() {
+  synth_reset_updated();
+  if (synth_reset_request) {
+    synth_reset();
+    synth_held_replay();
+  }
+#ifdef TSF_SYNTH
+  if (synth_available())
+    tsf_load_pending(synth);
 #endif
+}
 
+// render the synth and the USB stream into the free half of the DMA buffer
 void synth_update(uint8_t *buf, uint32_t bufpos, uint32_t bufsize) {
-#ifndef USE_FREERTOS
-  if (synth_available()) {
-    synth_reset_updated();
+  if (synth_available() && !QSPI_wrote_get()) {
+    QSPI_readonly_mode();
 #ifdef TSF_SYNTH
-    tsf_render_short(synth, (int16_t *)&synth_buf[bufpos], bufsize / 4, 0);
+    audio_mix(buf, bufpos, bufsize, tsf_render_int(synth, bufsize / 4));
 #else
-    fluid_synth_write_s16(synth, bufsize / 4, (int16_t *)&synth_buf[bufpos], 0, 2, (int16_t *)&synth_buf[bufpos], 1, 2 );
-#endif
-#endif
-
     int16_t *out = (int16_t *)&buf[0] + bufpos / 2;
-    int16_t *in = (int16_t *)synth_buf + bufpos / 2;
+    fluid_synth_write_s16(synth, bufsize / 4, out, 0, 2, out, 1, 2 );
 
     int blkCnt = (bufsize / 2) >> 2;
     while (blkCnt--) {
-      *out++ = *in++ >> 1;
-      *out++ = *in++ >> 1;
-      *out++ = *in++ >> 1;
-      *out++ = *in++ >> 1;
+      *out++ >>= 1;
+      *out++ >>= 1;
+      *out++ >>= 1;
+      *out++ >>= 1;
     }
-#ifndef USE_FREERTOS
+    audio_update(buf, bufpos, bufsize);
+#endif
   } else {
-    memset(&buf[0] + bufpos, 0, bufsize);
+    audio_mix(buf, bufpos, bufsize, NULL);
   }
-#endif
 }
 
@@ -14,8 +14,12 @@
 
    [OPTIONAL] #define TSF_NO_STDIO to remove stdio dependency
    [OPTIONAL] #define TSF_MALLOC, TSF_REALLOC, and TSF_FREE to avoid stdlib.h
-   [OPTIONAL] #define TSF_MEMCPY, TSF_MEMSET to avoid string.h
+   [OPTIONAL] #define TSF_MEMCPY, TSF_MEMSET, TSF_MEMMOVE to avoid string.h
+   [OPTIONAL] #define TSF_REGION_ARENA to the bytes reserved for the region tables of loaded presets
+   [OPTIONAL] #define TSF_SAMPLE_CACHE to the bytes reserved for SRAM copies of sample attacks and short loops (0 disables it)
+   [OPTIONAL] #define TSF_SAMPLE_CACHE_STATS to count the samples voices read from those copies and from the font
    [OPTIONAL] #define TSF_POW, TSF_POWF, TSF_EXPF, TSF_LOG, TSF_TAN, TSF_LOG10, TSF_SQRT to avoid math.h
+   [OPTIONAL] #define TSF_NO_MATH_TABLES to use libm instead of the interpolated exp2/tan tables in the render path
 
    NOT YET IMPLEMENTED
      - Better low-pass filter without lowering performance too much
@@ -91,11 +95,43 @@ struct tsf_stream
 
 	int32_t (*tell)(void* data);
 	int32_t (*seek)(void* data, uint32_t count);
+
+	// Optional (TSF_NULL if not mappable), returns the address the first 'size' bytes of the stream are mapped at,
+	// the hydra records are then parsed in place instead of through seek and read
+	const void* (*map)(void* data, uint32_t size);
 };
 
 // Generic SoundFont loading method using the stream structure above
 TSFDEF tsf* tsf_load(struct tsf_stream* stream);
 
+// Compiled image of a font: its sorted preset directory and bank/program hash, plus the resolved region
+// tables of every preset with flag_regions, so a later load does not parse the hydra.
+// tsf_image_write streams it through 'write' (returns the bytes it took) and returns the image size or 0
+// on failure, tsf_image_size returns the size it would write.
+TSFDEF int32_t tsf_image_size(tsf* f, int32_t flag_regions);
+TSFDEF int32_t tsf_image_write(tsf* f, int32_t (*write)(void* data, const void* ptr, uint32_t size), void* data, int32_t flag_regions);
+
+// Load a font along with the image compiled from it. The image is checked against a hash of the RIFF header
+// and pdta chunk of the font and ignored when it does not match, the font is then parsed as usual.
+// An image with region tables has to stay readable as long as the tsf is used.
+TSFDEF tsf* tsf_load_image(struct tsf_stream* stream, const void* image, int32_t image_size);
+#ifndef TSF_NO_STDIO
+TSFDEF tsf* tsf_load_filename_image(const char* filename, const void* image, int32_t image_size);
+#endif
+
+// Returns 1 when the presets were taken from the image
+TSFDEF int32_t tsf_image_loaded(tsf* f);
+
+// Native font compiled offline from a SF2 by test/sf2native: resolved region tables, sorted preset directory,
+// bank/program hash, key indexes and the samples, as int16 or as ADPCM blocks, all used in place.
+// Every preset is ready once loaded, there is no hydra to parse and no arena, so 'data' has to stay mapped
+// as long as the tsf is used. Returns TSF_NULL when data does not hold a valid native font of this build.
+TSFDEF tsf* tsf_load_native(const void* data, int32_t size);
+
+// Encode count samples into the IMA ADPCM block pool of a native font, samples past count read as zeros.
+// Writes to out unless TSF_NULL and returns the size of the pool in bytes.
+TSFDEF int32_t tsf_adpcm_encode(const int16_t* samples, uint32_t count, uint8_t* out);
+
 // Free the memory related to this tsf instance
 TSFDEF void tsf_close(tsf* f);
 
@@ -141,6 +177,10 @@ TSFDEF void tsf_set_output(tsf* f, enum TSFOutputMode outputmode, int32_t sample
 //   global_gain: the desired volume where 1.0 is 100%
 TSFDEF void tsf_set_volume(tsf* f, float global_gain);
 
+// Set the level below which a decaying or releasing voice is inaudible and gets ended early
+//   threshold_db: estimated voice level in dBFS (default TSF_CULL_DB, -100 or lower disables culling)
+TSFDEF void tsf_set_cull_threshold(tsf* f, float threshold_db);
+
 // Start playing a note
 //   preset_index: preset index >= 0 and < tsf_get_presetcount()
 //   key: note value between 0 and 127 (60 being middle C)
@@ -170,6 +210,66 @@ TSFDEF int32_t tsf_active_voice_count(tsf* f);
 //   flag_mixing: if 0 clear the buffer first, otherwise mix into existing data
 TSFDEF void tsf_render_short(tsf* f, int16_t* buffer, int32_t samples, int32_t flag_mixing CPP_DEFAULT0);
 
+// Render into the internal int32 stereo interleaved mix bus and return it, for callers doing their own output stage
+// Values carry 15 fractional bits (tsf_render_short outputs __SSAT(bus >> 15, 16)), the bus is valid until the next render
+//   samples: number of samples to render (at most TSF_MAX_SAMPLES)
+TSFDEF int32_t* tsf_render_int(tsf* f, int32_t samples);
+
+// Chorus and reverb are skipped while no voice sends to them and what is left of their tail is under the noise floor,
+// they keep their state for the next send. Returns the effects (enum TSFEffect bits) the last render ran.
+enum TSFEffect { TSF_EFFECT_CHORUS = 1, TSF_EFFECT_REVERB = 2 };
+TSFDEF int32_t tsf_effects_active(tsf* f);
+
+// CPU load governor steps, each one keeps the ones before it
+enum TSFGovernorLevel
+{
+	// everything rendered
+	TSF_GOVERNOR_FULL,
+	// note-ons only take over existing voices, the active voice count can't grow
+	TSF_GOVERNOR_CAP_VOICES,
+	// releasing voices are ended from TSF_GOVERNOR_CULL_DB on instead of the cull threshold
+	TSF_GOVERNOR_CULL_RELEASE,
+	// voices read the nearest sample without interpolation
+	TSF_GOVERNOR_NO_INTERPOLATION,
+	// chorus and reverb are bypassed (their state is kept for when they come back)
+	TSF_GOVERNOR_NO_EFFECTS,
+};
+
+// Measure every render against the time its samples last and degrade before the output runs late
+// A block over TSF_GOVERNOR_HIGH percent of its budget moves one step up, TSF_GOVERNOR_HOLD blocks
+// in a row under TSF_GOVERNOR_LOW percent move one step back
+//   cycles: free running cycle counter (the DWT cycle counter on Cortex-M, a scripted one on the host), TSF_NULL disables the governor
+//   cycles_per_sample: cycles the render may take per output sample (core clock / sample rate)
+TSFDEF void tsf_set_governor(tsf* f, uint32_t (*cycles)(void), uint32_t cycles_per_sample);
+
+// Returns the current governor step (enum TSFGovernorLevel) and the cost of the last render in percent of its budget
+TSFDEF int32_t tsf_governor_level(tsf* f);
+TSFDEF int32_t tsf_governor_load(tsf* f);
+
+// Region tables of loaded presets come from one TSF_REGION_ARENA block allocated with the font,
+// the preset collection compacts it. A preset that does not fit stays unloaded (its notes are
+// dropped) and is counted as a failure, the next collection then evicts to make room for it.
+// Returns the bytes in use (holes included until compacted) and the failed preset loads
+TSFDEF int32_t tsf_region_arena_used(tsf* f);
+TSFDEF int32_t tsf_region_arena_failures(tsf* f);
+
+// Loaded presets stay cached, the least recently played one nothing selects or plays is only evicted
+// when the tables pass budget_bytes (TSF_PRESET_CACHE by default) or when a load does not fit the arena
+TSFDEF void tsf_set_preset_cache(tsf* f, int32_t budget_bytes);
+
+// Returns the preset lookups of note-ons and program changes that found their preset loaded or not, and the evictions
+TSFDEF void tsf_preset_cache_stats(tsf* f, int32_t* hits, int32_t* misses, int32_t* evictions);
+
+// Loaded presets copy the attack of their samples and their short loops to the arena while budget_bytes
+// (TSF_SAMPLE_CACHE by default) allow, from their next load on, 0 turns it off. Needs a TSF_SAMPLE_CACHE build.
+// It only pays where the font is slower to read than SRAM: there are no target measurements, on the host it
+// renders no faster.
+TSFDEF void tsf_set_sample_cache(tsf* f, int32_t budget_bytes);
+
+// Returns the samples the voices read from the SRAM copies and from the font (0 without TSF_SAMPLE_CACHE_STATS),
+// and the bytes the copies take
+TSFDEF void tsf_sample_cache_stats(tsf* f, int32_t* hits, int32_t* misses, int32_t* resident_bytes);
+
 // Higher level channel based functions, set up channel parameters
 //   channel: channel number
 //   preset_index: preset index >= 0 and < tsf_get_presetcount()
@@ -192,6 +292,15 @@ TSFDEF void tsf_channel_set_pitchwheel(tsf* f, int32_t channel, int32_t pitch_wh
 TSFDEF void tsf_channel_set_pitchrange(tsf* f, int32_t channel, float pitch_range);
 TSFDEF void tsf_channel_set_tuning(tsf* f, int32_t channel, float tuning);
 
+// Presets are parsed when a channel selects them so the first note does not pay for it
+// With flag_deferred they are only marked there and loaded by tsf_load_pending() from a background task,
+// a note-on for a preset that is not loaded yet is then skipped instead of parsing it in the note-on path
+TSFDEF void tsf_set_preset_loader(tsf* f, int32_t flag_deferred);
+
+// Load the presets selected by channels that are not loaded yet, returns how many were loaded
+// (also runs the preset collection in deferred mode, so eviction and compaction stay out of the render)
+TSFDEF int32_t tsf_load_pending(tsf* f);
+
 // Start or stop playing notes on a channel (needs channel preset to be set)
 //   channel: channel number
 //   key: note value between 0 and 127 (60 being middle C)
@@ -235,13 +344,74 @@ TSFDEF float tsf_channel_get_tuning(tsf* f, int32_t channel);
 // Grace release time for quick voice off (avoid clicking noise)
 #define TSF_FASTRELEASETIME 0.01f
 
-// Reuse voice < level
-#define TSF_REUSE_LEVEL 0.1f
+// Fade length in samples (power of 2) of a voice stolen for a new note, and how many fades can overlap
+#ifndef TSF_STEAL_FADE
+#define TSF_STEAL_FADE 128
+#endif
+#define TSF_STEAL_FADES 4
+#define TSF_STEAL_DRUM 0x80000000
+#define TSF_STEAL_HELD 0x40000000
+
+// bytes reserved for region tables and key indexes, compaction keeps the use flat over long sessions
+#ifndef TSF_REGION_ARENA
+#define TSF_REGION_ARENA (96 * 1024)
+#endif
+
+// bytes of tables the preset cache keeps before evicting, the rest of the arena is headroom for loads
+#ifndef TSF_PRESET_CACHE
+#define TSF_PRESET_CACHE (TSF_REGION_ARENA / 4 * 3)
+#endif
+
+// bytes added to the arena for SRAM copies of the first TSF_SAMPLE_CACHE_ATTACK samples of the regions of loaded
+// presets and of their loops up to TSF_SAMPLE_CACHE_LOOP samples, the voices read those instead of the font.
+// Off by default: 0 leaves the arena and the voice kernels as they were.
+#ifndef TSF_SAMPLE_CACHE
+#define TSF_SAMPLE_CACHE 0
+#endif
+#ifndef TSF_SAMPLE_CACHE_ATTACK
+#define TSF_SAMPLE_CACHE_ATTACK 128
+#endif
+#ifndef TSF_SAMPLE_CACHE_LOOP
+#define TSF_SAMPLE_CACHE_LOOP 1024
+#endif
+
+// samples per ADPCM block (power of 2): the first sample as is and the step index, then a nibble per sample,
+// so any block decodes on its own and a loop plays the same samples on every pass
+#define TSF_ADPCM_BLOCK 64
+#define TSF_ADPCM_BLOCK_BYTES (4 + TSF_ADPCM_BLOCK / 2)
 
-// execute GC every TSF_GC_F render
-#define TSF_GC_F 1024
+// key region index of a loaded preset: TSF_KEY_INDEX offsets, key k plays regions [index[k], index[k + 1])
+#define TSF_KEY_INDEX 129
 
 #define TSF_MAX_SAMPLES 2048
+#ifndef TSF_CULL_DB
+#define TSF_CULL_DB -90.0f
+#endif
+// governor thresholds in percent of the block time, recovery hold in blocks, release cull level
+#ifndef TSF_GOVERNOR_HIGH
+#define TSF_GOVERNOR_HIGH 85
+#endif
+#ifndef TSF_GOVERNOR_LOW
+#define TSF_GOVERNOR_LOW 60
+#endif
+#ifndef TSF_GOVERNOR_HOLD
+#define TSF_GOVERNOR_HOLD 32
+#endif
+#ifndef TSF_GOVERNOR_CULL_DB
+#define TSF_GOVERNOR_CULL_DB -60.0f
+#endif
+// reverb tail level (16-bit output LSB, -72dB) it is skipped under once its send was silent over a comb buffer,
+// rounding keeps the combs cycling a few LSB over zero and never lets the tail die out on its own
+#ifndef TSF_REVERB_FLOOR
+#define TSF_REVERB_FLOOR 8
+#endif
+
+// Voices are chained per channel key and per exclusive class with 8-bit indices
+#define TSF_VOICE_NONE 0xFF
+#define TSF_MAX_VOICES 255
+
+// Number of exclusive class chains per channel (power of 2)
+#define TSF_GROUP_SLOTS 8
 
 //#define TSF_MEM_PROF // quick and dirty memory profile
 
@@ -288,10 +458,11 @@ void prof_free(void *ptr) {
 #endif
 #endif
 
-#if !defined(TSF_MEMCPY) || !defined(TSF_MEMSET)
+#if !defined(TSF_MEMCPY) || !defined(TSF_MEMSET) || !defined(TSF_MEMMOVE)
 #include <string.h>
 #define TSF_MEMCPY  memcpy
 #define TSF_MEMSET  memset
+#define TSF_MEMMOVE memmove
 #endif
 
 #if !defined(TSF_FILE) || !defined(TSF_MMAP)
@@ -319,12 +490,12 @@ void prof_free(void *ptr) {
 #define TSF_SQRTF   sqrtf
 #endif
 
-#if !defined(TSF_MUTEX_TYPEDEF) || !defined(TSF_MUTEX_INIT) || !defined(TSF_MUTEX_DEINIT) || !defined(TSF_MUTEX_LOCK) || !defined(TSF_MUTEX_UNLOCK)
-#define TSF_MUTEX_TYPEDEF uint32_t
-#define TSF_MUTEX_INIT 0
-#define TSF_MUTEX_DEINIT
-#define TSF_MUTEX_LOCK
-#define TSF_MUTEX_UNLOCK
+// Holds off whatever renders and plays notes (the audio and MIDI interrupts or tasks) while the preset loader
+// evicts, compacts or publishes a preset, and the other side while the render or a note changes the voice and fade
+// lists, must nest. Empty by default, for notes, loads and the render all running in one thread.
+#if !defined(TSF_CRITICAL_ENTER) || !defined(TSF_CRITICAL_EXIT)
+#define TSF_CRITICAL_ENTER()
+#define TSF_CRITICAL_EXIT()
 #endif
 
 #ifndef TSF_NO_STDIO
@@ -335,6 +506,7 @@ void prof_free(void *ptr) {
 #define TSF_FALSE 0
 #define TSF_BOOL char
 #define TSF_PI 3.14159265358979323846264338327950288
+#define TSF_LOG2E 1.44269504088896340736f
 #define TSF_NULL 0
 
 #ifdef __cplusplus
@@ -505,14 +677,36 @@ struct tsf_hydra
 struct tsf
 {
 	struct tsf_preset* presets;
+	// bank/program hash of preset index + 1, presetHashMask + 1 slots
+	uint16_t* presetHash;
+	uint32_t presetHashMask;
 	struct tsf_stream* stream;
 	struct tsf_hydra hydra;
+	// whole font when the stream can be mapped, TSF_NULL to read the hydra through the stream
+	const uint8_t* hydraBase;
+	// pdta list the image hash covers, region tables of the image the presets were loaded from
+	uint32_t pdtaPos, pdtaSize;
+	const uint8_t* imageTables;
+	TSF_BOOL imageLoaded;
+	// shared region tables by instrument
+	struct tsf_instrument* instruments;
+	int32_t instrumentNum;
 	int16_t* fontSamples;
 	uint32_t fontSamplesOffset;
 	uint32_t fontSampleCount;
+	// ADPCM sample pool of a native font instead of fontSamples, decoded through a window per voice then per fade
+	const uint8_t* fontAdpcm;
+	struct tsf_adpcm_window* windows;
 	struct tsf_voice* voices;
+	struct tsf_voice_cold* voicesCold;
 	struct tsf_channels* channels;
 
+	// compact index lists of the playing and of the idle voices (voiceFree points into the voiceActive allocation)
+	uint16_t* voiceActive;
+	uint16_t* voiceFree;
+	int32_t voiceActiveNum;
+	int32_t voiceFreeNum;
+
 	int32_t presetNum;
 	int32_t voiceNum;
 	int32_t voicesMax;
@@ -522,8 +716,30 @@ struct tsf
 	enum TSFOutputMode outputmode;
 	float outSampleRate;
 	float globalGainDB;
-
-	uint16_t gc;
+	float cullGain;
+
+	// CPU load governor
+	uint32_t (*govCycles)(void);
+	uint32_t govCyclesPerSample;
+	int32_t govLevel, govLoad, govCalm, govVoiceCap;
+
+	// TSF_STEAL_FADES slots, stolen voices fading out
+	struct tsf_voice_fade* fades;
+	int32_t fadeNum;
+
+	// effect sends the voices wrote (TSFEffect bits) and over how many samples, to clear before the next render,
+	// samples each effect went without a send (and for the reverb with its tail under the floor), effects last run
+	int32_t fxSent, fxSentSamples, fxActive;
+	uint32_t chorusQuiet, reverbQuiet;
+
+	TSF_BOOL presetDeferred;
+	uint8_t* arena;
+	uint32_t arenaSize, arenaUsed, arenaHoles, arenaFailures;
+	// a failed load (needing cacheNeed bytes) or holes wait for the next collection
+	TSF_BOOL cacheReclaim;
+	uint32_t cacheNeed, cacheBudget, cacheClock, cacheHits, cacheMisses, cacheEvictions;
+	// arena bytes of the sample spans, samples read inside and outside of them
+	uint32_t sampleCacheBudget, sampleCacheUsed, sampleCacheTally[2];
 #ifndef TSF_NO_REVERB
 	reverb_t rev;
 #endif
@@ -542,7 +758,13 @@ static int32_t tsf_stream_stdio_read(TSF_FILE* f, void* ptr, uint32_t size) { re
 static int32_t tsf_stream_stdio_skip(TSF_FILE* f, uint32_t count) { return !TSF_FSEEK(f, count, SEEK_CUR); }
 static int32_t tsf_stream_stdio_tell(TSF_FILE* f, uint32_t count) { return TSF_FTELL(f); }
 static int32_t tsf_stream_stdio_seek(TSF_FILE* f, uint32_t count) { return TSF_FSEEK(f, count, SEEK_SET); }
+static const void* tsf_stream_stdio_map(TSF_FILE* f, uint32_t size) { const void* p = TSF_MMAP(0, size, f); return (p == (const void*)-1 ? TSF_NULL : p); }
 TSFDEF tsf* tsf_load_filename(const char* filename)
+{
+	return tsf_load_filename_image(filename, TSF_NULL, 0);
+}
+
+TSFDEF tsf* tsf_load_filename_image(const char* filename, const void* image, int32_t image_size)
 {
 	tsf* res;
 	struct tsf_stream *stream = (struct tsf_stream *)TSF_MALLOC(sizeof(struct tsf_stream));
@@ -550,6 +772,7 @@ TSFDEF tsf* tsf_load_filename(const char* filename)
 	stream->skip = (int32_t(*)(void*, uint32_t))&tsf_stream_stdio_skip;
 	stream->tell = (int32_t(*)(void *))&tsf_stream_stdio_tell;
 	stream->seek = (int32_t(*)(void*, uint32_t))&tsf_stream_stdio_seek;
+	stream->map = (const void*(*)(void*, uint32_t))&tsf_stream_stdio_map;
 
 	TSF_FILE* f = TSF_FOPEN(filename, "rb");
 	if (!f)
@@ -558,7 +781,7 @@ TSFDEF tsf* tsf_load_filename(const char* filename)
 		return TSF_NULL;
 	}
 	stream->data = f;
-	res = tsf_load(stream);
+	res = tsf_load_image(stream, image, image_size);
 	//fclose(f);
 	return res;
 }
@@ -598,27 +821,82 @@ static void tsf_hydra_read_igen(struct tsf_hydra_igen* i, struct tsf_stream* str
 static void tsf_hydra_read_shdr(struct tsf_hydra_shdr* i, struct tsf_stream* stream) { TSFR(sampleName) TSFR(start) TSFR(end) TSFR(startLoop) TSFR(endLoop) TSFR(sampleRate) TSFR(originalPitch) TSFR(pitchCorrection) TSFR(sampleLink) TSFR(sampleType) }
 #undef TSFR
 
+// The same records decoded in place from a mapped font (packed little-endian like the file)
+#define TSFM(FIELD) TSF_MEMCPY(&i->FIELD, p, sizeof(i->FIELD)); p += sizeof(i->FIELD);
+static void tsf_hydra_map_phdr(struct tsf_hydra_phdr* i, const uint8_t* p) { TSFM(presetName) TSFM(preset) TSFM(bank) TSFM(presetBagNdx) TSFM(library) TSFM(genre) TSFM(morphology) }
+static void tsf_hydra_map_pbag(struct tsf_hydra_pbag* i, const uint8_t* p) { TSFM(genNdx) TSFM(modNdx) }
+static void tsf_hydra_map_pgen(struct tsf_hydra_pgen* i, const uint8_t* p) { TSFM(genOper) TSFM(genAmount) }
+static void tsf_hydra_map_inst(struct tsf_hydra_inst* i, const uint8_t* p) { TSFM(instName) TSFM(instBagNdx) }
+static void tsf_hydra_map_ibag(struct tsf_hydra_ibag* i, const uint8_t* p) { TSFM(instGenNdx) TSFM(instModNdx) }
+static void tsf_hydra_map_igen(struct tsf_hydra_igen* i, const uint8_t* p) { TSFM(genOper) TSFM(genAmount) }
+static void tsf_hydra_map_shdr(struct tsf_hydra_shdr* i, const uint8_t* p) { TSFM(sampleName) TSFM(start) TSFM(end) TSFM(startLoop) TSFM(endLoop) TSFM(sampleRate) TSFM(originalPitch) TSFM(pitchCorrection) TSFM(sampleLink) TSFM(sampleType) }
+#undef TSFM
+
+// Fetch hydra record 'idx' of a chunk, in place from the mapped font or through the stream as fallback
+#define TSFG(chunkName) \
+	static void tsf_hydra_get_##chunkName(tsf* f, struct tsf_hydra_##chunkName* i, int32_t idx) \
+	{ \
+		uint32_t pos = f->hydra.chunkName##Pos + idx * chunkName##SizeInFile; \
+		if (f->hydraBase) { tsf_hydra_map_##chunkName(i, f->hydraBase + pos); return; } \
+		f->stream->seek(f->stream->data, pos); \
+		tsf_hydra_read_##chunkName(i, f->stream); \
+	}
+TSFG(phdr) TSFG(pbag) TSFG(pgen) TSFG(inst) TSFG(ibag) TSFG(igen) TSFG(shdr)
+#undef TSFG
+
 struct tsf_riffchunk { tsf_fourcc id; tsf_u32 size; };
-struct tsf_envelope { float delay, attack, hold, decay, sustain, release, keynumToHold, keynumToDecay; };
-struct tsf_voice_envelope { float level, slope; int32_t samplesUntilNextSegment; int16_t segment, midiVelocity; struct tsf_envelope parameters; TSF_BOOL segmentIsExponential, isAmpEnv; };
+struct tsf_envelope { float delay, attack, hold, decay, sustain, release; };
+struct tsf_voice_envelope { float level, slope; int32_t samplesUntilNextSegment; int16_t segment, midiVelocity; TSF_BOOL segmentIsExponential, isAmpEnv; };
 struct tsf_voice_lowpass { float QInv; int32_t a0, a1, b1, b2; int32_t z1, z2; TSF_BOOL active; };
 struct tsf_voice_lfo { int32_t samplesUntil; float level, delta; };
 
+// envelope generators as the SF2 gives them, times in timecents and sustain in centibels (volume) or per mille (mod)
+struct tsf_region_envelope { int16_t delay, attack, hold, decay, sustain, release, keynumToHold, keynumToDecay; };
+
+// generators are kept in their SF2 units, exact as int16, and converted when a voice starts:
+// attenuation in centibels, pan in per mille, LFO delays in timecents
 struct tsf_region
 {
-	int16_t loop_mode;
 	uint32_t sample_rate;
+	uint32_t offset, end, loop_start, loop_end;
 	uint8_t lokey, hikey, lovel, hivel;
-	uint32_t group, offset, end, loop_start, loop_end;
+	uint16_t group;
+	int16_t loop_mode;
 	int16_t transpose, tune, pitch_keycenter, pitch_keytrack;
-	float attenuation, pan;
-	struct tsf_envelope ampenv, modenv;
+	int16_t attenuation, pan;
+	struct tsf_region_envelope ampenv, modenv;
 	int16_t initialFilterQ, initialFilterFc;
 	int16_t modEnvToPitch, modEnvToFilterFc, modLfoToFilterFc, modLfoToVolume;
-	float delayModLFO;
-	int16_t freqModLFO, modLfoToPitch;
-	float delayVibLFO;
-	int16_t freqVibLFO, vibLfoToPitch;
+	int16_t delayModLFO, freqModLFO, modLfoToPitch;
+	int16_t delayVibLFO, freqVibLFO, vibLfoToPitch;
+};
+
+#define TSF_REF_PRIVATE 0xFFFF
+
+// what a preset plays of a region: the table it is in, shared by instrument or the preset's own, and its ranges in this preset
+struct tsf_region_ref
+{
+	uint16_t table, region; // instrument index or TSF_REF_PRIVATE, region in that table
+	uint8_t lokey, hikey, lovel, hivel;
+};
+
+// SRAM copy of the font samples [start, end], a voice at a position in [start, end) reads them with its
+// interpolation partner from data bytes after the span; start == end caches nothing
+struct tsf_sample_span
+{
+	uint32_t start, end, data;
+};
+
+// zones of an instrument resolved under a preset zone without generators, one table for every preset playing them so.
+// Only such neutral preset zones share it: a preset zone with any generator beyond its ranges is resolved into the
+// own regions of its preset, as the merge clamps and converts timecents and is not kept as a delta for the note-on.
+struct tsf_instrument
+{
+	struct tsf_region* regions;
+	struct tsf_sample_span* spans; // attack then loop span by region, TSF_NULL when nothing is cached
+	uint16_t regionNum;
+	uint16_t refCount; // refs of the loaded presets into the table, bounded by what the arena holds
+	uint32_t imageTable; // offset in the image tables
 };
 
 struct tsf_preset
@@ -627,33 +905,72 @@ struct tsf_preset
 	tsf_char20 presetName;
 #endif
 	tsf_u16 preset, bank;
-	struct tsf_region* regions;
-	int32_t regionNum;
+	struct tsf_region_ref* refs;
+	struct tsf_region* regions; // its own regions, under preset zones with generators
+	struct tsf_sample_span* spans; // of its own regions as for an instrument
+	uint16_t* keyIndex; // offsets by key then ref numbers in load order, TSF_NULL scans all refs
+	int32_t regionNum, privateNum; // refs, own regions
 	int32_t pphdrIdx;
+	uint32_t imageTables; // offset of its refs then own regions in the image tables
 	TSF_BOOL loaded;
-	uint16_t refCount;
+	uint16_t refCount; // voices and channels holding it while the cache evicts
+	uint32_t lastUse;
 };
 
+// what tsf_voice_render reads every block
 struct tsf_voice
 {
-	int32_t playingPreset, playingKey, playingChannel;
+	int32_t playingPreset, playingChannel;
 	struct tsf_region* region;
+	const struct tsf_sample_span* spans; // attack and loop span of the region, TSF_NULL streams it all from the font
 	float pitchInputTimecents, pitchOutputFactor;
 	uint64_t sourceSamplePosition;
 	float  noteGainDB, panFactorLeft, panFactorRight;
-	uint32_t playIndex, loopStart, loopEnd;
-	uint8_t locked;
-	TSF_MUTEX_TYPEDEF mutex;
+	uint32_t loopStart, loopEnd;
 	struct tsf_voice_envelope ampenv, modenv;
 	struct tsf_voice_lowpass lowpass;
 	struct tsf_voice_lfo modlfo, viblfo;
 };
 
+// bookkeeping and envelope parameters, parallel to tsf::voices and only read on events and segment changes
+struct tsf_voice_cold
+{
+	int32_t playingKey;
+	uint32_t playIndex;
+	// steal priority refreshed every render block, the lowest is taken first (see tsf_voice_stealscore)
+	uint32_t stealScore;
+	uint16_t activeIdx;
+	uint8_t keyNext, groupNext;
+	struct tsf_envelope ampenv, modenv;
+};
+
+// decoded ADPCM block [base, base + TSF_ADPCM_BLOCK] including the first sample of the next block for the
+// interpolation, and after it the loop start sample a loop wraps to
+struct tsf_adpcm_window
+{
+	uint32_t base;
+	int16_t samples[TSF_ADPCM_BLOCK + 2];
+};
+#define TSF_ADPCM_NOBASE ((uint32_t)-TSF_ADPCM_BLOCK) // no position is inside, pos - base >= TSF_ADPCM_BLOCK
+
+// what is left of a stolen voice, faded out over TSF_STEAL_FADE samples while its slot plays the new note
+struct tsf_voice_fade
+{
+	uint64_t position, phaseIncr, sampleEndDbl, loopEndDbl, loopLengthDbl;
+	uint32_t loopStart, loopEnd;
+	int32_t gainLeft, gainRight, remain;
+	struct tsf_voice_lowpass lowpass;
+};
+
 struct tsf_channel
 {
 	uint16_t presetIndex, bank, pitchWheel, midiPan, midiVolume, midiExpression, midiRPN, midiData;
 	float reverb, chorus;
 	float panOffset, gainDB, pitchRange, tuning;
+	// heads of the voice chains playing each key and each exclusive class slot
+	uint8_t keyVoice[128];
+	uint8_t groupVoice[TSF_GROUP_SLOTS];
+	uint8_t voiceCount;
 };
 
 struct tsf_channels
@@ -663,9 +980,86 @@ struct tsf_channels
 	int32_t channelNum, activeChannel;
 };
 
-static float tsf_timecents2Secsf(float timecents) { return TSF_POWF(2.0f, timecents / 1200.0f); }
-static float tsf_cents2Hertz(float cents) { return 8.176f * TSF_POWF(2.0f, cents / 1200.0f); }
-static float tsf_decibelsToGain(float db) { return (db > -100.f ? TSF_POWF(10.0f, db * 0.05f) : 0); }
+#ifndef TSF_NO_MATH_TABLES
+// 2^(i/128), linearly interpolated: relative error below 5e-6 (0.009 cents, 0.00005 dB)
+static const float tsf_exp2_table[129] = {
+	1.000000000f, 1.005429901f, 1.010889286f, 1.016378315f, 1.021897149f, 1.027445949f, 1.033024879f, 1.038634102f,
+	1.044273782f, 1.049944086f, 1.055645178f, 1.061377227f, 1.067140401f, 1.072934868f, 1.078760798f, 1.084618362f,
+	1.090507733f, 1.096429082f, 1.102382583f, 1.108368412f, 1.114386743f, 1.120437752f, 1.126521619f, 1.132638520f,
+	1.138788635f, 1.144972144f, 1.151189230f, 1.157440074f, 1.163724859f, 1.170043770f, 1.176396992f, 1.182784711f,
+	1.189207115f, 1.195664392f, 1.202156731f, 1.208684324f, 1.215247360f, 1.221846033f, 1.228480536f, 1.235151064f,
+	1.241857812f, 1.248600977f, 1.255380757f, 1.262197350f, 1.269050957f, 1.275941778f, 1.282870016f, 1.289835873f,
+	1.296839555f, 1.303881265f, 1.310961212f, 1.318079601f, 1.325236643f, 1.332432547f, 1.339667524f, 1.346941786f,
+	1.354255547f, 1.361609021f, 1.369002423f, 1.376435971f, 1.383909882f, 1.391424376f, 1.398979673f, 1.406575994f,
+	1.414213562f, 1.421892602f, 1.429613338f, 1.437375997f, 1.445180807f, 1.453027996f, 1.460917794f, 1.468850433f,
+	1.476826146f, 1.484845166f, 1.492907728f, 1.501014070f, 1.509164428f, 1.517359041f, 1.525598151f, 1.533881998f,
+	1.542210825f, 1.550584878f, 1.559004400f, 1.567469640f, 1.575980845f, 1.584538265f, 1.593142151f, 1.601792756f,
+	1.610490332f, 1.619235135f, 1.628027422f, 1.636867450f, 1.645755478f, 1.654691768f, 1.663676580f, 1.672710180f,
+	1.681792831f, 1.690924799f, 1.700106354f, 1.709337763f, 1.718619298f, 1.727951231f, 1.737333835f, 1.746767386f,
+	1.756252160f, 1.765788436f, 1.775376493f, 1.785016611f, 1.794709075f, 1.804454168f, 1.814252176f, 1.824103385f,
+	1.834008086f, 1.843966569f, 1.853979125f, 1.864046048f, 1.874167634f, 1.884344179f, 1.894575982f, 1.904863342f,
+	1.915206561f, 1.925605944f, 1.936061793f, 1.946574418f, 1.957144124f, 1.967771223f, 1.978456026f, 1.989198847f,
+	2.000000000f,
+};
+
+// sin(i*pi/256) over a quarter wave, linearly interpolated: relative error below 2e-5
+static const float tsf_sin_table[129] = {
+	0.000000000f, 0.012271538f, 0.024541229f, 0.036807223f, 0.049067674f, 0.061320736f, 0.073564564f, 0.085797312f,
+	0.098017140f, 0.110222207f, 0.122410675f, 0.134580709f, 0.146730474f, 0.158858143f, 0.170961889f, 0.183039888f,
+	0.195090322f, 0.207111376f, 0.219101240f, 0.231058108f, 0.242980180f, 0.254865660f, 0.266712757f, 0.278519689f,
+	0.290284677f, 0.302005949f, 0.313681740f, 0.325310292f, 0.336889853f, 0.348418680f, 0.359895037f, 0.371317194f,
+	0.382683432f, 0.393992040f, 0.405241314f, 0.416429560f, 0.427555093f, 0.438616239f, 0.449611330f, 0.460538711f,
+	0.471396737f, 0.482183772f, 0.492898192f, 0.503538384f, 0.514102744f, 0.524589683f, 0.534997620f, 0.545324988f,
+	0.555570233f, 0.565731811f, 0.575808191f, 0.585797857f, 0.595699304f, 0.605511041f, 0.615231591f, 0.624859488f,
+	0.634393284f, 0.643831543f, 0.653172843f, 0.662415778f, 0.671558955f, 0.680600998f, 0.689540545f, 0.698376249f,
+	0.707106781f, 0.715730825f, 0.724247083f, 0.732654272f, 0.740951125f, 0.749136395f, 0.757208847f, 0.765167266f,
+	0.773010453f, 0.780737229f, 0.788346428f, 0.795836905f, 0.803207531f, 0.810457198f, 0.817584813f, 0.824589303f,
+	0.831469612f, 0.838224706f, 0.844853565f, 0.851355193f, 0.857728610f, 0.863972856f, 0.870086991f, 0.876070094f,
+	0.881921264f, 0.887639620f, 0.893224301f, 0.898674466f, 0.903989293f, 0.909167983f, 0.914209756f, 0.919113852f,
+	0.923879533f, 0.928506080f, 0.932992799f, 0.937339012f, 0.941544065f, 0.945607325f, 0.949528181f, 0.953306040f,
+	0.956940336f, 0.960430519f, 0.963776066f, 0.966976471f, 0.970031253f, 0.972939952f, 0.975702130f, 0.978317371f,
+	0.980785280f, 0.983105487f, 0.985277642f, 0.987301418f, 0.989176510f, 0.990902635f, 0.992479535f, 0.993906970f,
+	0.995184727f, 0.996312612f, 0.997290457f, 0.998118113f, 0.998795456f, 0.999322385f, 0.999698819f, 0.999924702f,
+	1.000000000f,
+};
+
+static float tsf_exp2f(float x)
+{
+	union { float f; uint32_t i; } scale;
+	int32_t n = (int32_t)x, i;
+	float t;
+	if ((float)n > x) n--;
+	if (n < -126) return 0.0f;
+	if (n > 127) n = 127;
+	t = (x - n) * 128.0f;
+	i = (int32_t)t;
+	if (i > 127) i = 127;
+	t -= i;
+	scale.i = (uint32_t)(n + 127) << 23;
+	return (tsf_exp2_table[i] + (tsf_exp2_table[i + 1] - tsf_exp2_table[i]) * t) * scale.f;
+}
+
+// sin(pi*x) for x in [0, 0.5]
+static float tsf_sinpif(float x)
+{
+	float t = x * 256.0f;
+	int32_t i = (int32_t)t;
+	if (i < 0) return 0.0f;
+	if (i > 127) i = 127;
+	t -= i;
+	return tsf_sin_table[i] + (tsf_sin_table[i + 1] - tsf_sin_table[i]) * t;
+}
+
+// tan(pi*x) for x in [0, 0.5), relative error below 4e-5
+static float tsf_tanpif(float x) { return tsf_sinpif(x) / tsf_sinpif(0.5f - x); }
+#else
+static float tsf_exp2f(float x) { return TSF_POWF(2.0f, x); }
+static float tsf_tanpif(float x) { return (float)TSF_TAN(TSF_PI * x); }
+#endif
+
+static float tsf_timecents2Secsf(float timecents) { return tsf_exp2f(timecents * (1.0f / 1200.0f)); }
+static float tsf_cents2Hertz(float cents) { return 8.176f * tsf_exp2f(cents * (1.0f / 1200.0f)); }
+static float tsf_decibelsToGain(float db) { return (db > -100.f ? tsf_exp2f(db * 0.166096404f) : 0); } // 10^(db/20) = 2^(db*log2(10)/20)
 static float tsf_gainToDecibels(float gain) { return (gain <= .00001f ? -100.f : (float)(20.0 * TSF_LOG10(gain))); }
 
 static TSF_BOOL tsf_riffchunk_read(struct tsf_riffchunk* parent, struct tsf_riffchunk* chunk, struct tsf_stream* stream)
@@ -696,21 +1090,20 @@ static void tsf_region_clear(struct tsf_region* i, TSF_BOOL for_relative)
 	i->pitch_keycenter = -1;
 
 	// SF2 defaults in timecents.
-	i->ampenv.delay = i->ampenv.attack = i->ampenv.hold = i->ampenv.decay = i->ampenv.release = -12000.0f;
-	i->modenv.delay = i->modenv.attack = i->modenv.hold = i->modenv.decay = i->modenv.release = -12000.0f;
+	i->ampenv.delay = i->ampenv.attack = i->ampenv.hold = i->ampenv.decay = i->ampenv.release = -12000;
+	i->modenv.delay = i->modenv.attack = i->modenv.hold = i->modenv.decay = i->modenv.release = -12000;
 
 	i->initialFilterFc = 13500;
 
-	i->delayModLFO = -12000.0f;
-	i->delayVibLFO = -12000.0f;
+	i->delayModLFO = -12000;
+	i->delayVibLFO = -12000;
 }
 
-static void tsf_region_operator(struct tsf_region* region, tsf_u16 genOper, union tsf_hydra_genamount* amount, struct tsf_region* merge_region)
+static void tsf_region_operator(struct tsf_region* region, tsf_u16 genOper, union tsf_hydra_genamount* amount, const struct tsf_region* merge_region)
 {
 	enum
 	{
 		_GEN_TYPE_MASK       = 0x0F,
-		GEN_FLOAT            = 0x01,
 		GEN_INT              = 0x02,
 		GEN_UINT_ADD         = 0x03,
 		GEN_UINT_ADD15       = 0x04,
@@ -726,13 +1119,13 @@ static void tsf_region_operator(struct tsf_region* region, tsf_u16 genOper, unio
 		GEN_INT_LIMITQ       = 0x30, //min 0, max 960
 		GEN_INT_LIMIT960     = 0x40, //min -960, max 960
 		GEN_INT_LIMIT16K4500 = 0x50, //min -16000, max 4500
-		GEN_FLOAT_LIMIT12K5K = 0x60, //min -12000, max 5000
-		GEN_FLOAT_LIMIT12K8K = 0x70, //min -12000, max 8000
-		GEN_FLOAT_LIMIT1200  = 0x80, //min -1200, max 1200
-		GEN_FLOAT_LIMITPAN   = 0x90, //* .001f, min -.5f, max .5f,
-		GEN_FLOAT_LIMITATTN  = 0xA0, //* .1f, min 0, max 144.0
-		GEN_FLOAT_MAX1000    = 0xB0, //min 0, max 1000
-		GEN_FLOAT_MAX1440    = 0xC0, //min 0, max 1440
+		GEN_INT_LIMIT12K5K   = 0x60, //min -12000, max 5000
+		GEN_INT_LIMIT12K8K   = 0x70, //min -12000, max 8000
+		GEN_INT_LIMIT1200    = 0x80, //min -1200, max 1200
+		GEN_INT_LIMITPAN     = 0x90, //min -500, max 500 (per mille)
+		GEN_INT_LIMITATTN    = 0xA0, //min 0, max 1440 (centibels)
+		GEN_INT_MAX1000      = 0xB0, //min 0, max 1000
+		GEN_INT_MAX1440      = 0xC0, //min 0, max 1440
 
 		_GEN_MAX = 59,
 	};
@@ -757,30 +1150,30 @@ static void tsf_region_operator(struct tsf_region* region, tsf_u16 genOper, unio
 		{ 0                                , (0                                                  ) }, //   Unused
 		{ 0                                , (0                                                  ) }, //15 ChorusEffectsSend (unsupported)
 		{ 0                                , (0                                                  ) }, //16 ReverbEffectsSend (unsupported)
-		{ GEN_FLOAT | GEN_FLOAT_LIMITPAN   , _TSFREGIONOFFSET(       float, pan                  ) }, //17 Pan
+		{ GEN_INT   | GEN_INT_LIMITPAN     , _TSFREGIONOFFSET(         int16_t, pan                  ) }, //17 Pan
 		{ 0                                , (0                                                  ) }, //   Unused
 		{ 0                                , (0                                                  ) }, //   Unused
 		{ 0                                , (0                                                  ) }, //   Unused
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT12K5K , _TSFREGIONOFFSET(       float, delayModLFO          ) }, //21 DelayModLFO
+		{ GEN_INT   | GEN_INT_LIMIT12K5K   , _TSFREGIONOFFSET(         int16_t, delayModLFO          ) }, //21 DelayModLFO
 		{ GEN_INT   | GEN_INT_LIMIT16K4500 , _TSFREGIONOFFSET(         int16_t, freqModLFO           ) }, //22 FreqModLFO
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT12K5K , _TSFREGIONOFFSET(       float, delayVibLFO          ) }, //23 DelayVibLFO
+		{ GEN_INT   | GEN_INT_LIMIT12K5K   , _TSFREGIONOFFSET(         int16_t, delayVibLFO          ) }, //23 DelayVibLFO
 		{ GEN_INT   | GEN_INT_LIMIT16K4500 , _TSFREGIONOFFSET(         int16_t, freqVibLFO           ) }, //24 FreqVibLFO
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT12K5K , _TSFREGIONENVOFFSET(    float, modenv, delay        ) }, //25 DelayModEnv
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT12K8K , _TSFREGIONENVOFFSET(    float, modenv, attack       ) }, //26 AttackModEnv
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT12K5K , _TSFREGIONENVOFFSET(    float, modenv, hold         ) }, //27 HoldModEnv
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT12K8K , _TSFREGIONENVOFFSET(    float, modenv, decay        ) }, //28 DecayModEnv
-		{ GEN_FLOAT | GEN_FLOAT_MAX1000    , _TSFREGIONENVOFFSET(    float, modenv, sustain      ) }, //29 SustainModEnv
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT12K8K , _TSFREGIONENVOFFSET(    float, modenv, release      ) }, //30 ReleaseModEnv
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT1200  , _TSFREGIONENVOFFSET(    float, modenv, keynumToHold ) }, //31 KeynumToModEnvHold
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT1200  , _TSFREGIONENVOFFSET(    float, modenv, keynumToDecay) }, //32 KeynumToModEnvDecay
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT12K5K , _TSFREGIONENVOFFSET(    float, ampenv, delay        ) }, //33 DelayVolEnv
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT12K8K , _TSFREGIONENVOFFSET(    float, ampenv, attack       ) }, //34 AttackVolEnv
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT12K5K , _TSFREGIONENVOFFSET(    float, ampenv, hold         ) }, //35 HoldVolEnv
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT12K8K , _TSFREGIONENVOFFSET(    float, ampenv, decay        ) }, //36 DecayVolEnv
-		{ GEN_FLOAT | GEN_FLOAT_MAX1440    , _TSFREGIONENVOFFSET(    float, ampenv, sustain      ) }, //37 SustainVolEnv
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT12K8K , _TSFREGIONENVOFFSET(    float, ampenv, release      ) }, //38 ReleaseVolEnv
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT1200  , _TSFREGIONENVOFFSET(    float, ampenv, keynumToHold ) }, //39 KeynumToVolEnvHold
-		{ GEN_FLOAT | GEN_FLOAT_LIMIT1200  , _TSFREGIONENVOFFSET(    float, ampenv, keynumToDecay) }, //40 KeynumToVolEnvDecay
+		{ GEN_INT   | GEN_INT_LIMIT12K5K   , _TSFREGIONENVOFFSET(  int16_t, modenv, delay        ) }, //25 DelayModEnv
+		{ GEN_INT   | GEN_INT_LIMIT12K8K   , _TSFREGIONENVOFFSET(  int16_t, modenv, attack       ) }, //26 AttackModEnv
+		{ GEN_INT   | GEN_INT_LIMIT12K5K   , _TSFREGIONENVOFFSET(  int16_t, modenv, hold         ) }, //27 HoldModEnv
+		{ GEN_INT   | GEN_INT_LIMIT12K8K   , _TSFREGIONENVOFFSET(  int16_t, modenv, decay        ) }, //28 DecayModEnv
+		{ GEN_INT   | GEN_INT_MAX1000      , _TSFREGIONENVOFFSET(  int16_t, modenv, sustain      ) }, //29 SustainModEnv
+		{ GEN_INT   | GEN_INT_LIMIT12K8K   , _TSFREGIONENVOFFSET(  int16_t, modenv, release      ) }, //30 ReleaseModEnv
+		{ GEN_INT   | GEN_INT_LIMIT1200    , _TSFREGIONENVOFFSET(  int16_t, modenv, keynumToHold ) }, //31 KeynumToModEnvHold
+		{ GEN_INT   | GEN_INT_LIMIT1200    , _TSFREGIONENVOFFSET(  int16_t, modenv, keynumToDecay) }, //32 KeynumToModEnvDecay
+		{ GEN_INT   | GEN_INT_LIMIT12K5K   , _TSFREGIONENVOFFSET(  int16_t, ampenv, delay        ) }, //33 DelayVolEnv
+		{ GEN_INT   | GEN_INT_LIMIT12K8K   , _TSFREGIONENVOFFSET(  int16_t, ampenv, attack       ) }, //34 AttackVolEnv
+		{ GEN_INT   | GEN_INT_LIMIT12K5K   , _TSFREGIONENVOFFSET(  int16_t, ampenv, hold         ) }, //35 HoldVolEnv
+		{ GEN_INT   | GEN_INT_LIMIT12K8K   , _TSFREGIONENVOFFSET(  int16_t, ampenv, decay        ) }, //36 DecayVolEnv
+		{ GEN_INT   | GEN_INT_MAX1440      , _TSFREGIONENVOFFSET(  int16_t, ampenv, sustain      ) }, //37 SustainVolEnv
+		{ GEN_INT   | GEN_INT_LIMIT12K8K   , _TSFREGIONENVOFFSET(  int16_t, ampenv, release      ) }, //38 ReleaseVolEnv
+		{ GEN_INT   | GEN_INT_LIMIT1200    , _TSFREGIONENVOFFSET(  int16_t, ampenv, keynumToHold ) }, //39 KeynumToVolEnvHold
+		{ GEN_INT   | GEN_INT_LIMIT1200    , _TSFREGIONENVOFFSET(  int16_t, ampenv, keynumToDecay) }, //40 KeynumToVolEnvDecay
 		{ 0                                , (0                                                  ) }, //   Instrument (special)
 		{ 0                                , (0                                                  ) }, //   Reserved
 		{ GEN_KEYRANGE                     , (0                                                  ) }, //43 KeyRange
@@ -788,7 +1181,7 @@ static void tsf_region_operator(struct tsf_region* region, tsf_u16 genOper, unio
 		{ GEN_UINT_ADD15                   , _TSFREGIONOFFSET(uint32_t, loop_start           ) }, //45 StartloopAddrsCoarseOffset
 		{ 0                                , (0                                                  ) }, //46 Keynum (special)
 		{ 0                                , (0                                                  ) }, //47 Velocity (special)
-		{ GEN_FLOAT | GEN_FLOAT_LIMITATTN  , _TSFREGIONOFFSET(       float, attenuation          ) }, //48 InitialAttenuation
+		{ GEN_INT   | GEN_INT_LIMITATTN    , _TSFREGIONOFFSET(         int16_t, attenuation          ) }, //48 InitialAttenuation
 		{ 0                                , (0                                                  ) }, //   Reserved
 		{ GEN_UINT_ADD15                   , _TSFREGIONOFFSET(uint32_t, loop_end             ) }, //50 EndloopAddrsCoarseOffset
 		{ GEN_INT                          , _TSFREGIONOFFSET(         int16_t, transpose            ) }, //51 CoarseTune
@@ -797,7 +1190,7 @@ static void tsf_region_operator(struct tsf_region* region, tsf_u16 genOper, unio
 		{ GEN_LOOPMODE                     , _TSFREGIONOFFSET(         int16_t, loop_mode            ) }, //54 SampleModes
 		{ 0                                , (0                                                  ) }, //   Reserved
 		{ GEN_INT                          , _TSFREGIONOFFSET(         int16_t, pitch_keytrack       ) }, //56 ScaleTuning
-		{ GEN_GROUP                        , _TSFREGIONOFFSET(uint32_t, group                ) }, //57 ExclusiveClass
+		{ GEN_GROUP                        , _TSFREGIONOFFSET(uint16_t, group                ) }, //57 ExclusiveClass
 		{ GEN_KEYCENTER                    , _TSFREGIONOFFSET(         int16_t, pitch_keycenter      ) }, //58 OverridingRootKey
 	};
 #undef _TSFREGIONOFFSET
@@ -809,7 +1202,6 @@ static void tsf_region_operator(struct tsf_region* region, tsf_u16 genOper, unio
 		offset = genMetas[genOper].offset;
 		switch (genMetas[genOper].mode & _GEN_TYPE_MASK)
 		{
-		case GEN_FLOAT:      ((       float*)region)[offset]  = amount->shortAmount;     return;
 		case GEN_INT:        ((         int16_t*)region)[offset]  = amount->shortAmount;     return;
 		case GEN_UINT_ADD:   ((uint32_t*)region)[offset] += amount->shortAmount;     return;
 		case GEN_UINT_ADD15: ((uint32_t*)region)[offset] += amount->shortAmount << 15; return;
@@ -827,30 +1219,10 @@ static void tsf_region_operator(struct tsf_region* region, tsf_u16 genOper, unio
 			int32_t offset = genMetas[genOper].offset;
 			switch (genMetas[genOper].mode & _GEN_TYPE_MASK)
 			{
-			case GEN_FLOAT:
-			{
-				float *val = &((float*)region)[offset], vfactor, vmin, vmax;
-				*val += ((float*)merge_region)[offset];
-				switch (genMetas[genOper].mode & _GEN_LIMIT_MASK)
-				{
-				case GEN_FLOAT_LIMIT12K5K: vfactor =   1.0f; vmin = -12000.0f; vmax = 5000.0f; break;
-				case GEN_FLOAT_LIMIT12K8K: vfactor =   1.0f; vmin = -12000.0f; vmax = 8000.0f; break;
-				case GEN_FLOAT_LIMIT1200:  vfactor =   1.0f; vmin =  -1200.0f; vmax = 1200.0f; break;
-				case GEN_FLOAT_LIMITPAN:   vfactor = 0.001f; vmin =     -0.5f; vmax =    0.5f; break;
-				case GEN_FLOAT_LIMITATTN:  vfactor =   0.1f; vmin =      0.0f; vmax =  144.0f; break;
-				case GEN_FLOAT_MAX1000:    vfactor =   1.0f; vmin =      0.0f; vmax = 1000.0f; break;
-				case GEN_FLOAT_MAX1440:    vfactor =   1.0f; vmin =      0.0f; vmax = 1440.0f; break;
-				default: continue;
-				}
-				*val *= vfactor;
-				if      (*val < vmin) *val = vmin;
-				else if (*val > vmax) *val = vmax;
-				continue;
-			}
 			case GEN_INT:
 			{
-				short *val = &((int16_t*)region)[offset], vmin, vmax;
-				*val += ((int16_t*)merge_region)[offset];
+				int16_t *val = &((int16_t*)region)[offset];
+				int32_t sum = *val + ((const int16_t*)merge_region)[offset], vmin, vmax;
 				switch (genMetas[genOper].mode & _GEN_LIMIT_MASK)
 				{
 				case GEN_INT_LIMIT12K:     vmin = -12000; vmax = 12000; break;
@@ -858,15 +1230,21 @@ static void tsf_region_operator(struct tsf_region* region, tsf_u16 genOper, unio
 				case GEN_INT_LIMITQ:       vmin =      0; vmax =   960; break;
 				case GEN_INT_LIMIT960:     vmin =   -960; vmax =   960; break;
 				case GEN_INT_LIMIT16K4500: vmin = -16000; vmax =  4500; break;
-				default: continue;
+				case GEN_INT_LIMIT12K5K:   vmin = -12000; vmax =  5000; break;
+				case GEN_INT_LIMIT12K8K:   vmin = -12000; vmax =  8000; break;
+				case GEN_INT_LIMIT1200:    vmin =  -1200; vmax =  1200; break;
+				case GEN_INT_LIMITPAN:     vmin =   -500; vmax =   500; break;
+				case GEN_INT_LIMITATTN:    vmin =      0; vmax =  1440; break;
+				case GEN_INT_MAX1000:      vmin =      0; vmax =  1000; break;
+				case GEN_INT_MAX1440:      vmin =      0; vmax =  1440; break;
+				default: *val = (int16_t)sum; continue;
 				}
-				if      (*val < vmin) *val = vmin;
-				else if (*val > vmax) *val = vmax;
+				*val = (int16_t)(sum < vmin ? vmin : sum > vmax ? vmax : sum);
 				continue;
 			}
 			case GEN_UINT_ADD:
 			{
-				((uint32_t*)region)[offset] += ((uint32_t*)merge_region)[offset];
+				((uint32_t*)region)[offset] += ((const uint32_t*)merge_region)[offset];
 				continue;
 			}
 			}
@@ -874,180 +1252,539 @@ static void tsf_region_operator(struct tsf_region* region, tsf_u16 genOper, unio
 	}
 }
 
-static void tsf_region_envtosecs(struct tsf_envelope* p, TSF_BOOL sustainIsGain)
+// EG and LFO times are converted from timecents to seconds when a voice starts.
+// Pin very short segments.  Timecents don't get to zero, and our EG is happier with zero values.
+static float tsf_region_secs(int16_t timecents) { return (timecents < -11950 ? 0.0f : tsf_timecents2Secsf(timecents)); }
+
+// a preset zone whose generators change nothing but the ranges plays the shared table of its instrument
+static TSF_BOOL tsf_region_neutral(const struct tsf_region* presetRegion)
+{
+	struct tsf_region neutral, probe = *presetRegion;
+	const uint8_t *a = (const uint8_t*)&probe, *b = (const uint8_t*)&neutral;
+	uint32_t i;
+
+	tsf_region_clear(&neutral, TSF_TRUE);
+	probe.lokey = neutral.lokey; probe.hikey = neutral.hikey;
+	probe.lovel = neutral.lovel; probe.hivel = neutral.hivel;
+	// byte by byte, the region has no padding
+	for (i = 0; i < sizeof(struct tsf_region); i++) if (a[i] != b[i]) return TSF_FALSE;
+	return TSF_TRUE;
+}
+
+// Resolve the zones with a sample of instrument inst under the preset zone presetRegion into out, up to max of them.
+// With filter the zones outside of the preset zone ranges are skipped and the others clamped to them, as the preset
+// plays them, without it every zone keeps its own ranges for a shared table. Returns the number of zones (out may be TSF_NULL).
+static int32_t tsf_instrument_resolve(tsf* res, int32_t inst, const struct tsf_region* presetRegion, TSF_BOOL filter, struct tsf_region* out, int32_t max)
 {
-	// EG times need to be converted from timecents to seconds.
-	// Pin very short EG segments.  Timecents don't get to zero, and our EG is
-	// happier with zero values.
-	p->delay   = (p->delay   < -11950.0f ? 0.0f : tsf_timecents2Secsf(p->delay));
-	p->attack  = (p->attack  < -11950.0f ? 0.0f : tsf_timecents2Secsf(p->attack));
-	p->release = (p->release < -11950.0f ? 0.0f : tsf_timecents2Secsf(p->release));
+	enum { GenSampleID = 53 };
+	struct tsf_hydra_inst pinst, nextpinst;
+	struct tsf_region instRegion;
+	int32_t pibagIdx, num = 0;
+
+	tsf_region_clear(&instRegion, TSF_FALSE);
+	tsf_hydra_get_inst(res, &pinst, inst);
+	tsf_hydra_get_inst(res, &nextpinst, (inst + 1));
+
+	for (pibagIdx = pinst.instBagNdx; pibagIdx < nextpinst.instBagNdx; pibagIdx++)
+	{
+		struct tsf_hydra_ibag pibag, nextpibag;
+
+		tsf_hydra_get_ibag(res, &pibag, pibagIdx);
+
+		tsf_hydra_get_ibag(res, &nextpibag, (pibagIdx + 1));
 
-	// If we have dynamic hold or decay times depending on key number we need
-	// to keep the values in timecents so we can calculate it during startNote
-	if (!p->keynumToHold)  p->hold  = (p->hold  < -11950.0f ? 0.0f : tsf_timecents2Secsf(p->hold));
-	if (!p->keynumToDecay) p->decay = (p->decay < -11950.0f ? 0.0f : tsf_timecents2Secsf(p->decay));
+		// Generators.
+		struct tsf_region zoneRegion = instRegion;
+		int32_t hadSampleID = 0;
+		int32_t pigenIdx;
+		for (pigenIdx = pibag.instGenNdx; pigenIdx < nextpibag.instGenNdx; pigenIdx++)
+		{
+			struct tsf_hydra_igen pigen;
+			struct tsf_hydra_shdr pshdr;
+			struct tsf_region* region;
+
+			tsf_hydra_get_igen(res, &pigen, pigenIdx);
+
+			if (pigen.genOper != GenSampleID)
+			{
+				tsf_region_operator(&zoneRegion, pigen.genOper, &pigen.genAmount, TSF_NULL);
+				continue;
+			}
+			// a zone with a sample is never the global one, even when this preset zone does not play it
+			hadSampleID = 1;
+
+			//preset region key and vel ranges are a filter for the zone regions
+			if (filter && (zoneRegion.hikey < presetRegion->lokey || zoneRegion.lokey > presetRegion->hikey)) continue;
+			if (filter && (zoneRegion.hivel < presetRegion->lovel || zoneRegion.lovel > presetRegion->hivel)) continue;
+			if (!out || num >= max) { num++; continue; }
 
-	if (p->sustain < 0.0f) p->sustain = 0.0f;
-	else if (sustainIsGain) p->sustain = tsf_decibelsToGain(-p->sustain / 10.0f);
-	else p->sustain = 1.0f - (p->sustain / 1000.0f);
+			region = &out[num++];
+			*region = zoneRegion;
+			if (filter)
+			{
+				if (presetRegion->lokey > region->lokey) region->lokey = presetRegion->lokey;
+				if (presetRegion->hikey < region->hikey) region->hikey = presetRegion->hikey;
+				if (presetRegion->lovel > region->lovel) region->lovel = presetRegion->lovel;
+				if (presetRegion->hivel < region->hivel) region->hivel = presetRegion->hivel;
+			}
+
+			//sum regions, times stay in timecents until note on
+			tsf_region_operator(region, 0, TSF_NULL, presetRegion);
+
+			// Fixup sample positions
+			tsf_hydra_get_shdr(res, &pshdr, pigen.genAmount.wordAmount);
+
+			region->offset += pshdr.start;
+			region->end += pshdr.end;
+			region->loop_start += pshdr.startLoop;
+			region->loop_end += pshdr.endLoop;
+			if (pshdr.endLoop > 0) region->loop_end -= 1;
+			if (region->pitch_keycenter == -1) region->pitch_keycenter = pshdr.originalPitch;
+			region->tune += pshdr.pitchCorrection;
+			region->sample_rate = pshdr.sampleRate;
+			if (region->end && region->end < res->fontSampleCount) region->end++;
+			else region->end = res->fontSampleCount;
+		}
+
+		// Handle instrument's global zone.
+		if (pibagIdx == pinst.instBagNdx && !hadSampleID)
+			instRegion = zoneRegion;
+
+		// Modulators (TODO)
+		//if (ibag->instModNdx < ibag[1].instModNdx) addUnsupportedOpcode("any modulator");
+	}
+	return num;
 }
 
-static int32_t tsf_preset_idx(struct tsf_hydra *hydra, struct tsf_stream *stream, struct tsf_hydra_phdr *pphdr, int32_t pphdrIdx) {
-	int32_t idx = 0;
-	int32_t otherpphdrIdx;
-	for (otherpphdrIdx = 0; otherpphdrIdx < hydra->phdrNum - 1; otherpphdrIdx++)
+// Count the refs of the preset bags [bagStart, bagEnd), the own regions among them in privateNum and in tableNum
+// the regions it needs at most with the shared tables of its instruments not loaded yet
+static int32_t tsf_preset_regioncount(tsf* res, int32_t bagStart, int32_t bagEnd, int32_t* privateNum, uint32_t* tableNum)
+{
+	enum { GenInstrument = 41 };
+	struct tsf_region globalRegion;
+	int32_t ppbagIdx, regionNum = 0;
+
+	*privateNum = 0;
+	if (tableNum) *tableNum = 0;
+	tsf_region_clear(&globalRegion, TSF_TRUE);
+	for (ppbagIdx = bagStart; ppbagIdx < bagEnd; ppbagIdx++)
 	{
-		struct tsf_hydra_phdr otherphdr;
-		stream->seek(stream->data, hydra->phdrPos + otherpphdrIdx * phdrSizeInFile);
-		tsf_hydra_read_phdr(&otherphdr, stream);
+		struct tsf_hydra_pbag ppbag, nextppbag;
+		struct tsf_region presetRegion = globalRegion;
+		int32_t ppgenIdx, hadGenInstrument = 0;
+
+		tsf_hydra_get_pbag(res, &ppbag, ppbagIdx);
+		tsf_hydra_get_pbag(res, &nextppbag, (ppbagIdx + 1));
+
+		for (ppgenIdx = ppbag.genNdx; ppgenIdx < nextppbag.genNdx; ppgenIdx++)
+		{
+			struct tsf_hydra_pgen ppgen;
+			int32_t n;
+
+			tsf_hydra_get_pgen(res, &ppgen, ppgenIdx);
+
+			if (ppgen.genOper != GenInstrument) { tsf_region_operator(&presetRegion, ppgen.genOper, &ppgen.genAmount, TSF_NULL); continue; }
+			hadGenInstrument = 1;
+			if (ppgen.genAmount.wordAmount >= res->instrumentNum) continue;
+			n = tsf_instrument_resolve(res, ppgen.genAmount.wordAmount, &presetRegion, TSF_TRUE, TSF_NULL, 0);
+			regionNum += n;
+			if (!tsf_region_neutral(&presetRegion)) { *privateNum += n; if (tableNum) *tableNum += n; }
+			else if (tableNum) *tableNum += res->instruments[ppgen.genAmount.wordAmount].regionNum;
+		}
+
+		// Handle preset's global zone.
+		if (ppbagIdx == bagStart && !hadGenInstrument)
+			globalRegion = presetRegion;
+	}
+	return regionNum;
+}
+
+static TSF_BOOL tsf_preset_less(const struct tsf_preset* a, const struct tsf_preset* b)
+{
+	if (a->bank != b->bank) return a->bank < b->bank;
+	if (a->preset != b->preset) return a->preset < b->preset;
+	return a->pphdrIdx < b->pphdrIdx;
+}
 
-		if (otherphdr.bank > pphdr->bank) continue;
-		else if (otherphdr.bank < pphdr->bank) idx++;
-		else if (otherphdr.preset > pphdr->preset) continue;
-		else if (otherphdr.preset < pphdr->preset) idx++;
-		else if (otherpphdrIdx < pphdrIdx) idx++;
+static void tsf_preset_siftdown(struct tsf_preset* presets, int32_t root, int32_t num)
+{
+	struct tsf_preset tmp;
+	int32_t child;
+	for (; (child = root * 2 + 1) < num; root = child)
+	{
+		if (child + 1 < num && tsf_preset_less(&presets[child], &presets[child + 1])) child++;
+		if (!tsf_preset_less(&presets[root], &presets[child])) return;
+		tmp = presets[root], presets[root] = presets[child], presets[child] = tmp;
 	}
-	return idx;
 }
 
-static void tsf_preload_presets(tsf* res)
+// In place heap sort by bank, preset number and file order
+static void tsf_preset_sort(struct tsf_preset* presets, int32_t num)
 {
-	enum { GenInstrument = 41, GenKeyRange = 43, GenVelRange = 44, GenSampleID = 53 };
-	struct tsf_stream *stream = res->stream;
-	struct tsf_hydra *hydra = &res->hydra;
-	// Read each preset.
-	int32_t pphdrIdx;
-	for (pphdrIdx = 0; pphdrIdx < hydra->phdrNum - 1; pphdrIdx++)
+	struct tsf_preset tmp;
+	int32_t i;
+	for (i = num / 2 - 1; i >= 0; i--) tsf_preset_siftdown(presets, i, num);
+	for (i = num - 1; i > 0; i--)
 	{
-		struct tsf_hydra_phdr pphdr;
-		struct tsf_hydra_phdr nextpphdr;
-		stream->seek(stream->data, hydra->phdrPos + pphdrIdx * phdrSizeInFile);
-		tsf_hydra_read_phdr(&pphdr, stream);
+		tmp = presets[0], presets[0] = presets[i], presets[i] = tmp;
+		tsf_preset_siftdown(presets, 0, i);
+	}
+}
 
-		stream->seek(stream->data, hydra->phdrPos + (pphdrIdx + 1) * phdrSizeInFile);
-		tsf_hydra_read_phdr(&nextpphdr, stream);
+static uint32_t tsf_preset_hashslot(const tsf* f, int32_t bank, int32_t preset_number)
+{
+	return ((((uint32_t)bank << 7) ^ (uint32_t)preset_number) * 2654435761u) >> 16 & f->presetHashMask;
+}
 
-		int32_t sortedIndex = 0;
-		struct tsf_preset* preset;
+// Open addressing table of preset index + 1 by bank/program, the first of duplicate headers wins like the old linear scan did
+static void tsf_preset_hash(tsf* res)
+{
+	int32_t i;
+	uint32_t slot;
+	for (res->presetHashMask = 1; res->presetHashMask < (uint32_t)res->presetNum * 2; res->presetHashMask <<= 1);
+	res->presetHash = (uint16_t*)TSF_MALLOC(res->presetHashMask * sizeof(uint16_t));
+	TSF_MEMSET(res->presetHash, 0, res->presetHashMask * sizeof(uint16_t));
+	res->presetHashMask--;
+	for (i = 0; i < res->presetNum; i++)
+	{
+		for (slot = tsf_preset_hashslot(res, res->presets[i].bank, res->presets[i].preset); res->presetHash[slot]; slot = (slot + 1) & res->presetHashMask)
+			if (res->presets[res->presetHash[slot] - 1].bank == res->presets[i].bank && res->presets[res->presetHash[slot] - 1].preset == res->presets[i].preset) break;
+		if (!res->presetHash[slot]) res->presetHash[slot] = (uint16_t)(i + 1);
+	}
+}
 
-		sortedIndex = tsf_preset_idx(hydra, stream, &pphdr, pphdrIdx);
+static void tsf_preload_presets(tsf* res)
+{
+	struct tsf_hydra *hydra = &res->hydra;
+	struct tsf_hydra_phdr pphdr;
+	uint16_t* bags = (uint16_t*)TSF_MALLOC(hydra->phdrNum * sizeof(uint16_t));
+	int32_t pphdrIdx, i;
 
-		preset = &res->presets[sortedIndex];
+	// Read the headers once in file order, the terminal one only gives the end of the last bag range
+	for (pphdrIdx = 0; pphdrIdx < hydra->phdrNum; pphdrIdx++)
+	{
+		struct tsf_preset* preset;
+		tsf_hydra_get_phdr(res, &pphdr, pphdrIdx);
+		bags[pphdrIdx] = pphdr.presetBagNdx;
+		if (pphdrIdx == hydra->phdrNum - 1) break;
+		preset = &res->presets[pphdrIdx];
 #ifndef TSF_NO_PRESET_NAME
 		TSF_MEMCPY(preset->presetName, pphdr.presetName, sizeof(preset->presetName));
 		preset->presetName[sizeof(preset->presetName) - 1] = '\0'; //should be zero terminated in source file but make sure
 #endif
 		preset->bank = pphdr.bank;
 		preset->preset = pphdr.preset;
-		preset->regionNum = 0;
+		preset->refs = TSF_NULL;
 		preset->regions = TSF_NULL;
+		preset->spans = TSF_NULL;
+		preset->keyIndex = TSF_NULL;
 		preset->pphdrIdx = pphdrIdx;
 		preset->loaded = TSF_FALSE;
 		preset->refCount = 0;
-//		printf("PRESET name:%s bank:%d preset:%d\n",preset->presetName, preset->bank, preset->preset);
-
-		int32_t ppbagIdx;
-		//count regions covered by this preset
-		for (ppbagIdx = pphdr.presetBagNdx; ppbagIdx < nextpphdr.presetBagNdx; ppbagIdx++)
-		{
-			struct tsf_hydra_pbag ppbag, nextppbag;
-
-			stream->seek(stream->data, hydra->pbagPos + ppbagIdx * pbagSizeInFile);
-			tsf_hydra_read_pbag(&ppbag, stream);
-			stream->seek(stream->data, hydra->pbagPos + (ppbagIdx + 1) * pbagSizeInFile);
-			tsf_hydra_read_pbag(&nextppbag, stream);
-
-			uint8_t plokey = 0, phikey = 127, plovel = 0, phivel = 127;
-			int32_t ppgenIdx;
-			for (ppgenIdx = ppbag.genNdx; ppgenIdx < nextppbag.genNdx; ppgenIdx++)
-			{
-				struct tsf_hydra_pgen ppgen;
-				struct tsf_hydra_inst pinst, nextpinst;
+		preset->lastUse = 0;
+		preset->imageTables = 0;
+	}
 
-				stream->seek(stream->data, hydra->pgenPos + ppgenIdx * pgenSizeInFile);
-				tsf_hydra_read_pgen(&ppgen, stream);
+	// zones of the shared instrument tables, which the region counts need
+	for (i = 0; i < res->instrumentNum; i++)
+		res->instruments[i].regionNum = (uint16_t)tsf_instrument_resolve(res, i, TSF_NULL, TSF_FALSE, TSF_NULL, 0);
+	for (pphdrIdx = 0; pphdrIdx < hydra->phdrNum - 1; pphdrIdx++)
+		res->presets[pphdrIdx].regionNum = tsf_preset_regioncount(res, bags[pphdrIdx], bags[pphdrIdx + 1], &res->presets[pphdrIdx].privateNum, TSF_NULL);
+	TSF_FREE(bags);
 
-				if (ppgen.genOper == GenKeyRange) { plokey = ppgen.genAmount.range.lo; phikey = ppgen.genAmount.range.hi; continue; }
-				if (ppgen.genOper == GenVelRange) { plovel = ppgen.genAmount.range.lo; phivel = ppgen.genAmount.range.hi; continue; }
-				if (ppgen.genOper != GenInstrument) continue;
-				if (ppgen.genAmount.wordAmount >= hydra->instNum) continue;
+	tsf_preset_sort(res->presets, res->presetNum);
+	tsf_preset_hash(res);
+}
 
-				stream->seek(stream->data, hydra->instPos + ppgen.genAmount.wordAmount * instSizeInFile);
-				tsf_hydra_read_inst(&pinst, stream);
+enum { TSF_ARENA_FREE, TSF_ARENA_REGIONS, TSF_ARENA_KEYINDEX, TSF_ARENA_REFS, TSF_ARENA_INSTRUMENT, TSF_ARENA_SPANS, TSF_ARENA_INSTRUMENT_SPANS };
 
-				stream->seek(stream->data, hydra->instPos + (ppgen.genAmount.wordAmount + 1) * instSizeInFile);
-				tsf_hydra_read_inst(&nextpinst, stream);
+// header of every table in the arena, the tables of a preset (or instrument) are found again through it when compacting
+struct tsf_arena_block
+{
+	uint32_t size;
+	uint16_t preset, kind; // instrument index for TSF_ARENA_INSTRUMENT(_SPANS)
+};
 
-				int32_t pibagIdx;
-				for (pibagIdx = pinst.instBagNdx; pibagIdx < nextpinst.instBagNdx; pibagIdx++)
-				{
-					struct tsf_hydra_ibag pibag, nextpibag;
+// bump allocation, holes left by unloaded presets are only given back by tsf_arena_compact()
+static void* tsf_arena_alloc(tsf* f, int32_t preset_index, uint16_t kind, uint32_t size)
+{
+	struct tsf_arena_block* b;
+	size = (sizeof(struct tsf_arena_block) + size + 7) & ~7u;
+	if (f->arenaUsed + size > f->arenaSize) return TSF_NULL;
+#ifdef TSF_MEM_PROF
+	printf("ARENA alloc preset %d kind %d %d at %d\n", preset_index, kind, size, f->arenaUsed);
+#endif
+	b = (struct tsf_arena_block*)(f->arena + f->arenaUsed);
+	b->size = size;
+	b->preset = (uint16_t)preset_index;
+	b->kind = kind;
+	f->arenaUsed += size;
+	return b + 1;
+}
 
-					stream->seek(stream->data, hydra->ibagPos + pibagIdx * ibagSizeInFile);
-					tsf_hydra_read_ibag(&pibag, stream);
+// gives back the end of the last allocated table
+static void tsf_arena_shrink(tsf* f, void* p, uint32_t size)
+{
+	struct tsf_arena_block* b = (struct tsf_arena_block*)p - 1;
+	size = (sizeof(struct tsf_arena_block) + size + 7) & ~7u;
+	f->arenaUsed -= b->size - size;
+	b->size = size;
+}
 
-					stream->seek(stream->data, hydra->ibagPos + (pibagIdx + 1) * ibagSizeInFile);
-					tsf_hydra_read_ibag(&nextpibag, stream);
+static void tsf_arena_free(tsf* f, void* p)
+{
+	struct tsf_arena_block* b;
+	if (!p) return;
+	b = (struct tsf_arena_block*)p - 1;
+	b->kind = TSF_ARENA_FREE;
+	if ((uint8_t*)b + b->size == f->arena + f->arenaUsed) f->arenaUsed -= b->size;
+	else f->arenaHoles += b->size;
+}
 
-					uint8_t ilokey = 0, ihikey = 127, ilovel = 0, ihivel = 127;
+// Slide the live tables down over the holes, voices playing a region of a moved table follow it. Voices and
+// tables are repointed and moved in one critical section, a render or note-on in between would read stale ones.
+static void tsf_arena_compact(tsf* f)
+{
+	uint32_t src, dst = 0, size;
+	int32_t i;
 
-					int32_t pigenIdx;
-					for (pigenIdx = pibag.instGenNdx; pigenIdx < nextpibag.instGenNdx; pigenIdx++)
-					{
-						struct tsf_hydra_igen pigen;
+	TSF_CRITICAL_ENTER();
+	for (src = 0; src < f->arenaUsed; src += size)
+	{
+		struct tsf_arena_block* b = (struct tsf_arena_block*)(f->arena + src);
+		uint8_t* table = f->arena + dst + sizeof(struct tsf_arena_block);
+		size = b->size;
+		if (b->kind == TSF_ARENA_FREE) continue;
+		if (dst != src)
+		{
+			if (b->kind == TSF_ARENA_REGIONS || b->kind == TSF_ARENA_INSTRUMENT)
+			{
+				for (i = 0; i < f->voiceActiveNum; i++)
+				{
+					struct tsf_voice* v = &f->voices[f->voiceActive[i]];
+					if ((uint8_t*)v->region > (uint8_t*)b && (uint8_t*)v->region < (uint8_t*)b + size) v->region = (struct tsf_region*)((uint8_t*)v->region - (src - dst));
+				}
+			}
+			else if (b->kind == TSF_ARENA_SPANS || b->kind == TSF_ARENA_INSTRUMENT_SPANS)
+			{
+				for (i = 0; i < f->voiceActiveNum; i++)
+				{
+					struct tsf_voice* v = &f->voices[f->voiceActive[i]];
+					if ((uint8_t*)v->spans > (uint8_t*)b && (uint8_t*)v->spans < (uint8_t*)b + size) v->spans = (const struct tsf_sample_span*)((uint8_t*)v->spans - (src - dst));
+				}
+			}
+			switch (b->kind)
+			{
+				case TSF_ARENA_REGIONS: f->presets[b->preset].regions = (struct tsf_region*)table; break;
+				case TSF_ARENA_KEYINDEX: f->presets[b->preset].keyIndex = (uint16_t*)table; break;
+				case TSF_ARENA_REFS: f->presets[b->preset].refs = (struct tsf_region_ref*)table; break;
+				case TSF_ARENA_INSTRUMENT: f->instruments[b->preset].regions = (struct tsf_region*)table; break;
+				case TSF_ARENA_SPANS: f->presets[b->preset].spans = (struct tsf_sample_span*)table; break;
+				case TSF_ARENA_INSTRUMENT_SPANS: f->instruments[b->preset].spans = (struct tsf_sample_span*)table; break;
+			}
+			TSF_MEMMOVE(f->arena + dst, f->arena + src, size);
+		}
+		dst += size;
+	}
+#ifdef TSF_MEM_PROF
+	printf("ARENA compact %d -> %d\n", f->arenaUsed, dst);
+#endif
+	f->arenaUsed = dst;
+	f->arenaHoles = 0;
+	TSF_CRITICAL_EXIT();
+}
 
-						stream->seek(stream->data, hydra->igenPos + pigenIdx * igenSizeInFile);
-						tsf_hydra_read_igen(&pigen, stream);
+// Copy the first TSF_SAMPLE_CACHE_ATTACK samples of every region of a table, then its loops of up to TSF_SAMPLE_CACHE_LOOP
+// samples, to the arena while the sample cache budget lasts. Spans playing the same samples share them.
+static struct tsf_sample_span* tsf_spans_fill(tsf* f, int32_t owner, uint16_t kind, const struct tsf_region* regions, int32_t regionNum)
+{
+	const int16_t* font = f->fontSamples + f->fontSamplesOffset;
+	struct tsf_sample_span* spans;
+	uint32_t room, size, used, start, end, pass;
+	int32_t i, j, spanNum = regionNum * 2;
 
-						if (pigen.genOper == GenKeyRange) { ilokey = pigen.genAmount.range.lo; ihikey = pigen.genAmount.range.hi; continue; }
-						if (pigen.genOper == GenVelRange) { ilovel = pigen.genAmount.range.lo; ihivel = pigen.genAmount.range.hi; continue; }
-						if (pigen.genOper == GenSampleID && ihikey >= plokey && ilokey <= phikey && ihivel >= plovel && ilovel <= phivel) preset->regionNum++;
-					}
-				}
+	if (!regionNum || f->fontAdpcm || !f->fontSamples || f->sampleCacheUsed >= f->sampleCacheBudget) return TSF_NULL;
+	room = f->sampleCacheBudget - f->sampleCacheUsed;
+	size = spanNum * sizeof(struct tsf_sample_span);
+	for (i = 0; i < regionNum; i++)
+	{
+		const struct tsf_region* r = &regions[i];
+		if (r->end > r->offset) size += ((r->end - r->offset > TSF_SAMPLE_CACHE_ATTACK ? TSF_SAMPLE_CACHE_ATTACK : r->end - r->offset) + 1) * sizeof(int16_t);
+		if (r->loop_mode != TSF_LOOPMODE_NONE && r->loop_start < r->loop_end && r->loop_end < r->end && r->loop_end - r->loop_start < TSF_SAMPLE_CACHE_LOOP)
+			size += (r->loop_end - r->loop_start + 2) * sizeof(int16_t);
+	}
+	if (room < sizeof(struct tsf_arena_block) + 7) return TSF_NULL;
+	if (size > room - sizeof(struct tsf_arena_block) - 7) size = room - sizeof(struct tsf_arena_block) - 7;
+	if (size <= spanNum * sizeof(struct tsf_sample_span)) return TSF_NULL;
+	spans = (struct tsf_sample_span*)tsf_arena_alloc(f, owner, kind, size);
+	if (!spans) return TSF_NULL;
+
+	TSF_MEMSET(spans, 0, spanNum * sizeof(struct tsf_sample_span));
+	used = spanNum * sizeof(struct tsf_sample_span);
+	for (pass = 0; pass < 2; pass++)
+		for (i = 0; i < regionNum; i++)
+		{
+			const struct tsf_region* r = &regions[i];
+			struct tsf_sample_span* s = &spans[i * 2 + pass];
+			if (pass == 0) start = r->offset, end = (r->end - r->offset > TSF_SAMPLE_CACHE_ATTACK ? r->offset + TSF_SAMPLE_CACHE_ATTACK : r->end);
+			else if (r->loop_mode != TSF_LOOPMODE_NONE && r->loop_start < r->loop_end && r->loop_end < r->end && r->loop_end - r->loop_start < TSF_SAMPLE_CACHE_LOOP)
+				start = r->loop_start, end = r->loop_end + 1;
+			else continue;
+			if (end <= start) continue;
+			for (j = 0; j < spanNum; j++)
+				if (spans[j].start == start && spans[j].end == end && spans[j].data) break;
+			if (j < spanNum)
+				s->data = (uint32_t)((uint8_t*)&spans[j] - (uint8_t*)s) + spans[j].data;
+			else if (used + (end - start + 1) * sizeof(int16_t) <= size)
+			{
+				TSF_MEMCPY((uint8_t*)spans + used, font + start, (end - start + 1) * sizeof(int16_t));
+				s->data = used - (uint32_t)((uint8_t*)s - (uint8_t*)spans);
+				used += (end - start + 1) * sizeof(int16_t);
 			}
+			else continue;
+			s->start = start, s->end = end;
 		}
+	if (used == spanNum * sizeof(struct tsf_sample_span))
+	{
+		tsf_arena_free(f, spans);
+		return TSF_NULL;
+	}
+	tsf_arena_shrink(f, spans, used);
+	f->sampleCacheUsed += ((struct tsf_arena_block*)spans - 1)->size;
+	return spans;
+}
+
+static void tsf_spans_free(tsf* f, struct tsf_sample_span* spans)
+{
+	if (!spans) return;
+	f->sampleCacheUsed -= ((struct tsf_arena_block*)spans - 1)->size;
+	tsf_arena_free(f, spans);
+}
+
+// the shared table of an instrument, resolved at its first use, held until released as often
+static struct tsf_instrument* tsf_instrument_acquire(tsf* f, int32_t inst)
+{
+	struct tsf_instrument* instrument = &f->instruments[inst];
+	if (!instrument->regions && instrument->regionNum)
+	{
+		struct tsf_region neutral;
+		instrument->regions = (struct tsf_region*)tsf_arena_alloc(f, inst, TSF_ARENA_INSTRUMENT, instrument->regionNum * sizeof(struct tsf_region));
+		if (!instrument->regions) return TSF_NULL;
+		tsf_region_clear(&neutral, TSF_TRUE);
+		if (f->imageTables) TSF_MEMCPY(instrument->regions, f->imageTables + instrument->imageTable, instrument->regionNum * sizeof(struct tsf_region));
+		else tsf_instrument_resolve(f, inst, &neutral, TSF_FALSE, instrument->regions, instrument->regionNum);
+		instrument->spans = tsf_spans_fill(f, inst, TSF_ARENA_INSTRUMENT_SPANS, instrument->regions, instrument->regionNum);
 	}
+	instrument->refCount++;
+	return instrument;
+}
+
+static void tsf_instrument_release(tsf* f, int32_t inst)
+{
+	struct tsf_instrument* instrument = &f->instruments[inst];
+	if (--instrument->refCount) return;
+	tsf_spans_free(f, instrument->spans);
+	tsf_arena_free(f, instrument->regions);
+	instrument->spans = TSF_NULL;
+	instrument->regions = TSF_NULL;
 }
 
 static void tsf_unload_preset(tsf *res, int32_t idx) {
 	struct tsf_preset* preset;
+	int32_t i;
 	preset = &res->presets[idx];
 
-	TSF_FREE(preset->regions);
-	preset->regions = TSF_NULL;
+	// not ready first, a note-on from an interrupt must not see the regions being freed
 	preset->loaded = TSF_FALSE;
+	// freed in reverse of the load order, the tables at the end of the arena are given back at once
+	tsf_spans_free(res, preset->spans);
+	tsf_arena_free(res, preset->keyIndex);
+	for (i = preset->regionNum - 1; preset->refs && i >= 0; i--)
+		if (preset->refs[i].table != TSF_REF_PRIVATE) tsf_instrument_release(res, preset->refs[i].table);
+	tsf_arena_free(res, preset->regions);
+	tsf_arena_free(res, preset->refs);
+	preset->refs = TSF_NULL;
+	preset->regions = TSF_NULL;
+	preset->spans = TSF_NULL;
+	preset->keyIndex = TSF_NULL;
 	preset->refCount = 0;
 }
 
-static void tsf_load_preset(tsf* res, int32_t idx)
+// Evict the least recently used presets no channel selects and no voice plays until the live tables fit in budget bytes
+// (the sample spans have their own budget). Only marks their tables free, the holes are left to the collection.
+static void tsf_cache_evict(tsf* f, uint32_t budget)
 {
-	enum { GenInstrument = 41, GenKeyRange = 43, GenVelRange = 44, GenSampleID = 53 };
+	int32_t i, victim;
 
-	struct tsf_stream *stream = res->stream;
-	struct tsf_hydra *hydra = &res->hydra;
+	// a note-on must not start a voice on a victim between its check and its unload
+	TSF_CRITICAL_ENTER();
+	for (i = 0; i < f->voiceActiveNum; i++)
+		f->presets[f->voices[f->voiceActive[i]].playingPreset].refCount++;
+	for (i = 0; f->channels && i < f->channels->channelNum; i++)
+		if (f->channels->channels[i].presetIndex < f->presetNum) f->presets[f->channels->channels[i].presetIndex].refCount++;
+
+	while (f->arenaUsed - f->arenaHoles - f->sampleCacheUsed > budget)
+	{
+		for (victim = -1, i = 0; i < f->presetNum; i++)
+			if (f->presets[i].loaded && !f->presets[i].refCount && (victim < 0 || f->presets[i].lastUse < f->presets[victim].lastUse)) victim = i;
+		if (victim < 0) break; // all pinned
+#ifdef TSF_MEM_PROF
+		printf("CACHE evict preset %d\n", victim);
+#endif
+		tsf_unload_preset(f, victim);
+		f->cacheEvictions++;
+		f->cacheReclaim = TSF_TRUE;
+	}
+	for (i = 0; i < f->presetNum; i++) f->presets[i].refCount = 0;
+	TSF_CRITICAL_EXIT();
+}
+
+// lists the refs of every key so a note-on only tests the velocity of the ones covering it
+static void tsf_preset_keyindex(tsf* f, struct tsf_preset* preset)
+{
+	const struct tsf_region_ref* refs = preset->refs;
+	uint16_t *index, *regions;
+	uint32_t total = 0;
+	int32_t i, k;
+
+	preset->keyIndex = TSF_NULL;
+	for (i = 0; i < preset->regionNum; i++)
+		if (refs[i].lokey <= refs[i].hikey && refs[i].lokey < 128)
+			total += (refs[i].hikey < 128 ? refs[i].hikey : 127) - refs[i].lokey + 1;
+	if (total > 0xFFFF) return; // offsets would not fit, keep scanning
+
+	index = (uint16_t*)tsf_arena_alloc(f, (int32_t)(preset - f->presets), TSF_ARENA_KEYINDEX, (TSF_KEY_INDEX + total) * sizeof(uint16_t));
+	if (!index) return;
+	regions = index + TSF_KEY_INDEX;
+
+	// count each key then fill backwards from its end, regions keep their load order within a key
+	TSF_MEMSET(index, 0, TSF_KEY_INDEX * sizeof(uint16_t));
+	for (i = 0; i < preset->regionNum; i++)
+		for (k = refs[i].lokey; k <= refs[i].hikey && k < 128; k++) index[k]++;
+	for (k = 1; k < 128; k++) index[k] += index[k - 1];
+	index[128] = (uint16_t)total;
+	for (i = preset->regionNum - 1; i >= 0; i--)
+		for (k = refs[i].lokey; k <= refs[i].hikey && k < 128; k++) regions[--index[k]] = (uint16_t)i;
+	preset->keyIndex = index;
+}
+
+// Resolve the zones of a preset into its refs: the zones under a preset zone without generators are played from the
+// shared table of their instrument, the others are resolved into its own regions. TSF_FALSE when a table did not fit.
+static TSF_BOOL tsf_preset_parse(tsf* res, struct tsf_preset* preset)
+{
+	enum { GenInstrument = 41 };
 
 	struct tsf_hydra_phdr pphdr;
 	struct tsf_hydra_phdr nextpphdr;
 
 	struct tsf_region globalRegion;
 
-	struct tsf_preset* preset;
-
-	int32_t region_index = 0;
+	int32_t refNum = 0, privateNum = 0;
 
-	preset = &res->presets[idx];
-
-	stream->seek(stream->data, hydra->phdrPos + preset->pphdrIdx * phdrSizeInFile);
-	tsf_hydra_read_phdr(&pphdr, stream);
+	tsf_hydra_get_phdr(res, &pphdr, preset->pphdrIdx);
 
-	stream->seek(stream->data, hydra->phdrPos + (preset->pphdrIdx + 1) * phdrSizeInFile);
-	tsf_hydra_read_phdr(&nextpphdr, stream);
+	tsf_hydra_get_phdr(res, &nextpphdr, (preset->pphdrIdx + 1));
 
-#ifdef TSF_MEM_PROF
-	printf("MALLOC struct tsf_region (%d) %d * %ld = %ld\n", idx, preset->regionNum, sizeof(struct tsf_region), preset->regionNum * sizeof(struct tsf_region));
-#endif
-	preset->regions = (struct tsf_region*)TSF_MALLOC(preset->regionNum * sizeof(struct tsf_region));
 	tsf_region_clear(&globalRegion, TSF_TRUE);
 
 	// Zones.
@@ -1056,10 +1793,8 @@ static void tsf_load_preset(tsf* res, int32_t idx)
 	{
 		struct tsf_hydra_pbag ppbag, nextppbag;
 
-		stream->seek(stream->data, hydra->pbagPos + ppbagIdx * pbagSizeInFile);
-		tsf_hydra_read_pbag(&ppbag, stream);
-		stream->seek(stream->data, hydra->pbagPos + (ppbagIdx + 1) * pbagSizeInFile);
-		tsf_hydra_read_pbag(&nextppbag, stream);
+		tsf_hydra_get_pbag(res, &ppbag, ppbagIdx);
+		tsf_hydra_get_pbag(res, &nextppbag, (ppbagIdx + 1));
 
 		struct tsf_region presetRegion = globalRegion;
 		int32_t hadGenInstrument = 0;
@@ -1069,107 +1804,54 @@ static void tsf_load_preset(tsf* res, int32_t idx)
 		for (ppgenIdx = ppbag.genNdx; ppgenIdx < nextppbag.genNdx; ppgenIdx++)
 		{
 			struct tsf_hydra_pgen ppgen;
+			int32_t inst, i, n;
 
-			stream->seek(stream->data, hydra->pgenPos + ppgenIdx * pgenSizeInFile);
-			tsf_hydra_read_pgen(&ppgen, stream);
+			tsf_hydra_get_pgen(res, &ppgen, ppgenIdx);
 
-			// Instrument.
-			if (ppgen.genOper == GenInstrument)
+			if (ppgen.genOper != GenInstrument)
 			{
-				struct tsf_hydra_inst pinst, nextpinst;
-
-				struct tsf_region instRegion;
-				tsf_u16 whichInst = ppgen.genAmount.wordAmount;
-				if (whichInst >= hydra->instNum) continue;
-
-				tsf_region_clear(&instRegion, TSF_FALSE);
-
-				stream->seek(stream->data, hydra->instPos + whichInst * instSizeInFile);
-				tsf_hydra_read_inst(&pinst, stream);
-
-				stream->seek(stream->data, hydra->instPos + (whichInst + 1) * instSizeInFile);
-				tsf_hydra_read_inst(&nextpinst, stream);
+				tsf_region_operator(&presetRegion, ppgen.genOper, &ppgen.genAmount, TSF_NULL);
+				continue;
+			}
+			hadGenInstrument = 1;
+			inst = ppgen.genAmount.wordAmount;
+			if (inst >= res->instrumentNum) continue;
 
-				int32_t pibagIdx;
-				for (pibagIdx = pinst.instBagNdx; pibagIdx < nextpinst.instBagNdx; pibagIdx++)
+			if (tsf_region_neutral(&presetRegion))
+			{
+				// the zones the preset zone ranges let through, each ref holding the table
+				struct tsf_instrument* instrument = tsf_instrument_acquire(res, inst);
+				if (!instrument) return TSF_FALSE;
+				for (i = 0; i < instrument->regionNum && refNum < preset->regionNum; i++)
 				{
-					struct tsf_hydra_ibag pibag, nextpibag;
-
-					stream->seek(stream->data, hydra->ibagPos + pibagIdx * ibagSizeInFile);
-					tsf_hydra_read_ibag(&pibag, stream);
-
-					stream->seek(stream->data, hydra->ibagPos + (pibagIdx + 1) * ibagSizeInFile);
-					tsf_hydra_read_ibag(&nextpibag, stream);
-
-					// Generators.
-					struct tsf_region zoneRegion = instRegion;
-					int32_t hadSampleID = 0;
-					int32_t pigenIdx;
-					for (pigenIdx = pibag.instGenNdx; pigenIdx < nextpibag.instGenNdx; pigenIdx++)
-					{
-						struct tsf_hydra_igen pigen;
-
-						stream->seek(stream->data, hydra->igenPos + pigenIdx * igenSizeInFile);
-						tsf_hydra_read_igen(&pigen, stream);
-
-						if (pigen.genOper == GenSampleID)
-						{
-							//struct tsf_hydra_shdr* pshdr;
-							struct tsf_hydra_shdr pshdr;
-
-							//preset region key and vel ranges are a filter for the zone regions
-							if (zoneRegion.hikey < presetRegion.lokey || zoneRegion.lokey > presetRegion.hikey) continue;
-							if (zoneRegion.hivel < presetRegion.lovel || zoneRegion.lovel > presetRegion.hivel) continue;
-							if (presetRegion.lokey > zoneRegion.lokey) zoneRegion.lokey = presetRegion.lokey;
-							if (presetRegion.hikey < zoneRegion.hikey) zoneRegion.hikey = presetRegion.hikey;
-							if (presetRegion.lovel > zoneRegion.lovel) zoneRegion.lovel = presetRegion.lovel;
-							if (presetRegion.hivel < zoneRegion.hivel) zoneRegion.hivel = presetRegion.hivel;
-
-							//sum regions
-							tsf_region_operator(&zoneRegion, 0, TSF_NULL, &presetRegion);
-
-							// EG times need to be converted from timecents to seconds.
-							tsf_region_envtosecs(&zoneRegion.ampenv, TSF_TRUE);
-							tsf_region_envtosecs(&zoneRegion.modenv, TSF_FALSE);
-
-							// LFO times need to be converted from timecents to seconds.
-							zoneRegion.delayModLFO = (zoneRegion.delayModLFO < -11950.0f ? 0.0f : tsf_timecents2Secsf(zoneRegion.delayModLFO));
-							zoneRegion.delayVibLFO = (zoneRegion.delayVibLFO < -11950.0f ? 0.0f : tsf_timecents2Secsf(zoneRegion.delayVibLFO));
-
-							// Fixup sample positions
-							//pshdr = &hydra->shdrs[pigen->genAmount.wordAmount];
-
-							stream->seek(stream->data, hydra->shdrPos + pigen.genAmount.wordAmount * shdrSizeInFile);
-							tsf_hydra_read_shdr(&pshdr, stream);
-
-							zoneRegion.offset += pshdr.start;
-							zoneRegion.end += pshdr.end;
-							zoneRegion.loop_start += pshdr.startLoop;
-							zoneRegion.loop_end += pshdr.endLoop;
-							if (pshdr.endLoop > 0) zoneRegion.loop_end -= 1;
-							if (zoneRegion.pitch_keycenter == -1) zoneRegion.pitch_keycenter = pshdr.originalPitch;
-							zoneRegion.tune += pshdr.pitchCorrection;
-							zoneRegion.sample_rate = pshdr.sampleRate;
-							if (zoneRegion.end && zoneRegion.end < res->fontSampleCount) zoneRegion.end++;
-							else zoneRegion.end = res->fontSampleCount;
-
-							preset->regions[region_index] = zoneRegion;
-							region_index++;
-							hadSampleID = 1;
-						}
-						else tsf_region_operator(&zoneRegion, pigen.genOper, &pigen.genAmount, TSF_NULL);
-					}
-
-					// Handle instrument's global zone.
-					if (pibagIdx == pinst.instBagNdx && !hadSampleID)
-						instRegion = zoneRegion;
-
-					// Modulators (TODO)
-					//if (ibag->instModNdx < ibag[1].instModNdx) addUnsupportedOpcode("any modulator");
+					const struct tsf_region* zone = &instrument->regions[i];
+					struct tsf_region_ref* ref = &preset->refs[refNum];
+					if (zone->hikey < presetRegion.lokey || zone->lokey > presetRegion.hikey) continue;
+					if (zone->hivel < presetRegion.lovel || zone->lovel > presetRegion.hivel) continue;
+					ref->table = (uint16_t)inst;
+					ref->region = (uint16_t)i;
+					ref->lokey = (presetRegion.lokey > zone->lokey ? presetRegion.lokey : zone->lokey);
+					ref->hikey = (presetRegion.hikey < zone->hikey ? presetRegion.hikey : zone->hikey);
+					ref->lovel = (presetRegion.lovel > zone->lovel ? presetRegion.lovel : zone->lovel);
+					ref->hivel = (presetRegion.hivel < zone->hivel ? presetRegion.hivel : zone->hivel);
+					instrument->refCount++;
+					refNum++;
+				}
+				tsf_instrument_release(res, inst);
+			}
+			else
+			{
+				n = tsf_instrument_resolve(res, inst, &presetRegion, TSF_TRUE, preset->regions + privateNum, preset->privateNum - privateNum);
+				for (i = 0; i < n && refNum < preset->regionNum && privateNum < preset->privateNum; i++, privateNum++, refNum++)
+				{
+					struct tsf_region_ref* ref = &preset->refs[refNum];
+					ref->region = (uint16_t)privateNum;
+					ref->lokey = preset->regions[privateNum].lokey;
+					ref->hikey = preset->regions[privateNum].hikey;
+					ref->lovel = preset->regions[privateNum].lovel;
+					ref->hivel = preset->regions[privateNum].hivel;
 				}
-				hadGenInstrument = 1;
 			}
-			else tsf_region_operator(&presetRegion, ppgen.genOper, &ppgen.genAmount, TSF_NULL);
 		}
 
 		// Modulators (TODO)
@@ -1179,8 +1861,323 @@ static void tsf_load_preset(tsf* res, int32_t idx)
 		if (ppbagIdx == pphdr.presetBagNdx && !hadGenInstrument)
 			globalRegion = presetRegion;
 	}
-
+	return TSF_TRUE;
+}
+
+static void tsf_load_preset(tsf* res, int32_t idx)
+{
+	struct tsf_preset* preset = &res->presets[idx];
+	TSF_BOOL ok = TSF_FALSE;
+	int32_t i;
+
+	preset->refs = (struct tsf_region_ref*)tsf_arena_alloc(res, idx, TSF_ARENA_REFS, preset->regionNum * sizeof(struct tsf_region_ref));
+	// refs playing nothing until resolved, the ones left so are skipped by an unload
+	for (i = 0; preset->refs && i < preset->regionNum; i++)
+	{
+		preset->refs[i].table = TSF_REF_PRIVATE;
+		preset->refs[i].region = 0;
+		preset->refs[i].lokey = preset->refs[i].lovel = 127;
+		preset->refs[i].hikey = preset->refs[i].hivel = 0;
+	}
+	preset->regions = (preset->privateNum ? (struct tsf_region*)tsf_arena_alloc(res, idx, TSF_ARENA_REGIONS, preset->privateNum * sizeof(struct tsf_region)) : TSF_NULL);
+	if (preset->refs && (preset->regions || !preset->privateNum))
+	{
+		// a compiled image has the tables resolved already
+		if (res->imageTables)
+		{
+			const struct tsf_region_ref* refs = (const struct tsf_region_ref*)(res->imageTables + preset->imageTables);
+			if (preset->privateNum) TSF_MEMCPY(preset->regions, refs + preset->regionNum, preset->privateNum * sizeof(struct tsf_region));
+			for (ok = TSF_TRUE, i = 0; i < preset->regionNum && ok; i++)
+			{
+				if (refs[i].table != TSF_REF_PRIVATE && !tsf_instrument_acquire(res, refs[i].table)) ok = TSF_FALSE;
+				else preset->refs[i] = refs[i];
+			}
+		}
+		else ok = tsf_preset_parse(res, preset);
+	}
+	if (!ok)
+	{
+		// out of arena: stays not ready, the collection makes room at its next chance and a later load retries
+		struct tsf_hydra_phdr pphdr, nextpphdr;
+		int32_t privateNum;
+		uint32_t tableNum;
+		tsf_unload_preset(res, idx);
+		tsf_hydra_get_phdr(res, &pphdr, preset->pphdrIdx);
+		tsf_hydra_get_phdr(res, &nextpphdr, preset->pphdrIdx + 1);
+		tsf_preset_regioncount(res, pphdr.presetBagNdx, nextpphdr.presetBagNdx, &privateNum, &tableNum);
+		res->arenaFailures++;
+		res->cacheNeed = preset->regionNum * (sizeof(struct tsf_region_ref) + 2 * sizeof(uint16_t)) + tableNum * sizeof(struct tsf_region)
+			+ (TSF_KEY_INDEX + 8) * sizeof(uint16_t) + (preset->regionNum + 3) * sizeof(struct tsf_arena_block);
+		res->cacheReclaim = TSF_TRUE;
+		return;
+	}
+
+	tsf_preset_keyindex(res, preset);
+	preset->spans = tsf_spans_fill(res, idx, TSF_ARENA_SPANS, preset->regions, preset->privateNum);
+	// published once its tables are complete
+	TSF_CRITICAL_ENTER();
 	preset->loaded = TSF_TRUE;
+	TSF_CRITICAL_EXIT();
+
+	// over budget, older presets make room (never the one just loaded)
+	if (res->arenaUsed - res->arenaHoles - res->sampleCacheUsed > res->cacheBudget)
+	{
+		preset->refCount = 1;
+		tsf_cache_evict(res, res->cacheBudget);
+	}
+}
+
+#define TSF_IMAGE_VERSION 3
+#define TSF_FNV_BASIS 2166136261u
+
+// Compiled image: header, preset entries in sorted order, instrument entries, bank/program hash (padded to 4 bytes),
+// region tables (refs then own regions of every preset, then the shared table of every instrument) and last a hash of
+// the header, entries and bank/program hash. It is written in that order, so a torn write leaves a stale or erased
+// last word and the image does not validate.
+struct tsf_image_header
+{
+	tsf_fourcc id; // "TSFI"
+	uint32_t version; // TSF_IMAGE_VERSION << 16 | sizeof(struct tsf_region), the tables are stored as is
+	uint32_t fontHash;
+	uint32_t size;
+	uint32_t presetNum, presetHashMask, instrumentNum;
+	uint32_t tablesSize; // 0 without region tables
+};
+
+struct tsf_image_preset
+{
+	tsf_char20 presetName;
+	uint16_t preset, bank;
+	uint32_t pphdrIdx, regionNum, privateNum, tables;
+};
+
+struct tsf_image_instrument
+{
+	uint32_t regionNum, table;
+};
+
+struct tsf_image_writer
+{
+	int32_t (*write)(void* data, const void* ptr, uint32_t size);
+	void* data;
+	uint32_t size;
+	TSF_BOOL failed;
+};
+
+// FNV-1a over 32-bit words with a shift to fold the high bits back, a word at a time since the pdta is hashed at every boot
+static uint32_t tsf_hash(uint32_t hash, const void* data, uint32_t size)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	uint32_t w;
+	for (; size >= 4; size -= 4, p += 4)
+	{
+		TSF_MEMCPY(&w, p, 4);
+		hash = (hash ^ w) * 16777619u;
+		hash ^= hash >> 13;
+	}
+	while (size--) hash = (hash ^ *p++) * 16777619u;
+	return hash;
+}
+
+// what an image is valid for: the RIFF header and the whole pdta list of the font
+static uint32_t tsf_font_hash(tsf* f)
+{
+	uint8_t buf[256];
+	uint32_t hash, pos, n;
+
+	if (f->hydraBase) return tsf_hash(tsf_hash(TSF_FNV_BASIS, f->hydraBase, 12), f->hydraBase + f->pdtaPos, f->pdtaSize);
+	f->stream->seek(f->stream->data, 0);
+	f->stream->read(f->stream->data, buf, 12);
+	hash = tsf_hash(TSF_FNV_BASIS, buf, 12);
+	f->stream->seek(f->stream->data, f->pdtaPos);
+	for (pos = 0; pos < f->pdtaSize; pos += n)
+	{
+		n = (f->pdtaSize - pos < sizeof(buf) ? f->pdtaSize - pos : sizeof(buf));
+		if (f->stream->read(f->stream->data, buf, n) != (int32_t)n) break;
+		hash = tsf_hash(hash, buf, n);
+	}
+	return hash;
+}
+
+static uint32_t tsf_image_hashsize(uint32_t presetHashMask)
+{
+	return ((presetHashMask + 1) * sizeof(uint16_t) + 3) & ~3u;
+}
+
+// Take the preset directory from a valid image instead of reading the phdr, bag and gen records
+static TSF_BOOL tsf_image_read(tsf* res, const uint8_t* image, uint32_t size)
+{
+	struct tsf_image_header h;
+	struct tsf_image_preset e;
+	struct tsf_image_instrument ie;
+	uint32_t i, instrumentsPos, hashPos, tablesPos, check, hash;
+
+	if (!image || size < sizeof(h) + sizeof(check)) return TSF_FALSE;
+	TSF_MEMCPY(&h, image, sizeof(h));
+	if (!TSF_FourCCEquals(h.id, "TSFI") || h.version != (TSF_IMAGE_VERSION << 16 | sizeof(struct tsf_region))) return TSF_FALSE;
+	if (h.size > size || h.presetNum != (uint32_t)res->presetNum || h.instrumentNum != (uint32_t)res->instrumentNum || h.presetHashMask > 0xFFFF) return TSF_FALSE;
+	instrumentsPos = sizeof(h) + h.presetNum * sizeof(e);
+	hashPos = instrumentsPos + h.instrumentNum * sizeof(ie);
+	tablesPos = hashPos + tsf_image_hashsize(h.presetHashMask);
+	if (tablesPos + h.tablesSize + sizeof(check) != h.size) return TSF_FALSE;
+	TSF_MEMCPY(&check, image + h.size - sizeof(check), sizeof(check));
+	// hashed in the pieces the writer hashed them in
+	hash = tsf_hash(TSF_FNV_BASIS, image, sizeof(h));
+	for (i = 0; i < h.presetNum; i++) hash = tsf_hash(hash, image + sizeof(h) + i * sizeof(e), sizeof(e));
+	for (i = 0; i < h.instrumentNum; i++) hash = tsf_hash(hash, image + instrumentsPos + i * sizeof(ie), sizeof(ie));
+	hash = tsf_hash(hash, image + hashPos, (h.presetHashMask + 1) * sizeof(uint16_t));
+	hash = tsf_hash(hash, image + hashPos + (h.presetHashMask + 1) * sizeof(uint16_t), tablesPos - hashPos - (h.presetHashMask + 1) * sizeof(uint16_t));
+	if (check != hash || h.fontHash != tsf_font_hash(res)) return TSF_FALSE;
+
+	for (i = 0; i < h.presetNum; i++)
+	{
+		struct tsf_preset* preset = &res->presets[i];
+		TSF_MEMCPY(&e, image + sizeof(h) + i * sizeof(e), sizeof(e));
+		if (h.tablesSize && (e.tables > h.tablesSize || (h.tablesSize - e.tables) / sizeof(struct tsf_region) < e.privateNum
+			|| (h.tablesSize - e.tables - e.privateNum * sizeof(struct tsf_region)) / sizeof(struct tsf_region_ref) < e.regionNum)) return TSF_FALSE;
+#ifndef TSF_NO_PRESET_NAME
+		TSF_MEMCPY(preset->presetName, e.presetName, sizeof(preset->presetName));
+#endif
+		preset->preset = e.preset;
+		preset->bank = e.bank;
+		preset->pphdrIdx = (int32_t)e.pphdrIdx;
+		preset->regionNum = (int32_t)e.regionNum;
+		preset->privateNum = (int32_t)e.privateNum;
+		preset->imageTables = e.tables;
+		preset->refs = TSF_NULL;
+		preset->regions = TSF_NULL;
+		preset->spans = TSF_NULL;
+		preset->keyIndex = TSF_NULL;
+		preset->loaded = TSF_FALSE;
+		preset->refCount = 0;
+		preset->lastUse = 0;
+	}
+	for (i = 0; i < h.instrumentNum; i++)
+	{
+		TSF_MEMCPY(&ie, image + instrumentsPos + i * sizeof(ie), sizeof(ie));
+		if (ie.regionNum > 0xFFFF || (h.tablesSize && (ie.table > h.tablesSize || (h.tablesSize - ie.table) / sizeof(struct tsf_region) < ie.regionNum))) return TSF_FALSE;
+		res->instruments[i].regionNum = (uint16_t)ie.regionNum;
+		res->instruments[i].imageTable = ie.table;
+	}
+	res->presetHashMask = h.presetHashMask;
+	res->presetHash = (uint16_t*)TSF_MALLOC((h.presetHashMask + 1) * sizeof(uint16_t));
+	TSF_MEMCPY(res->presetHash, image + hashPos, (h.presetHashMask + 1) * sizeof(uint16_t));
+	res->imageTables = (h.tablesSize ? image + tablesPos : TSF_NULL);
+	res->imageLoaded = TSF_TRUE;
+	return TSF_TRUE;
+}
+
+static void tsf_image_put(struct tsf_image_writer* w, const void* ptr, uint32_t size)
+{
+	if (w->failed || w->write(w->data, ptr, size) != (int32_t)size) { w->failed = TSF_TRUE; return; }
+	w->size += size;
+}
+
+static uint32_t tsf_image_tablessize(tsf* f)
+{
+	uint32_t size = 0;
+	int32_t i;
+	for (i = 0; i < f->presetNum; i++) size += f->presets[i].regionNum * sizeof(struct tsf_region_ref) + f->presets[i].privateNum * sizeof(struct tsf_region);
+	for (i = 0; i < f->instrumentNum; i++) size += f->instruments[i].regionNum * sizeof(struct tsf_region);
+	return size;
+}
+
+TSFDEF int32_t tsf_image_size(tsf* f, int32_t flag_regions)
+{
+	return (int32_t)(sizeof(struct tsf_image_header) + f->presetNum * sizeof(struct tsf_image_preset) + f->instrumentNum * sizeof(struct tsf_image_instrument)
+		+ tsf_image_hashsize(f->presetHashMask) + (flag_regions ? tsf_image_tablessize(f) : 0) + sizeof(uint32_t));
+}
+
+TSFDEF int32_t tsf_image_write(tsf* f, int32_t (*write)(void* data, const void* ptr, uint32_t size), void* data, int32_t flag_regions)
+{
+	struct tsf_image_writer w = { write, data, 0, TSF_FALSE };
+	struct tsf_image_header h;
+	uint32_t check;
+	struct tsf_image_preset e;
+	struct tsf_image_instrument ie;
+	struct tsf_hydra_phdr phdr;
+	uint32_t tables = 0, pad = 0;
+	int32_t i;
+
+	// only a SF2 has a pdta to validate an image against
+	if (!f->pdtaSize) return 0;
+
+	// the check covers the header, entries and bank/program hash, computed as they are written
+	TSF_MEMCPY(h.id, "TSFI", 4);
+	h.version = TSF_IMAGE_VERSION << 16 | sizeof(struct tsf_region);
+	h.fontHash = tsf_font_hash(f);
+	h.size = (uint32_t)tsf_image_size(f, flag_regions);
+	h.presetNum = (uint32_t)f->presetNum;
+	h.presetHashMask = f->presetHashMask;
+	h.instrumentNum = (uint32_t)f->instrumentNum;
+	h.tablesSize = (flag_regions ? tsf_image_tablessize(f) : 0);
+	tsf_image_put(&w, &h, sizeof(h));
+	check = tsf_hash(TSF_FNV_BASIS, &h, sizeof(h));
+
+	for (i = 0; i < f->presetNum; i++)
+	{
+		TSF_MEMSET(&e, 0, sizeof(e));
+		tsf_hydra_get_phdr(f, &phdr, f->presets[i].pphdrIdx);
+		TSF_MEMCPY(e.presetName, phdr.presetName, sizeof(e.presetName));
+		e.preset = f->presets[i].preset;
+		e.bank = f->presets[i].bank;
+		e.pphdrIdx = (uint32_t)f->presets[i].pphdrIdx;
+		e.regionNum = (uint32_t)f->presets[i].regionNum;
+		e.privateNum = (uint32_t)f->presets[i].privateNum;
+		e.tables = (flag_regions ? tables : 0);
+		tables += e.regionNum * sizeof(struct tsf_region_ref) + e.privateNum * sizeof(struct tsf_region);
+		tsf_image_put(&w, &e, sizeof(e));
+		check = tsf_hash(check, &e, sizeof(e));
+	}
+	for (i = 0; i < f->instrumentNum; i++)
+	{
+		ie.regionNum = f->instruments[i].regionNum;
+		ie.table = (flag_regions ? tables : 0);
+		tables += ie.regionNum * sizeof(struct tsf_region);
+		tsf_image_put(&w, &ie, sizeof(ie));
+		check = tsf_hash(check, &ie, sizeof(ie));
+	}
+	tsf_image_put(&w, f->presetHash, (f->presetHashMask + 1) * sizeof(uint16_t));
+	tsf_image_put(&w, &pad, tsf_image_hashsize(f->presetHashMask) - (f->presetHashMask + 1) * sizeof(uint16_t));
+	check = tsf_hash(check, f->presetHash, (f->presetHashMask + 1) * sizeof(uint16_t));
+	check = tsf_hash(check, &pad, tsf_image_hashsize(f->presetHashMask) - (f->presetHashMask + 1) * sizeof(uint16_t));
+
+	// the tables of presets and instruments that are not loaded are resolved through the arena one at a time
+	for (i = 0; flag_regions && i < f->presetNum && !w.failed; i++)
+	{
+		TSF_BOOL wasLoaded = f->presets[i].loaded;
+		if (!wasLoaded) tsf_load_preset(f, i);
+		if (!f->presets[i].loaded) { w.failed = TSF_TRUE; break; }
+		tsf_image_put(&w, f->presets[i].refs, f->presets[i].regionNum * sizeof(struct tsf_region_ref));
+		tsf_image_put(&w, f->presets[i].regions, f->presets[i].privateNum * sizeof(struct tsf_region));
+		if (!wasLoaded) tsf_unload_preset(f, i);
+	}
+	for (i = 0; flag_regions && i < f->instrumentNum && !w.failed; i++)
+	{
+		struct tsf_instrument* instrument = tsf_instrument_acquire(f, i);
+		if (!instrument) { w.failed = TSF_TRUE; break; }
+		tsf_image_put(&w, instrument->regions, instrument->regionNum * sizeof(struct tsf_region));
+		tsf_instrument_release(f, i);
+	}
+	if (f->arenaHoles) f->cacheReclaim = TSF_TRUE;
+
+	tsf_image_put(&w, &check, sizeof(check));
+	return (w.failed || w.size != h.size ? 0 : (int32_t)h.size);
+}
+
+TSFDEF int32_t tsf_image_loaded(tsf* f)
+{
+	return f->imageLoaded;
+}
+
+// stamps the preset as just used for the cache, TSF_FALSE when it still has to be loaded
+static TSF_BOOL tsf_preset_use(tsf* f, int32_t preset_index)
+{
+	struct tsf_preset* preset = &f->presets[preset_index];
+	preset->lastUse = ++f->cacheClock;
+	if (preset->loaded) { f->cacheHits++; return TSF_TRUE; }
+	f->cacheMisses++;
+	return TSF_FALSE;
 }
 
 static void tsf_load_samples(int16_t** fontSamples, uint32_t* fontSampleCount, struct tsf_riffchunk *chunkSmpl, struct tsf_stream* stream)
@@ -1199,12 +2196,104 @@ static void tsf_load_samples(int16_t** fontSamples, uint32_t* fontSampleCount, s
 	}
 }
 
-static void tsf_voice_envelope_nextsegment(struct tsf_voice_envelope* e, int16_t active_segment, float outSampleRate)
+static const int16_t tsf_adpcm_steps[89] =
+{
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+	130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060,
+	1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484,
+	7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+static const int8_t tsf_adpcm_indexes[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+
+// IMA ADPCM step of nibble n from predictor and step index
+static inline int32_t tsf_adpcm_step(int32_t* predictor, int32_t* index, int32_t n)
+{
+	int32_t step = tsf_adpcm_steps[*index], diff = step >> 3;
+	if (n & 1) diff += step >> 2;
+	if (n & 2) diff += step >> 1;
+	if (n & 4) diff += step;
+	*predictor = __SSAT(*predictor + (n & 8 ? -diff : diff), 16);
+	*index += tsf_adpcm_indexes[n];
+	if (*index < 0) *index = 0;
+	else if (*index > 88) *index = 88;
+	return *predictor;
+}
+
+// decode the first num samples of the block holding pos
+static void tsf_adpcm_block(const uint8_t* pool, uint32_t pos, int16_t* samples, int32_t num)
+{
+	const uint8_t* block = pool + (pos / TSF_ADPCM_BLOCK) * TSF_ADPCM_BLOCK_BYTES;
+	int32_t predictor = (int16_t)(block[0] | block[1] << 8), index = (block[2] > 88 ? 88 : block[2]), i;
+	samples[0] = (int16_t)predictor;
+	for (i = 1; i < num; i++)
+		samples[i] = (int16_t)tsf_adpcm_step(&predictor, &index, (block[4 + ((i - 1) >> 1)] >> (((i - 1) & 1) << 2)) & 15);
+}
+
+// move the window to the block holding pos
+static void tsf_adpcm_decode(const uint8_t* pool, struct tsf_adpcm_window* w, uint32_t pos)
+{
+	const uint8_t* next = pool + (pos / TSF_ADPCM_BLOCK + 1) * TSF_ADPCM_BLOCK_BYTES;
+	w->base = pos & ~(uint32_t)(TSF_ADPCM_BLOCK - 1);
+	tsf_adpcm_block(pool, pos, w->samples, TSF_ADPCM_BLOCK);
+	w->samples[TSF_ADPCM_BLOCK] = (int16_t)(next[0] | next[1] << 8);
+}
+
+// a voice starting: nothing decoded yet, the loop start sample kept for the wrap
+static void tsf_adpcm_window_start(const uint8_t* pool, struct tsf_adpcm_window* w, uint32_t loopStart, uint32_t loopEnd)
+{
+	int16_t samples[TSF_ADPCM_BLOCK];
+	w->base = TSF_ADPCM_NOBASE;
+	if (loopStart >= loopEnd) return;
+	tsf_adpcm_block(pool, loopStart, samples, (int32_t)(loopStart & (TSF_ADPCM_BLOCK - 1)) + 1);
+	w->samples[TSF_ADPCM_BLOCK + 1] = samples[loopStart & (TSF_ADPCM_BLOCK - 1)];
+}
+
+TSFDEF int32_t tsf_adpcm_encode(const int16_t* samples, uint32_t count, uint8_t* out)
+{
+	// the block after the one of sample count still gives the window of that one its next sample
+	uint32_t blockNum = count / TSF_ADPCM_BLOCK + 2, b;
+	if (!out) return (int32_t)(blockNum * TSF_ADPCM_BLOCK_BYTES);
+	for (b = 0; b < blockNum; b++)
+	{
+		uint8_t* block = out + b * TSF_ADPCM_BLOCK_BYTES;
+		int32_t src[TSF_ADPCM_BLOCK], best = 0, i;
+		int64_t bestError = -1;
+		for (i = 0; i < TSF_ADPCM_BLOCK; i++) src[i] = (b * TSF_ADPCM_BLOCK + i < count ? samples[b * TSF_ADPCM_BLOCK + i] : 0);
+		// the starting step index is searched, the one following through the block closest to the source wins
+		for (int32_t start = 0; start <= 88 + 1; start++)
+		{
+			int32_t predictor = src[0], index = (start > 88 ? best : start);
+			int64_t error = 0;
+			TSF_BOOL write = (start > 88);
+			if (write) TSF_MEMSET(block, 0, TSF_ADPCM_BLOCK_BYTES);
+			for (i = 1; i < TSF_ADPCM_BLOCK && (write || bestError < 0 || error < bestError); i++)
+			{
+				int32_t step = tsf_adpcm_steps[index], diff = src[i] - predictor, n = 0;
+				if (diff < 0) n = 8, diff = -diff;
+				if (diff >= step) n |= 4, diff -= step;
+				if (diff >= step >> 1) n |= 2, diff -= step >> 1;
+				if (diff >= step >> 2) n |= 1;
+				tsf_adpcm_step(&predictor, &index, n);
+				error += (int64_t)(src[i] - predictor) * (src[i] - predictor);
+				if (write) block[4 + ((i - 1) >> 1)] |= (uint8_t)(n << (((i - 1) & 1) << 2));
+			}
+			if (write)
+			{
+				block[0] = (uint8_t)src[0], block[1] = (uint8_t)(src[0] >> 8), block[2] = (uint8_t)best;
+				break;
+			}
+			if (bestError < 0 || error < bestError) bestError = error, best = start;
+		}
+	}
+	return (int32_t)(blockNum * TSF_ADPCM_BLOCK_BYTES);
+}
+
+static void tsf_voice_envelope_nextsegment(struct tsf_voice_envelope* e, struct tsf_envelope* p, int16_t active_segment, float outSampleRate)
 {
 	switch (active_segment)
 	{
 	case TSF_SEGMENT_NONE:
-		e->samplesUntilNextSegment = (int32_t)(e->parameters.delay * outSampleRate);
+		e->samplesUntilNextSegment = (int32_t)(p->delay * outSampleRate);
 		if (e->samplesUntilNextSegment > 0)
 		{
 			e->segment = TSF_SEGMENT_DELAY;
@@ -1215,13 +2304,13 @@ static void tsf_voice_envelope_nextsegment(struct tsf_voice_envelope* e, int16_t
 		}
 	/* fall through */
 	case TSF_SEGMENT_DELAY:
-		e->samplesUntilNextSegment = (int32_t)(e->parameters.attack * outSampleRate);
+		e->samplesUntilNextSegment = (int32_t)(p->attack * outSampleRate);
 		if (e->samplesUntilNextSegment > 0)
 		{
 			if (!e->isAmpEnv)
 			{
 				//mod env attack duration scales with velocity (velocity of 1 is full duration, max velocity is 0.125 times duration)
-				e->samplesUntilNextSegment = (int32_t)(e->parameters.attack * ((145 - e->midiVelocity) / 144.0f) * outSampleRate);
+				e->samplesUntilNextSegment = (int32_t)(p->attack * ((145 - e->midiVelocity) / 144.0f) * outSampleRate);
 			}
 			e->segment = TSF_SEGMENT_ATTACK;
 			e->segmentIsExponential = TSF_FALSE;
@@ -1231,7 +2320,7 @@ static void tsf_voice_envelope_nextsegment(struct tsf_voice_envelope* e, int16_t
 		}
 	/* fall through */
 	case TSF_SEGMENT_ATTACK:
-		e->samplesUntilNextSegment = (int32_t)(e->parameters.hold * outSampleRate);
+		e->samplesUntilNextSegment = (int32_t)(p->hold * outSampleRate);
 		if (e->samplesUntilNextSegment > 0)
 		{
 			e->segment = TSF_SEGMENT_HOLD;
@@ -1242,7 +2331,7 @@ static void tsf_voice_envelope_nextsegment(struct tsf_voice_envelope* e, int16_t
 		}
 	/* fall through */
 	case TSF_SEGMENT_HOLD:
-		e->samplesUntilNextSegment = (int32_t)(e->parameters.decay * outSampleRate);
+		e->samplesUntilNextSegment = (int32_t)(p->decay * outSampleRate);
 		if (e->samplesUntilNextSegment > 0)
 		{
 			e->segment = TSF_SEGMENT_DECAY;
@@ -1251,22 +2340,22 @@ static void tsf_voice_envelope_nextsegment(struct tsf_voice_envelope* e, int16_t
 			{
 				// I don't truly understand this; just following what LinuxSampler does.
 				float mysterySlope = -9.226f / e->samplesUntilNextSegment;
-				e->slope = TSF_EXPF(mysterySlope);
+				e->slope = mysterySlope * TSF_LOG2E; // exponential segments keep log2 of the per sample factor
 				e->segmentIsExponential = TSF_TRUE;
-				if (e->parameters.sustain > 0.0f)
+				if (p->sustain > 0.0f)
 				{
 					// Again, this is following LinuxSampler's example, which is similar to
 					// SF2-style decay, where "decay" specifies the time it would take to
 					// get to zero, not to the sustain level.  The SFZ spec is not that
 					// specific about what "decay" means, so perhaps it's really supposed
 					// to specify the time to reach the sustain level.
-					e->samplesUntilNextSegment = (int32_t)(TSF_LOG(e->parameters.sustain) / mysterySlope);
+					e->samplesUntilNextSegment = (int32_t)(TSF_LOG(p->sustain) / mysterySlope);
 				}
 			}
 			else
 			{
 				e->slope = -1.0f / e->samplesUntilNextSegment;
-				e->samplesUntilNextSegment = (int32_t)(e->parameters.decay * (1.0f - e->parameters.sustain) * outSampleRate);
+				e->samplesUntilNextSegment = (int32_t)(p->decay * (1.0f - p->sustain) * outSampleRate);
 				e->segmentIsExponential = TSF_FALSE;
 			}
 			return;
@@ -1274,19 +2363,19 @@ static void tsf_voice_envelope_nextsegment(struct tsf_voice_envelope* e, int16_t
 	/* fall through */
 	case TSF_SEGMENT_DECAY:
 		e->segment = TSF_SEGMENT_SUSTAIN;
-		e->level = e->parameters.sustain;
+		e->level = p->sustain;
 		e->slope = 0.0f;
 		e->samplesUntilNextSegment = 0x7FFFFFFF;
 		e->segmentIsExponential = TSF_FALSE;
 		return;
 	case TSF_SEGMENT_SUSTAIN:
 		e->segment = TSF_SEGMENT_RELEASE;
-		e->samplesUntilNextSegment = (int32_t)((e->parameters.release <= 0 ? TSF_FASTRELEASETIME : e->parameters.release) * outSampleRate);
+		e->samplesUntilNextSegment = (int32_t)((p->release <= 0 ? TSF_FASTRELEASETIME : p->release) * outSampleRate);
 		if (e->isAmpEnv)
 		{
 			// I don't truly understand this; just following what LinuxSampler does.
 			float mysterySlope = -9.226f / e->samplesUntilNextSegment;
-			e->slope = TSF_EXPF(mysterySlope);
+			e->slope = mysterySlope * TSF_LOG2E;
 			e->segmentIsExponential = TSF_TRUE;
 		}
 		else
@@ -1304,33 +2393,40 @@ static void tsf_voice_envelope_nextsegment(struct tsf_voice_envelope* e, int16_t
 	}
 }
 
-static void tsf_voice_envelope_setup(struct tsf_voice_envelope* e, struct tsf_envelope* new_parameters, int32_t midiNoteNumber, int16_t midiVelocity, TSF_BOOL isAmpEnv, float outSampleRate)
+static void tsf_voice_envelope_setup(struct tsf_voice_envelope* e, struct tsf_envelope* p, const struct tsf_region_envelope* r, int32_t midiNoteNumber, int16_t midiVelocity, TSF_BOOL isAmpEnv, float outSampleRate)
 {
-	e->parameters = *new_parameters;
-	if (e->parameters.keynumToHold)
+	p->delay   = tsf_region_secs(r->delay);
+	p->attack  = tsf_region_secs(r->attack);
+	p->release = tsf_region_secs(r->release);
+	if (r->keynumToHold)
 	{
-		e->parameters.hold += e->parameters.keynumToHold * (60.0f - midiNoteNumber);
-		e->parameters.hold = (e->parameters.hold < -10000.0f ? 0.0f : tsf_timecents2Secsf(e->parameters.hold));
+		float hold = r->hold + r->keynumToHold * (60.0f - midiNoteNumber);
+		p->hold = (hold < -10000.0f ? 0.0f : tsf_timecents2Secsf(hold));
 	}
-	if (e->parameters.keynumToDecay)
+	else p->hold = tsf_region_secs(r->hold);
+	if (r->keynumToDecay)
 	{
-		e->parameters.decay += e->parameters.keynumToDecay * (60.0f - midiNoteNumber);
-		e->parameters.decay = (e->parameters.decay < -10000.0f ? 0.0f : tsf_timecents2Secsf(e->parameters.decay));
+		float decay = r->decay + r->keynumToDecay * (60.0f - midiNoteNumber);
+		p->decay = (decay < -10000.0f ? 0.0f : tsf_timecents2Secsf(decay));
 	}
+	else p->decay = tsf_region_secs(r->decay);
+	if (r->sustain < 0) p->sustain = 0.0f;
+	else if (isAmpEnv) p->sustain = tsf_decibelsToGain(-r->sustain / 10.0f);
+	else p->sustain = 1.0f - (r->sustain / 1000.0f);
 	e->midiVelocity = midiVelocity;
 	e->isAmpEnv = isAmpEnv;
-	tsf_voice_envelope_nextsegment(e, TSF_SEGMENT_NONE, outSampleRate);
+	tsf_voice_envelope_nextsegment(e, p, TSF_SEGMENT_NONE, outSampleRate);
 }
 
-static void tsf_voice_envelope_process(struct tsf_voice_envelope* e, int32_t numSamples, float outSampleRate)
+static void tsf_voice_envelope_process(struct tsf_voice_envelope* e, struct tsf_envelope* p, int32_t numSamples, float outSampleRate)
 {
 	if (e->slope)
 	{
-		if (e->segmentIsExponential) e->level *= TSF_POWF(e->slope, (float)numSamples);
+		if (e->segmentIsExponential) e->level *= tsf_exp2f(e->slope * numSamples);
 		else e->level += (e->slope * numSamples);
 	}
 	if ((e->samplesUntilNextSegment -= numSamples) <= 0)
-		tsf_voice_envelope_nextsegment(e, e->segment, outSampleRate);
+		tsf_voice_envelope_nextsegment(e, p, e->segment, outSampleRate);
 }
 
 #ifndef TSF_NO_LOWPASS
@@ -1338,7 +2434,7 @@ static void tsf_voice_envelope_process(struct tsf_voice_envelope* e, int32_t num
 static void tsf_voice_lowpass_setup(struct tsf_voice_lowpass* e, float Fc)
 {
 	// Lowpass filter from http://www.earlevel.com/main/2012/11/26/biquad-c-source-code/
-	float K = TSF_TAN(TSF_PI * Fc), KK = K * K;
+	float K = tsf_tanpif(Fc), KK = K * K;
 	float norm = 1 / (1 + K * e->QInv + KK);
 	e->a0 = float_to_fixed(KK * norm);
 	e->a1 = float_to_fixed(2 * KK * norm);
@@ -1376,15 +2472,93 @@ static void tsf_voice_lfo_process(struct tsf_voice_lfo* e, int32_t blockSamples)
 	else if (e->level < -1.0f) { e->delta = -e->delta; e->level = -2.0f - e->level; }
 }
 
-static void tsf_voice_kill(struct tsf_voice* v)
+static void tsf_voices_init(tsf* f)
+{
+	int32_t i;
+	for (i = 0; i < f->voiceNum; i++)
+	{
+		f->voices[i].playingPreset = -1;
+		// pop order gives the lowest voice index first
+		f->voiceFree[i] = (uint16_t)(f->voiceNum - 1 - i);
+	}
+	f->voiceActiveNum = 0;
+	f->voiceFreeNum = f->voiceNum;
+	f->fadeNum = 0;
+}
+
+static struct tsf_voice* tsf_voice_alloc(tsf* f)
+{
+	struct tsf_voice* v;
+	if (!f->voiceFreeNum) return TSF_NULL;
+	v = &f->voices[f->voiceFree[--f->voiceFreeNum]];
+	f->voicesCold[v - f->voices].activeIdx = (uint16_t)f->voiceActiveNum;
+	f->voiceActive[f->voiceActiveNum++] = (uint16_t)(v - f->voices);
+	return v;
+}
+
+static struct tsf_voice_cold* tsf_voice_getcold(tsf* f, struct tsf_voice* v)
+{
+	return &f->voicesCold[v - f->voices];
+}
+
+static struct tsf_channel* tsf_voice_channel(tsf* f, struct tsf_voice* v)
 {
+	int32_t key = tsf_voice_getcold(f, v)->playingKey;
+	if (!f->channels || v->playingChannel < 0 || v->playingChannel >= f->channels->channelNum || key < 0 || key > 127) return TSF_NULL;
+	return &f->channels->channels[v->playingChannel];
+}
+
+static void tsf_voice_index(tsf* f, struct tsf_voice* v)
+{
+	struct tsf_channel* c = tsf_voice_channel(f, v);
+	struct tsf_voice_cold* vc = tsf_voice_getcold(f, v);
+	uint8_t idx = (uint8_t)(v - f->voices);
+	if (!c) return;
+	vc->keyNext = c->keyVoice[vc->playingKey];
+	c->keyVoice[vc->playingKey] = idx;
+	if (v->region->group)
+	{
+		vc->groupNext = c->groupVoice[v->region->group & (TSF_GROUP_SLOTS - 1)];
+		c->groupVoice[v->region->group & (TSF_GROUP_SLOTS - 1)] = idx;
+	}
+	c->voiceCount++;
+}
+
+static void tsf_voice_unindex(tsf* f, struct tsf_voice* v)
+{
+	// chains are short (voices of one key or one class), unlinking walks them
+	struct tsf_channel* c = tsf_voice_channel(f, v);
+	struct tsf_voice_cold* vc = tsf_voice_getcold(f, v);
+	uint8_t idx = (uint8_t)(v - f->voices), *link;
+	if (!c) return;
+	for (link = &c->keyVoice[vc->playingKey]; *link != TSF_VOICE_NONE; link = &f->voicesCold[*link].keyNext)
+		if (*link == idx) { *link = vc->keyNext; c->voiceCount--; break; }
+	if (v->region->group)
+	{
+		for (link = &c->groupVoice[v->region->group & (TSF_GROUP_SLOTS - 1)]; *link != TSF_VOICE_NONE; link = &f->voicesCold[*link].groupNext)
+			if (*link == idx) { *link = vc->groupNext; break; }
+	}
+}
+
+static void tsf_voice_kill(tsf* f, struct tsf_voice* v)
+{
+	uint16_t last, activeIdx;
+	if (v->playingPreset == -1) return;
+	tsf_voice_unindex(f, v);
 	v->playingPreset = -1;
+	// swap the last active voice into the freed slot
+	activeIdx = tsf_voice_getcold(f, v)->activeIdx;
+	last = f->voiceActive[--f->voiceActiveNum];
+	f->voiceActive[activeIdx] = last;
+	f->voicesCold[last].activeIdx = activeIdx;
+	f->voiceFree[f->voiceFreeNum++] = (uint16_t)(v - f->voices);
 }
 
-static void tsf_voice_end(struct tsf_voice* v, float outSampleRate)
+static void tsf_voice_end(tsf* f, struct tsf_voice* v)
 {
-	tsf_voice_envelope_nextsegment(&v->ampenv, TSF_SEGMENT_SUSTAIN, outSampleRate);
-	tsf_voice_envelope_nextsegment(&v->modenv, TSF_SEGMENT_SUSTAIN, outSampleRate);
+	struct tsf_voice_cold* vc = tsf_voice_getcold(f, v);
+	tsf_voice_envelope_nextsegment(&v->ampenv, &vc->ampenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
+	tsf_voice_envelope_nextsegment(&v->modenv, &vc->modenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
 	if (v->region->loop_mode == TSF_LOOPMODE_SUSTAIN)
 	{
 		// Continue playing, but stop looping.
@@ -1392,69 +2566,272 @@ static void tsf_voice_end(struct tsf_voice* v, float outSampleRate)
 	}
 }
 
-static void tsf_voice_endquick(struct tsf_voice* v, float outSampleRate)
+static void tsf_voice_endquick(tsf* f, struct tsf_voice* v)
+{
+	struct tsf_voice_cold* vc = tsf_voice_getcold(f, v);
+	vc->ampenv.release = 0.0f; tsf_voice_envelope_nextsegment(&v->ampenv, &vc->ampenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
+	vc->modenv.release = 0.0f; tsf_voice_envelope_nextsegment(&v->modenv, &vc->modenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
+}
+
+// Steal priority, the lowest goes first: drum kit voices come last, then held notes, then by level
+// in 6dB steps (the float exponent). Delay, attack and hold rank as full level, their envelope level
+// does not tell yet how loud the note is going to be.
+static uint32_t tsf_voice_stealscore(struct tsf_voice* v, uint32_t drum, float gainMono)
+{
+	union { float f; uint32_t u; } level;
+	level.f = (v->ampenv.segment < TSF_SEGMENT_DECAY ? 1.0f : gainMono);
+	return drum | (v->ampenv.segment < TSF_SEGMENT_RELEASE ? TSF_STEAL_HELD : 0) | ((level.u >> 23) & 0xFF);
+}
+
+// Hand the sound of a stolen voice over to a fade slot so its own slot can start the new note
+static void tsf_voice_fadeout(tsf* f, struct tsf_voice* v)
 {
-	v->ampenv.parameters.release = 0.0f; tsf_voice_envelope_nextsegment(&v->ampenv, TSF_SEGMENT_SUSTAIN, outSampleRate);
-	v->modenv.parameters.release = 0.0f; tsf_voice_envelope_nextsegment(&v->modenv, TSF_SEGMENT_SUSTAIN, outSampleRate);
+	struct tsf_voice_fade* d;
+	float gainMono = tsf_decibelsToGain(v->noteGainDB) * v->ampenv.level * 0.75f;
+	int32_t i;
+
+	if (gainMono < f->cullGain) return;
+	if (f->fadeNum < TSF_STEAL_FADES) d = &f->fades[f->fadeNum++];
+	else
+	{
+		// all busy, the fade closest to silence gives way
+		for (d = &f->fades[0], i = 1; i < TSF_STEAL_FADES; i++)
+			if (f->fades[i].remain < d->remain) d = &f->fades[i];
+	}
+
+	d->position = v->sourceSamplePosition;
+	d->phaseIncr = float_to_fixed64(tsf_timecents2Secsf(v->pitchInputTimecents) * v->pitchOutputFactor);
+	d->sampleEndDbl = ((uint64_t)v->region->end) << 32;
+	d->loopStart = v->loopStart, d->loopEnd = v->loopEnd;
+	d->loopEndDbl = ((uint64_t)v->loopEnd + 1) << 32;
+	d->loopLengthDbl = ((uint64_t)(v->loopEnd - v->loopStart + 1)) << 32;
+	if (v->loopStart >= v->loopEnd || d->loopEndDbl > d->sampleEndDbl) d->loopEnd = 0xFFFFFFFF, d->loopEndDbl = (uint64_t)-1;
+	d->gainLeft = float_to_fixed(gainMono * v->panFactorLeft), d->gainRight = float_to_fixed(gainMono * v->panFactorRight);
+	d->remain = TSF_STEAL_FADE;
+	d->lowpass = v->lowpass;
+	if (f->windows) f->windows[f->voicesMax + (d - f->fades)] = f->windows[v - f->voices];
+}
+
+static void tsf_voice_fade_render(tsf* f, struct tsf_voice_fade* d, int32_t* output, int32_t numSamples)
+{
+	const int16_t* input = f->fontSamplesOffset + f->fontSamples;
+	struct tsf_adpcm_window* w = (f->windows ? &f->windows[f->voicesMax + (d - f->fades)] : TSF_NULL);
+	for (; numSamples && d->remain; numSamples--, d->remain--)
+	{
+		uint32_t pos = (uint32_t)(d->position >> 32);
+		int32_t alpha = (int32_t)((uint32_t)d->position >> 17), in;
+		if (w)
+		{
+			if (pos - w->base >= TSF_ADPCM_BLOCK) tsf_adpcm_decode(f->fontAdpcm, w, pos);
+			in = (w->samples[pos - w->base] * (32767 - alpha) + w->samples[pos >= d->loopEnd ? TSF_ADPCM_BLOCK + 1 : pos - w->base + 1] * alpha) >> 15;
+		}
+		else in = (input[pos] * (32767 - alpha) + input[pos >= d->loopEnd ? d->loopStart : pos + 1] * alpha) >> 15;
+#ifndef TSF_NO_LOWPASS
+		if (d->lowpass.active) in = __SSAT(tsf_voice_lowpass_process(&d->lowpass, in), 16);
+#endif
+		// linear Q15 ramp from the level the voice had down to silence
+		in = (in * (d->remain * (32768 / TSF_STEAL_FADE))) >> 15;
+		output[0] += in * d->gainLeft;
+		output[1] += in * d->gainRight;
+		output += 2;
+
+		d->position += d->phaseIncr;
+		if (d->position >= d->loopEndDbl) d->position -= d->loopLengthDbl;
+		if (d->position >= d->sampleEndDbl) { d->remain = 0; break; }
+	}
+}
+
+// Take over a voice for a new note when none is free: the lowest steal score, the oldest among
+// equals, never one the same note-on just started
+static struct tsf_voice* tsf_voice_steal(tsf* f, uint32_t playIndex)
+{
+	struct tsf_voice_cold *vc, *victim = TSF_NULL;
+	struct tsf_voice* v;
+	int32_t i;
+	for (i = 0; i < f->voiceActiveNum; i++)
+	{
+		vc = &f->voicesCold[f->voiceActive[i]];
+		if (vc->playIndex == playIndex) continue;
+		if (!victim || vc->stealScore < victim->stealScore || (vc->stealScore == victim->stealScore && (int32_t)(vc->playIndex - victim->playIndex) < 0))
+			victim = vc;
+	}
+	if (!victim) return TSF_NULL;
+	v = &f->voices[victim - f->voicesCold];
+	tsf_voice_fadeout(f, v);
+	tsf_voice_unindex(f, v);
+	return v;
 }
 
-static void tsf_voice_calcpitchratio(struct tsf_voice* v, float pitchShift, float outSampleRate)
+static void tsf_voice_calcpitchratio(tsf* f, struct tsf_voice* v, float pitchShift)
 {
-	float note = v->playingKey + v->region->transpose + v->region->tune / 100.0;
+	float outSampleRate = f->outSampleRate;
+	float note = tsf_voice_getcold(f, v)->playingKey + v->region->transpose + v->region->tune / 100.0;
 	float adjustedPitch = v->region->pitch_keycenter + (note - v->region->pitch_keycenter) * (v->region->pitch_keytrack / 100.0);
 	if (pitchShift) adjustedPitch += pitchShift;
 	v->pitchInputTimecents = adjustedPitch * 100.0;
 	v->pitchOutputFactor = v->region->sample_rate / (tsf_timecents2Secsf(v->region->pitch_keycenter * 100.0) * outSampleRate);
 }
 
-#ifndef TSF_NO_LOWPASS
-static void tsf_voice_render_lowpass(struct tsf_voice_lowpass *e, int32_t *buf, uint32_t samples) {
-	if (e->active) {
-		int32_t in0, in1;
-		int32_t out0, out1;
+// per block state handed to the render kernels
+struct tsf_voice_block
+{
+	const int16_t* input;
+	const uint8_t* adpcm;
+	struct tsf_adpcm_window* window;
+	const struct tsf_sample_span* spans;
+#ifdef TSF_SAMPLE_CACHE_STATS
+	uint32_t* tally; // samples read from the spans, then from the font
+#endif
+	uint64_t position, phaseIncr, sampleEndDbl, loopEndDbl, loopLengthDbl;
+	uint32_t loopStart, loopEnd;
+	int32_t gainStereo, gainEffect;
+	int32_t *output, *chorus, *reverb;
+	struct tsf_voice_lowpass lowpass;
+};
 
-		int blkCnt = (samples) >> 1;
-		while (blkCnt--)
-		{
-			in0 = *buf++;
-			in1 = *buf++;
+// samples that can be produced before the position moves distance (32.32) ahead, at most maxRun
+static int32_t tsf_voice_kernel_run(uint64_t distance, uint64_t phaseIncr, int32_t maxRun)
+{
+	if (!phaseIncr || distance > (uint64_t)maxRun * phaseIncr) return maxRun;
+	return (int32_t)(distance / phaseIncr + (distance % phaseIncr != 0));
+}
 
-			out0 = tsf_voice_lowpass_process(e, in0);
-			out1 = tsf_voice_lowpass_process(e, in1);
+// Single pass over the block: interpolation, lowpass and the stereo/chorus/reverb MACs per sample.
+// Only called with constant flags through the specializations below, so the unused paths compile out.
+// The position runs as a 32-bit index plus a 32-bit fraction; the number of samples before the next
+// loop point or the sample end is computed per run so the inner loop has no boundary checks.
+// ADPCM samples are read from the voice window, runs also end at its block end and idx is relative to it.
+// Runs inside a span of the sample cache read its SRAM copy the same way (the loop span first, a wrap only from it).
+static inline __attribute__((always_inline)) int32_t tsf_voice_kernel(struct tsf_voice_block* b, int32_t numSamples, const int isCompressed, const int isLooping, const int isFiltered, const int isInterpolated)
+{
+	const int16_t* input = (isCompressed ? b->window->samples : b->input);
+	const struct tsf_sample_span* span;
+	uint64_t position = b->position;
+	uint32_t idx, frac, base = 0, incrInt = (uint32_t)(b->phaseIncr >> 32), incrFrac = (uint32_t)b->phaseIncr;
+	int32_t gainStereo = b->gainStereo, gainEffect = b->gainEffect;
+	int32_t *output = b->output, *fxChorusBuf = b->chorus, *fxRevBuf = b->reverb;
+	struct tsf_voice_lowpass lowpass = b->lowpass;
+	int32_t i = 0, run;
 
-			buf -= 2;
+	// one-shot: a single run up to the sample end
+	if (!isLooping) numSamples = tsf_voice_kernel_run(b->sampleEndDbl - position, b->phaseIncr, numSamples);
 
-			*buf++ = __SSAT(out0, 16);
-			*buf++ = __SSAT(out1, 16);
+	while (i < numSamples)
+	{
+		// offset from idx to the interpolation partner, which is the loop start once idx reaches the loop end
+		uint32_t nextOffset = 1, at = (uint32_t)(position >> 32);
+		TSF_BOOL wraps = TSF_FALSE;
+		run = numSamples - i;
+		if (isLooping)
+		{
+			if (at < b->loopEnd) run = tsf_voice_kernel_run(((uint64_t)b->loopEnd << 32) - position, b->phaseIncr, run);
+			else run = 1, nextOffset = b->loopStart - at, wraps = TSF_TRUE;
 		}
+		if (isCompressed)
+		{
+			struct tsf_adpcm_window* w = b->window;
+			if (at - w->base >= TSF_ADPCM_BLOCK) tsf_adpcm_decode(b->adpcm, w, at);
+			base = w->base;
+			if (wraps) nextOffset = TSF_ADPCM_BLOCK + 1 - (at - base);
+			else run = tsf_voice_kernel_run(((uint64_t)(base + TSF_ADPCM_BLOCK) << 32) - position, b->phaseIncr, run);
+		}
+		else
+		{
+			span = TSF_NULL;
+#if TSF_SAMPLE_CACHE
+			if (b->spans)
+			{
+				if (isLooping && at - b->spans[1].start < b->spans[1].end - b->spans[1].start) span = &b->spans[1];
+				else if (!wraps && at - b->spans[0].start < b->spans[0].end - b->spans[0].start) span = &b->spans[0];
+			}
+#endif
+			if (span)
+			{
+				input = (const int16_t*)((const uint8_t*)span + span->data), base = span->start;
+				run = tsf_voice_kernel_run(((uint64_t)span->end << 32) - position, b->phaseIncr, run);
+			}
+			else input = b->input, base = 0;
+#ifdef TSF_SAMPLE_CACHE_STATS
+			b->tally[span == TSF_NULL] += run;
+#endif
+		}
+		i += run;
+
+		idx = at - base, frac = (uint32_t)position;
+		while (run--)
+		{
+			int32_t in;
+
+			if (isInterpolated)
+			{
+				int32_t alpha = (int32_t)(frac >> 17);
+				in = (int32_t)__SMUAD(__PKHBT((32767 - alpha), alpha, 16), __PKHBT(input[idx], input[idx + nextOffset], 16)) >> 15;
+				in = __SSAT(in, 16);
+			}
+			else in = input[idx];
+
+#ifndef TSF_NO_LOWPASS
+			if (isFiltered) in = __SSAT(tsf_voice_lowpass_process(&lowpass, in), 16);
+#endif
+
+			output[0] = __SMLABB(in, gainStereo, output[0]);
+			output[1] = __SMLABT(in, gainStereo, output[1]);
+			output += 2;
+#ifndef TSF_NO_CHORUS
+			*fxChorusBuf = __SMLABB(in, gainEffect, *fxChorusBuf);
+			fxChorusBuf++;
+#endif
+#ifndef TSF_NO_REVERB
+			*fxRevBuf = __SMLABT(in, gainEffect, *fxRevBuf);
+			fxRevBuf++;
+#endif
 
-		blkCnt = (samples) >> 1;
-		if ((samples) - (blkCnt << 1) ) {
-			in0 = *buf++;
-			out0 = tsf_voice_lowpass_process(e, in0);
-			buf -= 1;
-			*buf++ = __SSAT(out0, 16);
+			frac += incrFrac;
+			idx += incrInt + (frac < incrFrac);
 		}
+		position = ((uint64_t)(idx + base) << 32) | frac;
 
+		if (isLooping && position >= b->loopEndDbl)
+		{
+			position -= b->loopLengthDbl;
+			// the loop ends before the sample does, only a wrap landing past the loop can reach the end
+			if (position >= b->sampleEndDbl) break;
+		}
 	}
-}
-#endif
+
+	b->position = position;
+	b->lowpass = lowpass;
+	b->output = output, b->chorus = fxChorusBuf, b->reverb = fxRevBuf;
+	return i;
+}
+
+#define TSF_VOICE_KERNEL(adpcm, loop, filter, interp) \
+	static int32_t tsf_voice_kernel_##adpcm##loop##filter##interp(struct tsf_voice_block* b, int32_t numSamples) { return tsf_voice_kernel(b, numSamples, adpcm, loop, filter, interp); }
+TSF_VOICE_KERNEL(0, 0, 0, 0) TSF_VOICE_KERNEL(0, 0, 0, 1) TSF_VOICE_KERNEL(0, 0, 1, 0) TSF_VOICE_KERNEL(0, 0, 1, 1)
+TSF_VOICE_KERNEL(0, 1, 0, 0) TSF_VOICE_KERNEL(0, 1, 0, 1) TSF_VOICE_KERNEL(0, 1, 1, 0) TSF_VOICE_KERNEL(0, 1, 1, 1)
+TSF_VOICE_KERNEL(1, 0, 0, 0) TSF_VOICE_KERNEL(1, 0, 0, 1) TSF_VOICE_KERNEL(1, 0, 1, 0) TSF_VOICE_KERNEL(1, 0, 1, 1)
+TSF_VOICE_KERNEL(1, 1, 0, 0) TSF_VOICE_KERNEL(1, 1, 0, 1) TSF_VOICE_KERNEL(1, 1, 1, 0) TSF_VOICE_KERNEL(1, 1, 1, 1)
+#undef TSF_VOICE_KERNEL
+
+// [adpcm][looping][filtered][interpolated], drum one-shots without filter at unity pitch take kernel_0000
+static int32_t (* const tsf_voice_kernels[2][2][2][2])(struct tsf_voice_block* b, int32_t numSamples) = {
+	{ { { tsf_voice_kernel_0000, tsf_voice_kernel_0001 }, { tsf_voice_kernel_0010, tsf_voice_kernel_0011 } },
+	  { { tsf_voice_kernel_0100, tsf_voice_kernel_0101 }, { tsf_voice_kernel_0110, tsf_voice_kernel_0111 } } },
+	{ { { tsf_voice_kernel_1000, tsf_voice_kernel_1001 }, { tsf_voice_kernel_1010, tsf_voice_kernel_1011 } },
+	  { { tsf_voice_kernel_1100, tsf_voice_kernel_1101 }, { tsf_voice_kernel_1110, tsf_voice_kernel_1111 } } },
+};
 
 static void tsf_voice_render(tsf* f, struct tsf_voice* v, int32_t* outputBuffer, int32_t *chorusBuffer, int32_t *reverbBuffer, int32_t numSamples)
 {
 	struct tsf_region* region = v->region;
-	int16_t* input = f->fontSamplesOffset + f->fontSamples;
-	int32_t* output = outputBuffer;
+	struct tsf_voice_cold* vc = tsf_voice_getcold(f, v);
+	struct tsf_voice_block block;
 
 	// Cache some values, to give them at least some chance of ending up in registers.
 	TSF_BOOL updateModEnv = (region->modEnvToPitch || region->modEnvToFilterFc);
 	TSF_BOOL updateModLFO = (v->modlfo.delta && (region->modLfoToPitch || region->modLfoToFilterFc || region->modLfoToVolume));
 	TSF_BOOL updateVibLFO = (v->viblfo.delta && (region->vibLfoToPitch));
-	TSF_BOOL isLooping    = (v->loopStart < v->loopEnd);
-	uint32_t tmpLoopStart = v->loopStart, tmpLoopEnd = v->loopEnd;
-	uint64_t tmpSampleEndDbl = ((uint64_t)region->end) << 32, tmpLoopEndDbl = ((uint64_t)tmpLoopEnd + 1) << 32;
-	uint64_t tmpSourceSamplePosition = v->sourceSamplePosition;
-	struct tsf_voice_lowpass tmpLowpass = v->lowpass;
+	TSF_BOOL isLooping;
 
 	TSF_BOOL dynamicLowpass = (region->modLfoToFilterFc || region->modEnvToFilterFc);
 	float tmpSampleRate = f->outSampleRate, tmpInitialFilterFc, tmpModLfoToFilterFc, tmpModEnvToFilterFc;
@@ -1466,25 +2843,45 @@ static void tsf_voice_render(tsf* f, struct tsf_voice* v, int32_t* outputBuffer,
 	TSF_BOOL dynamicGain = (region->modLfoToVolume != 0);
 	float noteGain = 0, tmpModLfoToVolume;
 
+	// audibility estimate: a full scale sample at the note gain (which carries the channel volume and expression)
+	// through the louder pan side, with room for the volume LFO swing
+	float cullGain = (v->ampenv.segment == TSF_SEGMENT_RELEASE && f->govLevel >= TSF_GOVERNOR_CULL_RELEASE ? tsf_decibelsToGain(TSF_GOVERNOR_CULL_DB) : f->cullGain);
+	cullGain /= (v->panFactorLeft > v->panFactorRight ? v->panFactorLeft : v->panFactorRight);
+
 	if (dynamicLowpass) tmpInitialFilterFc = (float)region->initialFilterFc, tmpModLfoToFilterFc = (float)region->modLfoToFilterFc, tmpModEnvToFilterFc = (float)region->modEnvToFilterFc;
 	else tmpInitialFilterFc = 0, tmpModLfoToFilterFc = 0, tmpModEnvToFilterFc = 0;
 
 	if (dynamicPitchRatio) pitchRatio = 0, tmpModLfoToPitch = (float)region->modLfoToPitch, tmpVibLfoToPitch = (float)region->vibLfoToPitch, tmpModEnvToPitch = (float)region->modEnvToPitch;
 	else pitchRatio = tsf_timecents2Secsf(v->pitchInputTimecents) * v->pitchOutputFactor, tmpModLfoToPitch = 0, tmpVibLfoToPitch = 0, tmpModEnvToPitch = 0;
 
-	if (dynamicGain) tmpModLfoToVolume = (float)region->modLfoToVolume * 0.1f;
+	if (dynamicGain) tmpModLfoToVolume = (float)region->modLfoToVolume * 0.1f, cullGain /= tsf_decibelsToGain(tmpModLfoToVolume < 0 ? -tmpModLfoToVolume : tmpModLfoToVolume);
 	else noteGain = tsf_decibelsToGain(v->noteGainDB), tmpModLfoToVolume = 0;
 
 	struct tsf_channel *chan = &f->channels->channels[v->playingChannel];
 
-	int32_t *fxRevBuf = reverbBuffer;
-	int32_t *fxChorusBuf = chorusBuffer;
+	block.input = f->fontSamplesOffset + f->fontSamples;
+	block.adpcm = f->fontAdpcm;
+	block.window = (f->windows ? &f->windows[v - f->voices] : TSF_NULL);
+	block.spans = v->spans;
+#ifdef TSF_SAMPLE_CACHE_STATS
+	block.tally = f->sampleCacheTally;
+#endif
+	block.position = v->sourceSamplePosition;
+	block.sampleEndDbl = ((uint64_t)region->end) << 32;
+	block.loopStart = v->loopStart, block.loopEnd = v->loopEnd;
+	block.loopEndDbl = ((uint64_t)v->loopEnd + 1) << 32;
+	block.loopLengthDbl = ((uint64_t)(v->loopEnd - v->loopStart + 1)) << 32;
+	block.output = outputBuffer, block.chorus = chorusBuffer, block.reverb = reverbBuffer;
+	block.lowpass = v->lowpass;
+	// a loop ending past the sample end is never reached, play it as a one-shot
+	isLooping = (v->loopStart < v->loopEnd && block.loopEndDbl <= block.sampleEndDbl);
 
 	while (numSamples)
 	{
 		float gainMono;
-		int32_t gainLeft, gainRight, gainStereo;
-		int32_t gainChorus = 0, gainReverb = 0, gainEffect;
+		int32_t gainLeft, gainRight;
+		int32_t gainChorus = 0, gainReverb = 0;
+		TSF_BOOL isFiltered = TSF_FALSE, isInterpolated = TSF_FALSE;
 		int32_t blockSamples = (numSamples > TSF_RENDER_EFFECTSAMPLEBLOCK ? TSF_RENDER_EFFECTSAMPLEBLOCK : numSamples);
 		numSamples -= blockSamples;
 
@@ -1493,8 +2890,8 @@ static void tsf_voice_render(tsf* f, struct tsf_voice* v, int32_t* outputBuffer,
 		{
 			float fres = tmpInitialFilterFc + v->modlfo.level * tmpModLfoToFilterFc + v->modenv.level * tmpModEnvToFilterFc;
 			float lowpassFc = (fres <= 13500 ? tsf_cents2Hertz(fres) / tmpSampleRate : 1.0f);
-			tmpLowpass.active = (lowpassFc < 0.499f);
-			if (tmpLowpass.active) tsf_voice_lowpass_setup(&tmpLowpass, lowpassFc);
+			block.lowpass.active = (lowpassFc < 0.499f);
+			if (block.lowpass.active) tsf_voice_lowpass_setup(&block.lowpass, lowpassFc);
 		}
 #endif
 
@@ -1506,23 +2903,33 @@ static void tsf_voice_render(tsf* f, struct tsf_voice* v, int32_t* outputBuffer,
 
 		gainMono = noteGain * v->ampenv.level * 0.75f; // fix saturation problem
 
+		// once the envelope can only hold or fall, a voice under the threshold stays inaudible
+		if (v->ampenv.segment >= TSF_SEGMENT_DECAY && gainMono < cullGain)
+		{
+			tsf_voice_kill(f, v);
+			return;
+		}
+		vc->stealScore = tsf_voice_stealscore(v, vc->stealScore & TSF_STEAL_DRUM, gainMono);
+
 		// Update EG.
-		tsf_voice_envelope_process(&v->ampenv, blockSamples, tmpSampleRate);
-		if (updateModEnv) tsf_voice_envelope_process(&v->modenv, blockSamples, tmpSampleRate);
+		tsf_voice_envelope_process(&v->ampenv, &vc->ampenv, blockSamples, tmpSampleRate);
+		if (updateModEnv) tsf_voice_envelope_process(&v->modenv, &vc->modenv, blockSamples, tmpSampleRate);
 
 		// Update LFOs.
 		if (updateModLFO) tsf_voice_lfo_process(&v->modlfo, blockSamples);
 		if (updateVibLFO) tsf_voice_lfo_process(&v->viblfo, blockSamples);
 
-		uint64_t phaseIncr = float_to_fixed64(pitchRatio);
-		uint32_t pos, nextPos;
-		
+		block.phaseIncr = float_to_fixed64(pitchRatio);
+#ifndef TSF_NO_LOWPASS
+		isFiltered = block.lowpass.active;
+#endif
 #ifndef TSF_NO_INTERPOLATION
-		int32_t alpha;
+		// a unity pitch from a whole sample position never needs interpolation
+		isInterpolated = (f->govLevel < TSF_GOVERNOR_NO_INTERPOLATION && (block.phaseIncr != ((uint64_t)1 << 32) || (uint32_t)block.position));
 #endif
 
 		gainLeft = float_to_fixed(gainMono * v->panFactorLeft), gainRight = float_to_fixed(gainMono * v->panFactorRight);
-		gainStereo = __PKHBT(gainLeft, gainRight, 16);
+		block.gainStereo = __PKHBT(gainLeft, gainRight, 16);
 
 #ifndef TSF_NO_CHORUS
 		gainChorus = float_to_fixed(gainMono * chan->chorus);
@@ -1531,137 +2938,21 @@ static void tsf_voice_render(tsf* f, struct tsf_voice* v, int32_t* outputBuffer,
 		gainReverb = float_to_fixed(gainMono * chan->reverb);
 #endif
 
-		gainEffect = __PKHBT(gainChorus, gainReverb, 16);
-
-		int32_t samplesBuf[TSF_RENDER_EFFECTSAMPLEBLOCK];
-		int32_t *buf = samplesBuf;
-		int32_t in0, in1;
-		int32_t out0, out1, out2, out3;
-
-		int blkCnt, blckRemain;
+		block.gainEffect = __PKHBT(gainChorus, gainReverb, 16);
+		if (gainChorus) f->fxSent |= TSF_EFFECT_CHORUS;
+		if (gainReverb) f->fxSent |= TSF_EFFECT_REVERB;
 
-		blkCnt = blockSamples;
-		int samples;
+		tsf_voice_kernels[block.adpcm ? 1 : 0][isLooping ? 1 : 0][isFiltered ? 1 : 0][isInterpolated ? 1 : 0](&block, blockSamples);
 
-		while (blkCnt-- && tmpSourceSamplePosition < tmpSampleEndDbl)
+		if (block.position >= block.sampleEndDbl || v->ampenv.segment == TSF_SEGMENT_DONE)
 		{
-			pos = (tmpSourceSamplePosition >> 32);
-#ifndef TSF_NO_INTERPOLATION
-			alpha = (tmpSourceSamplePosition - ((uint64_t)pos << 32)) >> 17;
-			nextPos = (isLooping && pos >= tmpLoopEnd ? tmpLoopStart : pos + 1);
-
-			in0 = __PKHBT((32767 - alpha), alpha, 16);
-			in1 = __PKHBT(input[pos], input[nextPos], 16);
-
-			out0 = (int32_t)__SMUAD(in0, in1) >> 15;
-
-			*buf++ = __SSAT(out0, 16);
-#else
-			*buf++ = (int32_t)input[pos];
-#endif
-			tmpSourceSamplePosition += phaseIncr;
-
-			if (isLooping && tmpSourceSamplePosition >= tmpLoopEndDbl) tmpSourceSamplePosition -= ((uint64_t)(tmpLoopEnd - tmpLoopStart + 1)) << 32;
-		}
-
-		blckRemain = blkCnt + 1; // some samples are skipped
-
-		samples = blockSamples - blckRemain;
-
-#ifndef TSF_NO_LOWPASS
-		buf = samplesBuf;
-		tsf_voice_render_lowpass(&tmpLowpass, buf, samples);
-#endif
-
-#if 1
-		buf = samplesBuf;
-		blkCnt = (samples) >> 1;
-		while (blkCnt--)
-		{
-			in0 = __PKHBT(buf[0], buf[1], 16);
-			buf += 2;
-
-			out0 = (int32_t) * output++;
-			out1 = (int32_t) * output++;
-			out2 = (int32_t) * output++;
-			out3 = (int32_t) * output++;
-
-			out0 = __SMLABB(in0, gainStereo, out0);
-			out1 = __SMLABT(in0, gainStereo, out1);
-			out2 = __SMLATB(in0, gainStereo, out2);
-			out3 = __SMLATT(in0, gainStereo, out3);
-
-			output -= 4;
-
-			*output++ = out0;
-			*output++ = out1;
-			*output++ = out2;
-			*output++ = out3;
-
-#ifndef TSF_NO_CHORUS
-			out0 = (int32_t) * fxChorusBuf++;
-			out1 = (int32_t) * fxChorusBuf++;
-
-			out0 = __SMLABB(in0, gainEffect, out0);
-			out1 = __SMLATB(in0, gainEffect, out1);
-
-			fxChorusBuf -= 2;
-
-			*fxChorusBuf++ = out0;
-			*fxChorusBuf++ = out1;
-#endif
-
-#ifndef TSF_NO_REVERB
-			out0 = (int32_t) * fxRevBuf++;
-			out1 = (int32_t) * fxRevBuf++;
-
-			out0 = __SMLABT(in0, gainEffect, out0);
-			out1 = __SMLATT(in0, gainEffect, out1);
-
-			fxRevBuf -= 2;
-
-			*fxRevBuf++ = out0;
-			*fxRevBuf++ = out1;
-#endif
-		}
-
-		// remaining sample
-		blkCnt = (samples) >> 1;
-		if ((samples) - (blkCnt << 1) ) {
-			in0 = __PKHBT(buf[0], buf[0], 16);
-			buf += 1;
-
-			out0 = (int32_t) * output++;
-			out1 = (int32_t) * output++;
-
-			out0 = __SMLABB(in0, gainStereo, out0);
-			out1 = __SMLABT(in0, gainStereo, out1);
-
-			output -= 2;
-
-			*output++ = out0;
-			*output++ = out1;
-
-			out0 = (int32_t) * fxChorusBuf++;
-			out0 = __SMLABB(in0, gainEffect, out0);
-			fxChorusBuf -= 1;
-			*fxChorusBuf++ = out0;
-
-			out0 = (int32_t) * fxRevBuf++;
-			out0 = __SMLABT(in0, gainEffect, out0);
-			fxRevBuf -= 1;
-			*fxRevBuf++ = out1;
-		}
-#endif
-		if (tmpSourceSamplePosition >= tmpSampleEndDbl || v->ampenv.segment == TSF_SEGMENT_DONE)
-		{
-			tsf_voice_kill(v);
+			tsf_voice_kill(f, v);
 			return;
 		}
 	}
 
-	v->sourceSamplePosition = tmpSourceSamplePosition;
-	if (tmpLowpass.active || dynamicLowpass) v->lowpass = tmpLowpass;
+	v->sourceSamplePosition = block.position;
+	if (block.lowpass.active || dynamicLowpass) v->lowpass = block.lowpass;
 }
 
 #ifndef TSF_NO_REVERB
@@ -1684,7 +2975,44 @@ TSFDEF void tsf_chorus_setup(tsf* f, float delay, float decay, float speed, floa
 }
 #endif
 
+// instance with its voices and effects set up, the loaders fill in the presets and samples
+static tsf* tsf_create(int32_t presetNum)
+{
+	tsf* res = (tsf*)TSF_MALLOC(sizeof(tsf));
+	TSF_MEMSET(res, 0, sizeof(tsf));
+	res->presetNum = presetNum;
+	res->presets = (struct tsf_preset*)TSF_MALLOC(res->presetNum * sizeof(struct tsf_preset));
+	res->outSampleRate = 44100.0f;
+	res->cullGain = tsf_decibelsToGain(TSF_CULL_DB);
+	res->voicesMax = 128;
+
+#ifdef TSF_MEM_PROF
+	printf("MALLOC struct tsf_voice %ld * %ld = %ld\n", res->voicesMax, sizeof(struct tsf_voice), res->voicesMax * sizeof(struct tsf_voice));
+#endif
+	res->voices = (struct tsf_voice *)TSF_MALLOC(res->voicesMax * sizeof(struct tsf_voice));
+	res->voicesCold = (struct tsf_voice_cold *)TSF_MALLOC(res->voicesMax * sizeof(struct tsf_voice_cold));
+	res->voiceActive = (uint16_t *)TSF_MALLOC(res->voicesMax * 2 * sizeof(uint16_t));
+	res->voiceFree = res->voiceActive + res->voicesMax;
+	res->fades = (struct tsf_voice_fade *)TSF_MALLOC(TSF_STEAL_FADES * sizeof(struct tsf_voice_fade));
+	res->voiceNum = res->voicesMax;
+	tsf_voices_init(res);
+
+#ifndef TSF_NO_REVERB
+	tsf_reverb_setup(res, 0.0f, 0.7f, 0.7f); // default large hall
+#endif
+
+#ifndef TSF_NO_CHORUS
+	tsf_chorus_setup(res, 50.0f, 0.5f, 0.4f, 6.3f); // default chorus 3
+#endif
+	return res;
+}
+
 TSFDEF tsf* tsf_load(struct tsf_stream* stream)
+{
+	return tsf_load_image(stream, TSF_NULL, 0);
+}
+
+TSFDEF tsf* tsf_load_image(struct tsf_stream* stream, const void* image, int32_t image_size)
 {
 	tsf* res = TSF_NULL;
 	struct tsf_riffchunk chunkHead;
@@ -1693,12 +3021,15 @@ TSFDEF tsf* tsf_load(struct tsf_stream* stream)
 	int16_t* fontSamples = TSF_NULL;
 	uint32_t offset = 0;
 	uint32_t fontSampleCount = 0;
+	uint32_t fontSize, pdtaPos = 0, pdtaSize = 0;
 
 	if (!tsf_riffchunk_read(TSF_NULL, &chunkHead, stream) || !TSF_FourCCEquals(chunkHead.id, "sfbk"))
 	{
 		//if (e) *e = TSF_INVALID_NOSF2HEADER;
 		return res;
 	}
+	// RIFF header and form type included
+	fontSize = chunkHead.size + 12;
 
 	// Read hydra and locate sample data.
 	TSF_MEMSET(&hydra, 0, sizeof(hydra));
@@ -1707,6 +3038,9 @@ TSFDEF tsf* tsf_load(struct tsf_stream* stream)
 		struct tsf_riffchunk chunk;
 		if (TSF_FourCCEquals(chunkList.id, "pdta"))
 		{
+			// list header and type included
+			pdtaPos = stream->tell(stream->data) - 12;
+			pdtaSize = chunkList.size + 12;
 			while (tsf_riffchunk_read(&chunkList, &chunk, stream))
 			{
 #define HandleChunk(chunkName) (TSF_FourCCEquals(chunk.id, #chunkName) && !(chunk.size % chunkName##SizeInFile)) \
@@ -1748,40 +3082,162 @@ TSFDEF tsf* tsf_load(struct tsf_stream* stream)
 //	}
 	else
 	{
-		res = (tsf*)TSF_MALLOC(sizeof(tsf));
-		TSF_MEMSET(res, 0, sizeof(tsf));
-		res->presetNum = hydra.phdrNum - 1;
-		res->presets = (struct tsf_preset*)TSF_MALLOC(res->presetNum * sizeof(struct tsf_preset));
+		res = tsf_create(hydra.phdrNum - 1);
 		res->fontSamples = fontSamples;
 		res->fontSamplesOffset = offset / sizeof(int16_t);
 		res->fontSampleCount = fontSampleCount;
-		res->outSampleRate = 44100.0f;
-		res->voicesMax = 128;
-
-#ifdef TSF_MEM_PROF
-		printf("MALLOC struct tsf_voice %ld * %ld = %ld\n", res->voicesMax, sizeof(struct tsf_voice), res->voicesMax * sizeof(struct tsf_voice));
-#endif
-		res->voices = (struct tsf_voice *)TSF_MALLOC(res->voicesMax * sizeof(struct tsf_voice));
-		for (int i = 0; i < res->voicesMax; i++) {
-			res->voices[i].mutex = TSF_MUTEX_INIT;
-			res->voices[i].playingPreset = -1;
-		}
-		res->voiceNum = res->voicesMax;
-
 		res->stream = stream;
 		res->hydra = hydra;
-		res->gc = 0;
+		res->hydraBase = (stream->map ? (const uint8_t*)stream->map(stream->data, fontSize) : TSF_NULL);
+		res->pdtaPos = pdtaPos;
+		res->pdtaSize = pdtaSize;
+		res->instrumentNum = (hydra.instNum > 1 ? hydra.instNum - 1 : 0);
+		res->instruments = (struct tsf_instrument*)TSF_MALLOC((res->instrumentNum + 1) * sizeof(struct tsf_instrument));
+		TSF_MEMSET(res->instruments, 0, (res->instrumentNum + 1) * sizeof(struct tsf_instrument));
+		res->arena = (uint8_t*)TSF_MALLOC(TSF_REGION_ARENA + TSF_SAMPLE_CACHE);
+		res->arenaSize = (res->arena ? TSF_REGION_ARENA + TSF_SAMPLE_CACHE : 0);
+		res->cacheBudget = (TSF_PRESET_CACHE < res->arenaSize ? TSF_PRESET_CACHE : res->arenaSize);
+		res->sampleCacheBudget = (res->arena ? TSF_SAMPLE_CACHE : 0);
+
+		if (!tsf_image_read(res, (const uint8_t*)image, (uint32_t)image_size)) tsf_preload_presets(res);
+	}
+	return res;
+}
 
-#ifndef TSF_NO_REVERB
-		tsf_reverb_setup(res, 0.0f, 0.7f, 0.7f); // default large hall
-#endif
+#define TSF_NATIVE_VERSION 4
+#define TSF_NATIVE_NOINDEX 0xFFFFFFFFu
+#define TSF_NATIVE_ADPCM 1 // the samples are tsf_adpcm_encode blocks instead of int16
 
-#ifndef TSF_NO_CHORUS
-		tsf_chorus_setup(res, 50.0f, 0.5f, 0.4f, 6.3f); // default chorus 3
-#endif
+// Native font: header, preset entries in sorted order, instrument entries, bank/program hash, refs, region tables
+// (own regions of the presets, then the shared ones of the instruments), key indexes and the samples, each section
+// starting 4-byte aligned
+struct tsf_native_header
+{
+	tsf_fourcc id; // "TSFN"
+	uint32_t version; // TSF_NATIVE_VERSION << 16 | sizeof(struct tsf_region), the tables are stored as is
+	uint32_t size, flags;
+	uint32_t presetNum, presetHashMask, instrumentNum, refNum, regionNum, keyIndexNum, sampleCount;
+	uint32_t presetsPos, instrumentsPos, hashPos, refsPos, regionsPos, keyIndexPos, samplesPos;
+};
 
-		tsf_preload_presets(res);
+struct tsf_native_preset
+{
+	tsf_char20 presetName;
+	uint16_t preset, bank;
+	uint32_t regionNum, privateNum, firstRef, firstRegion;
+	uint32_t keyIndex; // first entry in the key indexes, TSF_NATIVE_NOINDEX scans all refs
+};
+
+struct tsf_native_instrument
+{
+	uint32_t regionNum, firstRegion;
+};
+
+// the section of count items at pos lies inside the font and is aligned for in-place use
+static TSF_BOOL tsf_native_section(const struct tsf_native_header* h, uint32_t pos, uint32_t count, uint32_t itemSize)
+{
+	return !(pos & 3) && pos <= h->size && count <= (h->size - pos) / itemSize;
+}
+
+// The tables are used in place from read-only memory, so where the SF2 path clamps a region a native font is rejected.
+// A region plays samples [offset, end) within the font and a loop it takes ends inside it.
+static TSF_BOOL tsf_native_region_valid(const struct tsf_region* r, uint32_t sampleCount)
+{
+	if (r->offset > r->end || r->end > sampleCount) return TSF_FALSE;
+	return (r->loop_mode == TSF_LOOPMODE_NONE || r->loop_start >= r->loop_end || r->loop_end < sampleCount);
+}
+
+// refs point into the own table of the preset or into an instrument table, the key index lists refs in key order
+static TSF_BOOL tsf_native_preset_valid(const tsf* res, const struct tsf_preset* preset)
+{
+	const uint16_t* index = preset->keyIndex;
+	int32_t i;
+
+	for (i = 0; i < preset->regionNum; i++)
+	{
+		const struct tsf_region_ref* ref = &preset->refs[i];
+		if (ref->table == TSF_REF_PRIVATE ? ref->region >= preset->privateNum
+			: ref->table >= res->instrumentNum || ref->region >= res->instruments[ref->table].regionNum) return TSF_FALSE;
+	}
+	for (i = 0; index && i < TSF_KEY_INDEX - 1; i++)
+		if (index[i] > index[i + 1]) return TSF_FALSE;
+	for (i = 0; index && i < index[TSF_KEY_INDEX - 1]; i++)
+		if (index[TSF_KEY_INDEX + i] >= preset->regionNum) return TSF_FALSE;
+	return TSF_TRUE;
+}
+
+TSFDEF tsf* tsf_load_native(const void* data, int32_t size)
+{
+	const uint8_t* base = (const uint8_t*)data;
+	struct tsf_native_header h;
+	struct tsf_native_preset e;
+	struct tsf_native_instrument ie;
+	tsf* res;
+	uint32_t i;
+
+	if (!data || size < (int32_t)sizeof(h)) return TSF_NULL;
+	TSF_MEMCPY(&h, base, sizeof(h));
+	if (!TSF_FourCCEquals(h.id, "TSFN") || h.version != (TSF_NATIVE_VERSION << 16 | sizeof(struct tsf_region))) return TSF_NULL;
+	if (h.size > (uint32_t)size || (h.flags & ~TSF_NATIVE_ADPCM) || !h.presetNum || h.presetNum > 0xFFFF || h.instrumentNum >= TSF_REF_PRIVATE || h.presetHashMask > 0xFFFF || (h.presetHashMask & (h.presetHashMask + 1))) return TSF_NULL;
+	if (!tsf_native_section(&h, h.presetsPos, h.presetNum, sizeof(e)) || !tsf_native_section(&h, h.instrumentsPos, h.instrumentNum, sizeof(ie))
+		|| !tsf_native_section(&h, h.hashPos, h.presetHashMask + 1, sizeof(uint16_t)) || !tsf_native_section(&h, h.refsPos, h.refNum, sizeof(struct tsf_region_ref))
+		|| !tsf_native_section(&h, h.regionsPos, h.regionNum, sizeof(struct tsf_region)) || !tsf_native_section(&h, h.keyIndexPos, h.keyIndexNum, sizeof(uint16_t))
+		|| !(h.flags & TSF_NATIVE_ADPCM ? tsf_native_section(&h, h.samplesPos, h.sampleCount / TSF_ADPCM_BLOCK + 2, TSF_ADPCM_BLOCK_BYTES)
+			: tsf_native_section(&h, h.samplesPos, h.sampleCount, sizeof(int16_t)))) return TSF_NULL;
+
+	res = tsf_create((int32_t)h.presetNum);
+	res->instrumentNum = (int32_t)h.instrumentNum;
+	res->instruments = (struct tsf_instrument*)TSF_MALLOC((h.instrumentNum + 1) * sizeof(struct tsf_instrument));
+	TSF_MEMSET(res->instruments, 0, (h.instrumentNum + 1) * sizeof(struct tsf_instrument));
+	res->presetHash = (uint16_t*)TSF_MALLOC((h.presetHashMask + 1) * sizeof(uint16_t));
+	for (i = 0; i < h.instrumentNum; i++)
+	{
+		TSF_MEMCPY(&ie, base + h.instrumentsPos + i * sizeof(ie), sizeof(ie));
+		if (ie.regionNum > 0xFFFF || ie.firstRegion > h.regionNum || ie.regionNum > h.regionNum - ie.firstRegion) { tsf_close(res); return TSF_NULL; }
+		res->instruments[i].regions = (struct tsf_region*)(base + h.regionsPos) + ie.firstRegion;
+		res->instruments[i].regionNum = (uint16_t)ie.regionNum;
+	}
+	for (i = 0; i < h.regionNum; i++)
+		if (!tsf_native_region_valid((const struct tsf_region*)(base + h.regionsPos) + i, h.sampleCount)) { tsf_close(res); return TSF_NULL; }
+	for (i = 0; i < h.presetNum; i++)
+	{
+		struct tsf_preset* preset = &res->presets[i];
+		TSF_MEMCPY(&e, base + h.presetsPos + i * sizeof(e), sizeof(e));
+		if (e.firstRef > h.refNum || e.regionNum > h.refNum - e.firstRef || e.firstRegion > h.regionNum || e.privateNum > h.regionNum - e.firstRegion
+			|| (e.keyIndex != TSF_NATIVE_NOINDEX && (e.keyIndex > h.keyIndexNum || h.keyIndexNum - e.keyIndex < TSF_KEY_INDEX
+				|| h.keyIndexNum - e.keyIndex - TSF_KEY_INDEX < ((const uint16_t*)(base + h.keyIndexPos))[e.keyIndex + TSF_KEY_INDEX - 1])))
+		{
+			tsf_close(res);
+			return TSF_NULL;
+		}
+#ifndef TSF_NO_PRESET_NAME
+		TSF_MEMCPY(preset->presetName, e.presetName, sizeof(preset->presetName));
+#endif
+		preset->preset = e.preset;
+		preset->bank = e.bank;
+		preset->regionNum = (int32_t)e.regionNum;
+		preset->privateNum = (int32_t)e.privateNum;
+		preset->pphdrIdx = (int32_t)i;
+		preset->imageTables = 0;
+		// ready for good: the tables are never freed, and with no arena the cache never evicts
+		preset->refs = (struct tsf_region_ref*)(base + h.refsPos) + e.firstRef;
+		preset->regions = (struct tsf_region*)(base + h.regionsPos) + e.firstRegion;
+		preset->spans = TSF_NULL;
+		preset->keyIndex = (e.keyIndex == TSF_NATIVE_NOINDEX ? TSF_NULL : (uint16_t*)(base + h.keyIndexPos) + e.keyIndex);
+		preset->loaded = TSF_TRUE;
+		preset->refCount = 0;
+		preset->lastUse = 0;
+		if (!tsf_native_preset_valid(res, preset)) { tsf_close(res); return TSF_NULL; }
 	}
+	res->presetHashMask = h.presetHashMask;
+	TSF_MEMCPY(res->presetHash, base + h.hashPos, (h.presetHashMask + 1) * sizeof(uint16_t));
+	if (h.flags & TSF_NATIVE_ADPCM)
+	{
+		res->fontAdpcm = base + h.samplesPos;
+		res->windows = (struct tsf_adpcm_window*)TSF_MALLOC((res->voicesMax + TSF_STEAL_FADES) * sizeof(struct tsf_adpcm_window));
+	}
+	else res->fontSamples = (int16_t*)(base + h.samplesPos);
+	res->fontSampleCount = h.sampleCount;
 	return res;
 }
 
@@ -1789,34 +3245,43 @@ TSFDEF void tsf_set_max_voices(tsf* f, int max) {
 #ifdef TSF_MEM_PROF
 	printf("REALLOC struct tsf_voice %ld * %ld = %ld\n", f->voicesMax, sizeof(struct tsf_voice), f->voicesMax * sizeof(struct tsf_voice));
 #endif
-	for (int i = 0; i < f->voicesMax; i++) {
-		TSF_MUTEX_DEINIT(f->voices[i].mutex);
+	TSF_CRITICAL_ENTER();
+	if (max > TSF_MAX_VOICES) max = TSF_MAX_VOICES;
+	if (f->channels)
+	{
+		// every voice is dropped below, clear the channel chains with them
+		for (int i = 0; i < f->channels->channelNum; i++)
+		{
+			TSF_MEMSET(f->channels->channels[i].keyVoice, TSF_VOICE_NONE, sizeof(f->channels->channels[i].keyVoice));
+			TSF_MEMSET(f->channels->channels[i].groupVoice, TSF_VOICE_NONE, sizeof(f->channels->channels[i].groupVoice));
+			f->channels->channels[i].voiceCount = 0;
+		}
 	}
 	f->voicesMax = max;
 	f->voices = (struct tsf_voice *)TSF_REALLOC(f->voices, f->voicesMax * sizeof(struct tsf_voice));
-	for (int i = 0; i < f->voicesMax; i++) {
-		f->voices[i].mutex = TSF_MUTEX_INIT;
-		f->voices[i].playingPreset = -1;
-	}
+	f->voicesCold = (struct tsf_voice_cold *)TSF_REALLOC(f->voicesCold, f->voicesMax * sizeof(struct tsf_voice_cold));
+	if (f->windows) f->windows = (struct tsf_adpcm_window *)TSF_REALLOC(f->windows, (f->voicesMax + TSF_STEAL_FADES) * sizeof(struct tsf_adpcm_window));
+	f->voiceActive = (uint16_t *)TSF_REALLOC(f->voiceActive, f->voicesMax * 2 * sizeof(uint16_t));
+	f->voiceFree = f->voiceActive + f->voicesMax;
 	f->voiceNum = f->voicesMax;
+	tsf_voices_init(f);
+	TSF_CRITICAL_EXIT();
 }
 
 TSFDEF void tsf_close(tsf* f)
 {
-	struct tsf_preset *preset, *presetEnd;
 	if (!f) return;
 
-	for (int i = 0; i < f->voicesMax; i++) {
-		TSF_MUTEX_DEINIT(f->voices[i].mutex);
-	}
-
-	for (preset = f->presets, presetEnd = preset + f->presetNum; preset != presetEnd; preset++) {
-		if (preset->loaded)
-			TSF_FREE(preset->regions);
-	}
+	TSF_FREE(f->arena);
 	TSF_FREE(f->presets);
+	TSF_FREE(f->presetHash);
+	TSF_FREE(f->instruments);
 	//TSF_FREE(f->fontSamples);
 	TSF_FREE(f->voices);
+	TSF_FREE(f->voicesCold);
+	TSF_FREE(f->voiceActive);
+	TSF_FREE(f->fades);
+	TSF_FREE(f->windows);
 	if (f->channels) { TSF_FREE(f->channels->channels); TSF_FREE(f->channels); }
 	TSF_FREE(f->stream);
 	TSF_FREE(f);
@@ -1824,20 +3289,25 @@ TSFDEF void tsf_close(tsf* f)
 
 TSFDEF void tsf_reset(tsf* f)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1 && (v->ampenv.segment < TSF_SEGMENT_RELEASE || v->ampenv.parameters.release))
-			tsf_voice_endquick(v, f->outSampleRate);
+	int32_t i;
+	for (i = 0; i < f->voiceActiveNum; i++)
+	{
+		struct tsf_voice *v = &f->voices[f->voiceActive[i]];
+		if (v->ampenv.segment < TSF_SEGMENT_RELEASE || tsf_voice_getcold(f, v)->ampenv.release)
+			tsf_voice_endquick(f, v);
+	}
 	if (f->channels) { TSF_FREE(f->channels->channels); TSF_FREE(f->channels); f->channels = TSF_NULL; }
 }
 
 TSFDEF int32_t tsf_get_presetindex(const tsf* f, int32_t bank, int32_t preset_number)
 {
-	const struct tsf_preset *presets;
-	int32_t i, iMax;
-	for (presets = f->presets, i = 0, iMax = f->presetNum; i < iMax; i++)
-		if (presets[i].preset == preset_number && presets[i].bank == bank)
-			return i;
+	uint32_t slot;
+	const struct tsf_preset* preset;
+	for (slot = tsf_preset_hashslot(f, bank, preset_number); f->presetHash[slot]; slot = (slot + 1) & f->presetHashMask)
+	{
+		preset = &f->presets[f->presetHash[slot] - 1];
+		if (preset->preset == preset_number && preset->bank == bank) return f->presetHash[slot] - 1;
+	}
 	return -1;
 }
 
@@ -1872,80 +3342,115 @@ TSFDEF void tsf_set_volume(tsf* f, float global_volume)
 	f->globalGainDB = (global_volume == 1.0f ? 0 : -tsf_gainToDecibels(1.0f / global_volume));
 }
 
-static struct tsf_voice *tsf_reusable_voice(tsf * f, float cap) {
-	struct tsf_voice *reuseVoice, *v, *vEnd;
-	reuseVoice = TSF_NULL;
-	float minLevel = 2.0f;
-	v = f->voices, vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++) {
-		TSF_MUTEX_LOCK(v->mutex);
-		if ((v->ampenv.segment == TSF_SEGMENT_DECAY || v->ampenv.segment == TSF_SEGMENT_SUSTAIN || v->ampenv.segment == TSF_SEGMENT_RELEASE || v->ampenv.segment == TSF_SEGMENT_DONE))
-			if (v->locked == 0 && v->ampenv.level < minLevel) {
-				minLevel = v->ampenv.level;
-				reuseVoice = v;
-			}
-		TSF_MUTEX_UNLOCK(v->mutex);
-	}
+TSFDEF void tsf_set_cull_threshold(tsf* f, float threshold_db)
+{
+	f->cullGain = tsf_decibelsToGain(threshold_db);
+}
 
-	if (minLevel < cap)
-		return reuseVoice;
-	else
-		return TSF_NULL;
+TSFDEF void tsf_set_governor(tsf* f, uint32_t (*cycles)(void), uint32_t cycles_per_sample)
+{
+	f->govCycles = (cycles_per_sample ? cycles : TSF_NULL);
+	f->govCyclesPerSample = cycles_per_sample;
+	f->govLevel = TSF_GOVERNOR_FULL, f->govLoad = 0, f->govCalm = 0;
+}
+
+TSFDEF int32_t tsf_governor_level(tsf* f)
+{
+	return f->govLevel;
 }
 
+TSFDEF int32_t tsf_governor_load(tsf* f)
+{
+	return f->govLoad;
+}
+
+TSFDEF int32_t tsf_region_arena_used(tsf* f)
+{
+	return (int32_t)f->arenaUsed;
+}
+
+TSFDEF int32_t tsf_region_arena_failures(tsf* f)
+{
+	return (int32_t)f->arenaFailures;
+}
 
 TSFDEF void tsf_note_on(tsf* f, int32_t preset_index, int32_t key, float vel)
 {
 	int16_t midiVelocity = (int16_t)(vel * 127);
-	int32_t voicePlayIndex;
-	struct tsf_region *region, *regionEnd;
+	int32_t voicePlayIndex, n, nEnd;
+	const uint16_t* keyRegions;
+	struct tsf_preset* preset;
+	struct tsf_region *region;
+	const struct tsf_sample_span* spans;
 
-	if (preset_index < 0 || preset_index >= f->presetNum) return;
+	if (preset_index < 0 || preset_index >= f->presetNum || key < 0 || key > 127) return;
 	if (vel <= 0.0f) { tsf_note_off(f, preset_index, key); return; }
 
-	if (f->presets[preset_index].loaded == TSF_FALSE) {
+	if (!tsf_preset_use(f, preset_index)) {
+		// not ready yet: in deferred mode the loader task gets to it, the note is dropped
+		if (f->presetDeferred) return;
 		tsf_load_preset(f, preset_index);
+		if (f->presets[preset_index].loaded == TSF_FALSE) return; // out of arena
 	}
 
-	// Play all matching regions.
+	// Play all matching regions, the key index narrows them to the ones covering the key.
+	preset = &f->presets[preset_index];
+	keyRegions = (preset->keyIndex ? preset->keyIndex + TSF_KEY_INDEX : TSF_NULL);
+	n = (keyRegions ? preset->keyIndex[key] : 0);
+	nEnd = (keyRegions ? preset->keyIndex[key + 1] : preset->regionNum);
+	TSF_CRITICAL_ENTER();
 	voicePlayIndex = f->voicePlayIndex++;
-	for (region = f->presets[preset_index].regions, regionEnd = region + f->presets[preset_index].regionNum; region != regionEnd; region++)
+	for (; n < nEnd; n++)
 	{
-		struct tsf_voice *voice, *v, *vEnd; TSF_BOOL doLoop; float lowpassFilterQDB, lowpassFc;
-		if (key < region->lokey || key > region->hikey || midiVelocity < region->lovel || midiVelocity > region->hivel) continue;
+		struct tsf_voice *voice, *v; struct tsf_voice_cold *voiceCold; TSF_BOOL doLoop; float lowpassFilterQDB, lowpassFc; int32_t i;
+		const struct tsf_region_ref* ref = &preset->refs[keyRegions ? keyRegions[n] : n];
+		if (key < ref->lokey || key > ref->hikey || midiVelocity < ref->lovel || midiVelocity > ref->hivel) continue;
+		region = (ref->table == TSF_REF_PRIVATE ? &preset->regions[ref->region] : &f->instruments[ref->table].regions[ref->region]);
+		spans = (ref->table == TSF_REF_PRIVATE ? preset->spans : f->instruments[ref->table].spans);
 
-		voice = TSF_NULL, v = f->voices, vEnd = v + f->voiceNum;
-		if (region->group)
+		if (region->group && f->channels)
 		{
-			for (; v != vEnd; v++)
-				if (v->playingPreset == preset_index && v->region->group == region->group) tsf_voice_endquick(v, f->outSampleRate);
-				else if (v->playingPreset == -1 && !voice) voice = v;
+			// exclusive class is cut per channel through its class chain
+			uint8_t idx = f->channels->channels[f->channels->activeChannel].groupVoice[region->group & (TSF_GROUP_SLOTS - 1)];
+			for (; idx != TSF_VOICE_NONE; idx = f->voicesCold[idx].groupNext)
+			{
+				v = &f->voices[idx];
+				if (v->playingPreset == preset_index && v->region->group == region->group) tsf_voice_endquick(f, v);
+			}
 		}
-		else for (; v != vEnd; v++) if (v->playingPreset == -1) { voice = v; break; }
-		if (!voice)
+		else if (region->group)
 		{
-			voice = tsf_reusable_voice(f, TSF_REUSE_LEVEL);
+			for (i = 0; i < f->voiceActiveNum; i++)
+			{
+				v = &f->voices[f->voiceActive[i]];
+				if (v->playingPreset == preset_index && v->region->group == region->group) tsf_voice_endquick(f, v);
+			}
 		}
+		// over budget the governor only lets new notes take over existing voices
+		voice = (f->govLevel < TSF_GOVERNOR_CAP_VOICES || f->voiceActiveNum < f->govVoiceCap ? tsf_voice_alloc(f) : TSF_NULL);
+		if (!voice) voice = tsf_voice_steal(f, voicePlayIndex);
 
 		if (voice) {
-			TSF_MUTEX_LOCK(voice->mutex);
-			voice->locked = 1;
+			voiceCold = tsf_voice_getcold(f, voice);
 			voice->region = region;
+			voice->spans = (spans ? spans + ref->region * 2 : TSF_NULL);
 			voice->playingPreset = preset_index;
-			voice->playingKey = key;
-			voice->playIndex = voicePlayIndex;
-			voice->noteGainDB = f->globalGainDB - region->attenuation - tsf_gainToDecibels(1.0f / vel);
+			voiceCold->playingKey = key;
+			voiceCold->playIndex = voicePlayIndex;
+			voiceCold->stealScore = ((preset->bank & 128) ? TSF_STEAL_DRUM : 0) | TSF_STEAL_HELD | 0xFF;
+			voice->noteGainDB = f->globalGainDB - region->attenuation * 0.1f - tsf_gainToDecibels(1.0f / vel);
 
 			if (f->channels)
 			{
 				f->channels->setupVoice(f, voice);
+				tsf_voice_index(f, voice);
 			}
 			else
 			{
-				tsf_voice_calcpitchratio(voice, 0, f->outSampleRate);
+				tsf_voice_calcpitchratio(f, voice, 0);
 				// The SFZ spec is silent about the pan curve, but a 3dB pan law seems common. This sqrt() curve matches what Dimension LE does; Alchemy Free seems closer to sin(adjustedPan * pi/2).
-				voice->panFactorLeft  = TSF_SQRTF(0.5f - region->pan);
-				voice->panFactorRight = TSF_SQRTF(0.5f + region->pan);
+				voice->panFactorLeft  = TSF_SQRTF(0.5f - region->pan * 0.001f);
+				voice->panFactorRight = TSF_SQRTF(0.5f + region->pan * 0.001f);
 			}
 
 			// Offset/end.
@@ -1955,10 +3460,11 @@ TSFDEF void tsf_note_on(tsf* f, int32_t preset_index, int32_t key, float vel)
 			doLoop = (region->loop_mode != TSF_LOOPMODE_NONE && region->loop_start < region->loop_end);
 			voice->loopStart = (doLoop ? region->loop_start : 0);
 			voice->loopEnd = (doLoop ? region->loop_end : 0);
+			if (f->windows) tsf_adpcm_window_start(f->fontAdpcm, &f->windows[voice - f->voices], voice->loopStart, voice->loopEnd);
 
 			// Setup envelopes.
-			tsf_voice_envelope_setup(&voice->ampenv, &region->ampenv, key, midiVelocity, TSF_TRUE, f->outSampleRate);
-			tsf_voice_envelope_setup(&voice->modenv, &region->modenv, key, midiVelocity, TSF_FALSE, f->outSampleRate);
+			tsf_voice_envelope_setup(&voice->ampenv, &voiceCold->ampenv, &region->ampenv, key, midiVelocity, TSF_TRUE, f->outSampleRate);
+			tsf_voice_envelope_setup(&voice->modenv, &voiceCold->modenv, &region->modenv, key, midiVelocity, TSF_FALSE, f->outSampleRate);
 
 #ifndef TSF_NO_LOWPASS
 			// Setup lowpass filter.
@@ -1970,41 +3476,86 @@ TSFDEF void tsf_note_on(tsf* f, int32_t preset_index, int32_t key, float vel)
 			if (voice->lowpass.active) tsf_voice_lowpass_setup(&voice->lowpass, lowpassFc);
 #endif
 			// Setup LFO filters.
-			tsf_voice_lfo_setup(&voice->modlfo, region->delayModLFO, region->freqModLFO, f->outSampleRate);
-			tsf_voice_lfo_setup(&voice->viblfo, region->delayVibLFO, region->freqVibLFO, f->outSampleRate);
-			voice->locked = 0;
-			TSF_MUTEX_UNLOCK(voice->mutex);
+			tsf_voice_lfo_setup(&voice->modlfo, tsf_region_secs(region->delayModLFO), region->freqModLFO, f->outSampleRate);
+			tsf_voice_lfo_setup(&voice->viblfo, tsf_region_secs(region->delayVibLFO), region->freqVibLFO, f->outSampleRate);
 		} else {
 			// ignore note on
 		}
 	}
+	TSF_CRITICAL_EXIT();
 }
 
-// unload unused presets
+// Collection: evicts for a load that did not fit and compacts the arena over the holes. Presets otherwise
+// stay cached, it runs from the render in eager mode and from tsf_load_pending() in deferred mode.
 TSFDEF void tsf_gc(tsf * f) {
-	if (f->gc == TSF_GC_F) {
-		f->gc = 0;
-		struct tsf_voice *v, *vEnd;
-
-		v = f->voices, vEnd = v + f->voiceNum;
-		for (; v != vEnd; v++) {
-			if (v->playingPreset != -1) {
-				f->presets[v->playingPreset].refCount++;
-			}
-		}
+	if (!f->cacheReclaim) return;
+	f->cacheReclaim = TSF_FALSE;
+	if (f->cacheNeed)
+	{
+		// the spans left after the eviction take at most what they take now
+		uint32_t room = f->arenaSize - f->sampleCacheUsed;
+		tsf_cache_evict(f, (f->cacheNeed < room ? room - f->cacheNeed : 0));
+		f->cacheNeed = 0;
+	}
+	if (f->arenaHoles) tsf_arena_compact(f);
+}
 
-		for (int32_t i = 0; i < f->presetNum; i++) {
-			if (f->presets[i].refCount == 0 && f->presets[i].loaded == TSF_TRUE) {
-#ifdef TSF_MEM_PROF
-				printf("GC unload preset %d\n", i);
-#endif
-				tsf_unload_preset(f, i);
-			}
-			f->presets[i].refCount = 0;
+TSFDEF void tsf_set_preset_loader(tsf* f, int32_t flag_deferred)
+{
+	f->presetDeferred = (flag_deferred ? TSF_TRUE : TSF_FALSE);
+}
+
+// preset the channel selects, or -1 past the last channel: the MIDI side may grow the channels meanwhile
+static int32_t tsf_channel_selected(tsf* f, int32_t channel)
+{
+	int32_t preset_index = -1;
+	TSF_CRITICAL_ENTER();
+	if (f->channels && channel < f->channels->channelNum) preset_index = f->channels->channels[channel].presetIndex;
+	TSF_CRITICAL_EXIT();
+	return preset_index;
+}
+
+TSFDEF int32_t tsf_load_pending(tsf* f)
+{
+	int32_t i, pass, preset_index, loaded = 0;
+	// a load that did not fit gets a second pass once the collection made room
+	for (pass = 0; pass < 2; pass++)
+	{
+		if (f->presetDeferred) tsf_gc(f);
+		for (i = 0; (preset_index = tsf_channel_selected(f, i)) >= 0; i++)
+		{
+			if (preset_index >= f->presetNum || f->presets[preset_index].loaded) continue;
+			tsf_load_preset(f, preset_index);
+			if (f->presets[preset_index].loaded) loaded++;
 		}
+		if (!f->presetDeferred || !f->cacheNeed) break;
 	}
+	return loaded;
+}
 
-	f->gc++;
+TSFDEF void tsf_set_preset_cache(tsf* f, int32_t budget_bytes)
+{
+	f->cacheBudget = ((uint32_t)budget_bytes < f->arenaSize ? (uint32_t)budget_bytes : f->arenaSize);
+}
+
+TSFDEF void tsf_preset_cache_stats(tsf* f, int32_t* hits, int32_t* misses, int32_t* evictions)
+{
+	if (hits) *hits = (int32_t)f->cacheHits;
+	if (misses) *misses = (int32_t)f->cacheMisses;
+	if (evictions) *evictions = (int32_t)f->cacheEvictions;
+}
+
+TSFDEF void tsf_set_sample_cache(tsf* f, int32_t budget_bytes)
+{
+	// the kernels of a build without TSF_SAMPLE_CACHE never read the copies, make none
+	f->sampleCacheBudget = (!TSF_SAMPLE_CACHE ? 0 : (uint32_t)budget_bytes < f->arenaSize ? (uint32_t)budget_bytes : f->arenaSize);
+}
+
+TSFDEF void tsf_sample_cache_stats(tsf* f, int32_t* hits, int32_t* misses, int32_t* resident_bytes)
+{
+	if (hits) *hits = (int32_t)f->sampleCacheTally[0];
+	if (misses) *misses = (int32_t)f->sampleCacheTally[1];
+	if (resident_bytes) *resident_bytes = (int32_t)f->sampleCacheUsed;
 }
 
 TSFDEF int32_t tsf_bank_note_on(tsf* f, int32_t bank, int32_t preset_number, int32_t key, float vel)
@@ -2017,22 +3568,30 @@ TSFDEF int32_t tsf_bank_note_on(tsf* f, int32_t bank, int32_t preset_number, int
 
 TSFDEF void tsf_note_off(tsf* f, int32_t preset_index, int32_t key)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum, *vMatchFirst = TSF_NULL, *vMatchLast = TSF_NULL;
-	for (; v != vEnd; v++)
+	struct tsf_voice *v;
+	struct tsf_voice_cold *vc, *vMatchFirst = TSF_NULL;
+	int32_t i;
+	TSF_CRITICAL_ENTER();
+	for (i = 0; i < f->voiceActiveNum; i++)
 	{
-		//Find the first and last entry in the voices list with matching preset, key and look up the smallest play index
-		if (v->playingPreset != preset_index || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
-		else if (!vMatchFirst || v->playIndex < vMatchFirst->playIndex) vMatchFirst = vMatchLast = v;
-		else if (v->playIndex == vMatchFirst->playIndex) vMatchLast = v;
+		//Find the smallest play index among the voices with matching preset and key
+		v = &f->voices[f->voiceActive[i]];
+		vc = tsf_voice_getcold(f, v);
+		if (v->playingPreset != preset_index || vc->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
+		if (!vMatchFirst || vc->playIndex < vMatchFirst->playIndex) vMatchFirst = vc;
 	}
-	if (!vMatchFirst) return;
-	for (v = vMatchFirst; v <= vMatchLast; v++)
+	if (vMatchFirst)
 	{
-		//Stop all voices with matching preset, key and the smallest play index which was enumerated above
-		if (v != vMatchFirst && v != vMatchLast &&
-		        (v->playIndex != vMatchFirst->playIndex || v->playingPreset != preset_index || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE)) continue;
-		tsf_voice_end(v, f->outSampleRate);
+		for (i = 0; i < f->voiceActiveNum; i++)
+		{
+			//Stop all voices with matching preset, key and the smallest play index which was enumerated above
+			v = &f->voices[f->voiceActive[i]];
+			vc = tsf_voice_getcold(f, v);
+			if (vc->playIndex != vMatchFirst->playIndex || v->playingPreset != preset_index || vc->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
+			tsf_voice_end(f, v);
+		}
 	}
+	TSF_CRITICAL_EXIT();
 }
 
 TSFDEF int32_t tsf_bank_note_off(tsf* f, int32_t bank, int32_t preset_number, int32_t key)
@@ -2045,50 +3604,142 @@ TSFDEF int32_t tsf_bank_note_off(tsf* f, int32_t bank, int32_t preset_number, in
 
 TSFDEF void tsf_note_off_all(tsf* f)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++) if (v->playingPreset != -1 && v->ampenv.segment < TSF_SEGMENT_RELEASE)
-			tsf_voice_end(v, f->outSampleRate);
+	int32_t i;
+	for (i = 0; i < f->voiceActiveNum; i++)
+	{
+		struct tsf_voice *v = &f->voices[f->voiceActive[i]];
+		if (v->ampenv.segment < TSF_SEGMENT_RELEASE)
+			tsf_voice_end(f, v);
+	}
 }
 
 TSFDEF int32_t tsf_active_voice_count(tsf* f)
 {
-	int32_t count = 0;
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++) if (v->playingPreset != -1) count++;
-	return count;
+	return f->voiceActiveNum;
 }
 
-TSFDEF void tsf_render_short(tsf* f, int16_t* buffer, int32_t samples, int32_t flag_mixing)
+#if !defined(TSF_NO_CHORUS) || !defined(TSF_NO_REVERB)
+// bypassed effects still leave the dry signal at the level their mix would, stages are the effects bypassed
+static void tsf_effects_bypass(int32_t* buffer, int32_t samples, int32_t stages)
+{
+	int32_t i, k, s;
+	for (i = 0; i < samples * 2; i++)
+	{
+		s = buffer[i] >> 15;
+		for (k = 0; k < stages; k++) s = s * 3/4;
+		buffer[i] = s << 15;
+	}
+}
+#endif
+
+static void tsf_governor_update(tsf* f, uint32_t cycles, int32_t samples)
 {
-	tsf_gc(f);
+	if (!samples) return;
+	f->govLoad = (int32_t)((uint64_t)cycles * 100 / ((uint64_t)f->govCyclesPerSample * samples));
+	if (f->govLoad > TSF_GOVERNOR_HIGH)
+	{
+		// the voice cap is the count playing when the budget was first exceeded
+		if (f->govLevel == TSF_GOVERNOR_FULL) f->govVoiceCap = f->voiceActiveNum;
+		if (f->govLevel < TSF_GOVERNOR_NO_EFFECTS) f->govLevel++;
+		f->govCalm = 0;
+	}
+	else if (f->govLoad < TSF_GOVERNOR_LOW && f->govLevel > TSF_GOVERNOR_FULL)
+	{
+		if (++f->govCalm >= TSF_GOVERNOR_HOLD) f->govLevel--, f->govCalm = 0;
+	}
+	else f->govCalm = 0;
+}
+
+TSFDEF int32_t* tsf_render_int(tsf* f, int32_t samples)
+{
+	uint32_t start = (f->govCycles ? f->govCycles() : 0);
+	// deferred loading collects from tsf_load_pending(), the render never moves tables
+	if (!f->presetDeferred) tsf_gc(f);
 
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
+	int32_t i;
 
 	TSF_MEMSET(f->buffer, 0, sizeof(int32_t) * samples * 2);
-	TSF_MEMSET(f->chorusBuffer, 0, sizeof(int32_t) * samples);
-	TSF_MEMSET(f->reverbBuffer, 0, sizeof(int32_t) * samples);
+	// voices without a send add nothing to the send buffers, they only need clearing after some did
+	if (f->fxSent & TSF_EFFECT_CHORUS) TSF_MEMSET(f->chorusBuffer, 0, sizeof(int32_t) * f->fxSentSamples);
+	if (f->fxSent & TSF_EFFECT_REVERB) TSF_MEMSET(f->reverbBuffer, 0, sizeof(int32_t) * f->fxSentSamples);
+	f->fxSent = 0;
+
+	// one critical section per fade and voice: a note-on taken in between sees consistent lists and never
+	// steals the voice being rendered, it only waits for one voice
+	for (i = 0; i < f->fadeNum;)
+	{
+		TSF_CRITICAL_ENTER();
+		tsf_voice_fade_render(f, &f->fades[i], f->buffer, samples);
+		if (f->fades[i].remain) i++;
+		else f->fades[i] = f->fades[--f->fadeNum];
+		TSF_CRITICAL_EXIT();
+	}
+	for (i = 0; i < f->voiceActiveNum;) {
+		struct tsf_voice *v;
+		TSF_CRITICAL_ENTER();
+		v = &f->voices[f->voiceActive[i]];
+		tsf_voice_render(f, v, f->buffer, f->chorusBuffer, f->reverbBuffer, samples);
+		// a finished voice is swapped out with the last active one, render that slot again
+		if (v->playingPreset != -1) i++;
+		TSF_CRITICAL_EXIT();
+	}
 
-	if (!flag_mixing) TSF_MEMSET(buffer, 0, (f->outputmode == TSF_MONO ? 1 : 2) * sizeof(int16_t) * samples);
+	f->fxSentSamples = samples;
+	f->fxActive = 0;
 
-	for (; v != vEnd; v++) {
-		TSF_MUTEX_LOCK(v->mutex);
-		if (v->playingPreset != -1 && v->locked == 0) {
-			v->locked = 1;
-			tsf_voice_render(f, v, f->buffer, f->chorusBuffer, f->reverbBuffer, samples);
-			v->locked = 0;
-		}
-		TSF_MUTEX_UNLOCK(v->mutex);
+#if !defined(TSF_NO_CHORUS) || !defined(TSF_NO_REVERB)
+	if (f->govLevel >= TSF_GOVERNOR_NO_EFFECTS)
+	{
+#if !defined(TSF_NO_CHORUS) && !defined(TSF_NO_REVERB)
+		tsf_effects_bypass(f->buffer, samples, 2);
+#else
+		tsf_effects_bypass(f->buffer, samples, 1);
+#endif
 	}
-
+	else
+#endif
+	{
 #ifndef TSF_NO_CHORUS
-	chorus_process(&f->chorus, f->chorusBuffer, f->buffer, samples);
+		// the chorus has no feedback, a delay line that only took silence since plays silence
+		if (f->fxSent & TSF_EFFECT_CHORUS) f->chorusQuiet = 0;
+		if (f->chorusQuiet >= (uint32_t)f->chorus.maxsamples)
+		{
+			chorus_skip(&f->chorus, samples);
+			tsf_effects_bypass(f->buffer, samples, 1);
+		}
+		else
+		{
+			chorus_process(&f->chorus, f->chorusBuffer, f->buffer, samples);
+			f->chorusQuiet = (f->fxSent & TSF_EFFECT_CHORUS ? 0 : f->chorusQuiet + samples);
+			f->fxActive |= TSF_EFFECT_CHORUS;
+		}
 #endif
 
 #ifndef TSF_NO_REVERB
-	reverb_process(&f->rev, f->reverbBuffer, f->buffer, samples);
+		// quiet once the tail stayed under the floor for as long as the combs take to play out what they hold
+		if (f->fxSent & TSF_EFFECT_REVERB) f->reverbQuiet = 0;
+		if (f->reverbQuiet >= COMB_SIZE) tsf_effects_bypass(f->buffer, samples, 1);
+		else
+		{
+			reverb_process(&f->rev, f->reverbBuffer, f->buffer, samples);
+			f->reverbQuiet = (f->fxSent & TSF_EFFECT_REVERB || f->rev.peak > TSF_REVERB_FLOOR ? 0 : f->reverbQuiet + samples);
+			f->fxActive |= TSF_EFFECT_REVERB;
+		}
 #endif
+	}
+
+	if (f->govCycles) tsf_governor_update(f, f->govCycles() - start, samples);
+	return f->buffer;
+}
+
+TSFDEF int32_t tsf_effects_active(tsf* f)
+{
+	return f->fxActive;
+}
 
-	int32_t *inBuf = f->buffer;
+TSFDEF void tsf_render_short(tsf* f, int16_t* buffer, int32_t samples, int32_t flag_mixing)
+{
+	int32_t *inBuf = tsf_render_int(f, samples);
 	int blkCnt = (samples * 2) >> 2;
 
 	// convert to 16bits
@@ -2103,10 +3754,10 @@ TSFDEF void tsf_render_short(tsf* f, int16_t* buffer, int32_t samples, int32_t f
 static void tsf_channel_setup_voice(tsf* f, struct tsf_voice* v)
 {
 	struct tsf_channel* c = &f->channels->channels[f->channels->activeChannel];
-	float newpan = v->region->pan + c->panOffset;
+	float newpan = v->region->pan * 0.001f + c->panOffset;
 	v->playingChannel = f->channels->activeChannel;
 	v->noteGainDB += c->gainDB;
-	tsf_voice_calcpitchratio(v, (c->pitchWheel == 8192 ? c->tuning : ((c->pitchWheel / 16383.0f * c->pitchRange * 2.0f) - c->pitchRange + c->tuning)), f->outSampleRate);
+	tsf_voice_calcpitchratio(f, v, (c->pitchWheel == 8192 ? c->tuning : ((c->pitchWheel / 16383.0f * c->pitchRange * 2.0f) - c->pitchRange + c->tuning)));
 	if      (newpan <= -0.5f) { v->panFactorLeft = 1.0f; v->panFactorRight = 0.0f; }
 	else if (newpan >=  0.5f) { v->panFactorLeft = 0.0f; v->panFactorRight = 1.0f; }
 	else { v->panFactorLeft = TSF_SQRTF(0.5f - newpan); v->panFactorRight = TSF_SQRTF(0.5f + newpan); }
@@ -2148,22 +3799,36 @@ static struct tsf_channel* tsf_channel_init(tsf* f, int32_t channel)
 		c->tuning = 0.0f;
 		c->chorus = 0.0f;
 		c->reverb = 0.0f;
+		TSF_MEMSET(c->keyVoice, TSF_VOICE_NONE, sizeof(c->keyVoice));
+		TSF_MEMSET(c->groupVoice, TSF_VOICE_NONE, sizeof(c->groupVoice));
+		c->voiceCount = 0;
 	}
 	return &f->channels->channels[channel];
 }
 
 static void tsf_channel_applypitch(tsf* f, int32_t channel, struct tsf_channel* c)
 {
-	struct tsf_voice *v, *vEnd;
+	int32_t i;
 	float pitchShift = (c->pitchWheel == 8192 ? c->tuning : ((c->pitchWheel / 16383.0f * c->pitchRange * 2.0f) - c->pitchRange + c->tuning));
-	for (v = f->voices, vEnd = v + f->voiceNum; v != vEnd; v++)
-		if (v->playingChannel == channel && v->playingPreset != -1)
-			tsf_voice_calcpitchratio(v, pitchShift, f->outSampleRate);
+	for (i = 0; i < f->voiceActiveNum; i++)
+	{
+		struct tsf_voice *v = &f->voices[f->voiceActive[i]];
+		if (v->playingChannel == channel)
+			tsf_voice_calcpitchratio(f, v, pitchShift);
+	}
+}
+
+// select the channel preset and parse it now unless the loader task does it
+static void tsf_channel_select_preset(tsf* f, struct tsf_channel* c, int32_t preset_index)
+{
+	c->presetIndex = (uint16_t)preset_index;
+	if (preset_index >= 0 && preset_index < f->presetNum && !tsf_preset_use(f, preset_index) && !f->presetDeferred)
+		tsf_load_preset(f, preset_index);
 }
 
 TSFDEF void tsf_channel_set_presetindex(tsf* f, int32_t channel, int32_t preset_index)
 {
-	tsf_channel_init(f, channel)->presetIndex = (uint16_t)preset_index;
+	tsf_channel_select_preset(f, tsf_channel_init(f, channel), preset_index);
 }
 
 TSFDEF int32_t tsf_channel_set_presetnumber(tsf* f, int32_t channel, int32_t preset_number, int32_t flag_mididrums)
@@ -2184,7 +3849,7 @@ TSFDEF int32_t tsf_channel_set_presetnumber(tsf* f, int32_t channel, int32_t pre
 	if (preset_index == -1) preset_index = tsf_get_presetindex(f, 0, preset_number);
 	if (preset_index != -1)
 	{
-		c->presetIndex = (uint16_t)preset_index;
+		tsf_channel_select_preset(f, c, preset_index);
 		return 1;
 	}
 	return 0;
@@ -2200,22 +3865,25 @@ TSFDEF int32_t tsf_channel_set_bank_preset(tsf* f, int32_t channel, int32_t bank
 	struct tsf_channel *c = tsf_channel_init(f, channel);
 	int32_t preset_index = tsf_get_presetindex(f, bank, preset_number);
 	if (preset_index == -1) return 0;
-	c->presetIndex = (uint16_t)preset_index;
+	tsf_channel_select_preset(f, c, preset_index);
 	c->bank = (uint16_t)bank;
 	return 1;
 }
 
 TSFDEF void tsf_channel_set_pan(tsf* f, int32_t channel, float pan)
 {
-	struct tsf_voice *v, *vEnd;
-	for (v = f->voices, vEnd = v + f->voiceNum; v != vEnd; v++)
-		if (v->playingChannel == channel && v->playingPreset != -1)
+	int32_t i;
+	for (i = 0; i < f->voiceActiveNum; i++)
+	{
+		struct tsf_voice *v = &f->voices[f->voiceActive[i]];
+		if (v->playingChannel == channel)
 		{
-			float newpan = v->region->pan + pan - 0.5f;
+			float newpan = v->region->pan * 0.001f + pan - 0.5f;
 			if      (newpan <= -0.5f) { v->panFactorLeft = 1.0f; v->panFactorRight = 0.0f; }
 			else if (newpan >=  0.5f) { v->panFactorLeft = 0.0f; v->panFactorRight = 1.0f; }
 			else { v->panFactorLeft = TSF_SQRTF(0.5f - newpan); v->panFactorRight = TSF_SQRTF(0.5f + newpan); }
 		}
+	}
 	tsf_channel_init(f, channel)->panOffset = pan - 0.5f;
 }
 
@@ -2223,11 +3891,14 @@ TSFDEF void tsf_channel_set_volume(tsf* f, int32_t channel, float volume)
 {
 	struct tsf_channel *c = tsf_channel_init(f, channel);
 	float gainDB = tsf_gainToDecibels(volume), gainDBChange = gainDB - c->gainDB;
-	struct tsf_voice *v, *vEnd;
+	int32_t i;
 	if (gainDBChange == 0) return;
-	for (v = f->voices, vEnd = v + f->voiceNum; v != vEnd; v++)
-		if (v->playingChannel == channel && v->playingPreset != -1)
+	for (i = 0; i < f->voiceActiveNum; i++)
+	{
+		struct tsf_voice *v = &f->voices[f->voiceActive[i]];
+		if (v->playingChannel == channel)
 			v->noteGainDB += gainDBChange;
+	}
 	c->gainDB = gainDB;
 }
 
@@ -2264,38 +3935,63 @@ TSFDEF void tsf_channel_note_on(tsf* f, int32_t channel, int32_t key, float vel)
 
 TSFDEF void tsf_channel_note_off(tsf* f, int32_t channel, int32_t key)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum, *vMatchFirst = TSF_NULL, *vMatchLast = TSF_NULL;
-	for (; v != vEnd; v++)
+	struct tsf_voice *v;
+	struct tsf_voice_cold *vc, *vMatchFirst = TSF_NULL;
+	uint8_t idx;
+	if (!f->channels || channel >= f->channels->channelNum || key < 0 || key > 127) return;
+	TSF_CRITICAL_ENTER();
+	for (idx = f->channels->channels[channel].keyVoice[key]; idx != TSF_VOICE_NONE; idx = vc->keyNext)
 	{
-		//Find the first and last entry in the voices list with matching channel, key and look up the smallest play index
-		if (v->playingPreset == -1 || v->playingChannel != channel || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
-		else if (!vMatchFirst || v->playIndex < vMatchFirst->playIndex) vMatchFirst = vMatchLast = v;
-		else if (v->playIndex == vMatchFirst->playIndex) vMatchLast = v;
+		//Find the smallest play index among the voices chained on this channel key
+		v = &f->voices[idx], vc = &f->voicesCold[idx];
+		if (v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
+		if (!vMatchFirst || vc->playIndex < vMatchFirst->playIndex) vMatchFirst = vc;
 	}
-	if (!vMatchFirst) return;
-	for (v = vMatchFirst; v <= vMatchLast; v++)
+	if (vMatchFirst)
 	{
-		//Stop all voices with matching channel, key and the smallest play index which was enumerated above
-		if (v != vMatchFirst && v != vMatchLast &&
-		        (v->playIndex != vMatchFirst->playIndex || v->playingPreset == -1 || v->playingChannel != channel || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE)) continue;
-		tsf_voice_end(v, f->outSampleRate);
+		for (idx = f->channels->channels[channel].keyVoice[key]; idx != TSF_VOICE_NONE; idx = vc->keyNext)
+		{
+			//Stop all voices with the smallest play index which was enumerated above
+			v = &f->voices[idx], vc = &f->voicesCold[idx];
+			if (vc->playIndex != vMatchFirst->playIndex || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
+			tsf_voice_end(f, v);
+		}
 	}
+	TSF_CRITICAL_EXIT();
 }
 
 TSFDEF void tsf_channel_note_off_all(tsf* f, int32_t channel)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel && v->ampenv.segment < TSF_SEGMENT_RELEASE)
-			tsf_voice_end(v, f->outSampleRate);
+	struct tsf_channel *c;
+	struct tsf_voice *v;
+	int32_t key;
+	uint8_t idx;
+	if (!f->channels || channel >= f->channels->channelNum) return;
+	c = &f->channels->channels[channel];
+	for (key = 0; key < 128 && c->voiceCount; key++)
+		for (idx = c->keyVoice[key]; idx != TSF_VOICE_NONE; idx = f->voicesCold[idx].keyNext)
+		{
+			v = &f->voices[idx];
+			if (v->ampenv.segment < TSF_SEGMENT_RELEASE)
+				tsf_voice_end(f, v);
+		}
 }
 
 TSFDEF void tsf_channel_sounds_off_all(tsf* f, int32_t channel)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel && (v->ampenv.segment < TSF_SEGMENT_RELEASE || v->ampenv.parameters.release))
-			tsf_voice_endquick(v, f->outSampleRate);
+	struct tsf_channel *c;
+	struct tsf_voice *v;
+	int32_t key;
+	uint8_t idx;
+	if (!f->channels || channel >= f->channels->channelNum) return;
+	c = &f->channels->channels[channel];
+	for (key = 0; key < 128 && c->voiceCount; key++)
+		for (idx = c->keyVoice[key]; idx != TSF_VOICE_NONE; idx = f->voicesCold[idx].keyNext)
+		{
+			v = &f->voices[idx];
+			if (v->ampenv.segment < TSF_SEGMENT_RELEASE || tsf_voice_getcold(f, v)->ampenv.release)
+				tsf_voice_endquick(f, v);
+		}
 }
 
 TSFDEF void tsf_channel_midi_control(tsf* f, int32_t channel, int32_t controller, int32_t control_value)
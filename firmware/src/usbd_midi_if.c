@@ -30,15 +30,14 @@ static int8_t Midi_Receive(uint8_t *msg, uint32_t len) {
 		osMessageQueuePut(midi_queue, &midi_msg, 0U, 0U);
 	}
 #else
-	if (synth_available()) {
-	  #ifdef LED2_PIN
-    	BSP_LED_On(LED2);
-	  #endif
-		synth_midi_process(msg, len);
-	  #ifdef LED2_PIN
-    	BSP_LED_Off(LED2);
-	  #endif
-	}
+	// held while a reset is pending, dropped while the synth is unavailable
+	#ifdef LED2_PIN
+	BSP_LED_On(LED2);
+	#endif
+	synth_midi_process(msg, len);
+	#ifdef LED2_PIN
+	BSP_LED_Off(LED2);
+	#endif
 #endif	
 
 	return 0;
@@ -0,0 +1,159 @@
+/* tsf render and MIDI event benchmark */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TSF_RENDER_EFFECTSAMPLEBLOCK 512
+#define TSF_NO_PRESET_NAME
+//#define TSF_NO_INTERPOLATION
+//#define TSF_NO_LOWPASS
+//#define TSF_NO_REVERB
+//#define TSF_NO_CHORUS
+
+#define TSF_IMPLEMENTATION
+#include "tsf.h"
+#include "tsf_test.h"
+
+#define SAMPLE_RATE 48000
+#define POLYPHONY 64
+#define BLOCK_SIZE 480 // AUDIO_BUF_SIZE / 2 / 4 on the firmware
+#define BLOCKS 2000
+#define EVENTS 100000
+
+// hold `notes` keys spread over the first 8 channels
+static void bench_notes_on(tsf* synth, int notes)
+{
+	for (int i = 0; i < notes; i++)
+		tsf_channel_note_on(synth, i % 8, 36 + (i / 8) * 7 + (i % 8), 0.8f);
+}
+
+static void bench_render(tsf* synth, int notes)
+{
+	static int16_t buf[BLOCK_SIZE * 2];
+	double t;
+
+	for (int c = 0; c < 8; c++) tsf_channel_sounds_off_all(synth, c);
+	for (int i = 0; i < 8; i++) tsf_render_short(synth, buf, BLOCK_SIZE, 0);
+
+	bench_notes_on(synth, notes);
+	t = now_ns();
+	for (int i = 0; i < BLOCKS; i++) {
+		// keep the requested voices alive over the whole run
+		if (tsf_active_voice_count(synth) < notes) bench_notes_on(synth, notes - tsf_active_voice_count(synth));
+		tsf_render_short(synth, buf, BLOCK_SIZE, 0);
+	}
+	t = now_ns() - t;
+	printf("render  %2d voices: %8.0f ns/block (%5.1f%% of a %d samples block)\n", tsf_active_voice_count(synth),
+	       t / BLOCKS, 100.0 * (t / BLOCKS) / (1e9 * BLOCK_SIZE / SAMPLE_RATE), BLOCK_SIZE);
+}
+
+// reference: the same events walking every voice slot, as tsf did before the active and free voice lists
+static void scan_set_pitchwheel(tsf* f, int32_t channel, int32_t pitch_wheel)
+{
+	struct tsf_channel *c = tsf_channel_init(f, channel);
+	float pitchShift;
+	if (c->pitchWheel == pitch_wheel) return;
+	c->pitchWheel = (uint16_t)pitch_wheel;
+	pitchShift = (c->pitchWheel == 8192 ? c->tuning : ((c->pitchWheel / 16383.0f * c->pitchRange * 2.0f) - c->pitchRange + c->tuning));
+	for (int i = 0; i < f->voiceNum; i++)
+		if (f->voices[i].playingPreset != -1 && f->voices[i].playingChannel == channel)
+			tsf_voice_calcpitchratio(f, &f->voices[i], pitchShift);
+}
+
+static void scan_set_volume(tsf* f, int32_t channel, int32_t control_value)
+{
+	struct tsf_channel *c = tsf_channel_init(f, channel);
+	float gainDB, gainDBChange;
+	c->midiVolume = (uint16_t)((c->midiVolume & 0x7F) | (control_value << 7));
+	gainDB = tsf_gainToDecibels(TSF_POWF((c->midiVolume / 16383.0f) * (c->midiExpression / 16383.0f), 3.0f));
+	gainDBChange = gainDB - c->gainDB;
+	if (gainDBChange == 0) return;
+	for (int i = 0; i < f->voiceNum; i++)
+		if (f->voices[i].playingPreset != -1 && f->voices[i].playingChannel == channel)
+			f->voices[i].noteGainDB += gainDBChange;
+	c->gainDB = gainDB;
+}
+
+static void scan_note_off(tsf* f, int32_t channel, int32_t key)
+{
+	struct tsf_voice_cold *vMatchFirst = TSF_NULL;
+	for (int i = 0; i < f->voiceNum; i++)
+	{
+		struct tsf_voice *v = &f->voices[i];
+		struct tsf_voice_cold *vc = &f->voicesCold[i];
+		if (v->playingPreset == -1 || v->playingChannel != channel || vc->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
+		if (!vMatchFirst || vc->playIndex < vMatchFirst->playIndex) vMatchFirst = vc;
+	}
+	if (vMatchFirst) tsf_voice_end(f, &f->voices[vMatchFirst - f->voicesCold]);
+}
+
+static int32_t scan_active_voice_count(tsf* f)
+{
+	int32_t count = 0;
+	for (int i = 0; i < f->voiceNum; i++)
+		if (f->voices[i].playingPreset != -1) count++;
+	return count;
+}
+
+static double bench_event_loop(tsf* synth, int scan)
+{
+	volatile int32_t count;
+	double t = now_ns();
+	for (int i = 0; i < EVENTS; i++) {
+		switch ((i & 3) | (scan ? 4 : 0)) {
+		case 0: tsf_channel_set_pitchwheel(synth, i & 7, (i * 37) & 0x3FFF); break;
+		case 1: tsf_channel_midi_control(synth, i & 7, 7, i & 0x7F); break;
+		case 2: tsf_channel_note_off(synth, i & 7, 127); break; // key never played
+		case 3: count = tsf_active_voice_count(synth); break;
+		case 4: scan_set_pitchwheel(synth, i & 7, (i * 37) & 0x3FFF); break;
+		case 5: scan_set_volume(synth, i & 7, i & 0x7F); break;
+		case 6: scan_note_off(synth, i & 7, 127); break;
+		case 7: count = scan_active_voice_count(synth); break;
+		}
+	}
+	(void)count;
+	return (now_ns() - t) / EVENTS;
+}
+
+static void bench_events(tsf* synth, int notes)
+{
+	static int16_t buf[BLOCK_SIZE * 2];
+	double lists, scan;
+
+	for (int c = 0; c < 8; c++) tsf_channel_sounds_off_all(synth, c);
+	for (int i = 0; i < 8; i++) tsf_render_short(synth, buf, BLOCK_SIZE, 0);
+	bench_notes_on(synth, notes);
+
+	scan = bench_event_loop(synth, 1);
+	lists = bench_event_loop(synth, 0);
+	printf("events  %2d voices: %8.1f ns/event (%.1f ns scanning all %d slots)\n", tsf_active_voice_count(synth), lists, scan,
+	       synth->voiceNum);
+}
+
+int main(int argc, char** argv)
+{
+	static const int voices[] = { 0, 1, 4, 16, POLYPHONY };
+
+	if (argc < 2) {
+		printf("Usage:\n bench_tsf file.sf2 [preset_number]\n");
+		return 1;
+	}
+
+	tsf* synth = tsf_load_filename(argv[1]);
+	if (!synth) {
+		fprintf(stderr, "Could not create synth\n");
+		return 1;
+	}
+	tsf_set_max_voices(synth, POLYPHONY);
+	tsf_set_output(synth, TSF_STEREO_INTERLEAVED, SAMPLE_RATE, 0.0f);
+	for (int c = 0; c < 8; c++)
+		tsf_channel_set_presetnumber(synth, c, argc > 2 ? atoi(argv[2]) : 0, 0);
+
+	for (unsigned int i = 0; i < sizeof(voices) / sizeof(voices[0]); i++)
+		bench_render(synth, voices[i]);
+	for (unsigned int i = 0; i < sizeof(voices) / sizeof(voices[0]); i++)
+		bench_events(synth, voices[i]);
+
+	tsf_close(synth);
+	return 0;
+}
@@ -0,0 +1,299 @@
+/* compile a soundfont into the native font tsf_load_native maps in place, and check it renders the same
+   (with -a the samples are ADPCM blocks and the output is compared by its SNR) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define TSF_RENDER_EFFECTSAMPLEBLOCK 512
+#define TSF_IMPLEMENTATION
+#include "tsf.h"
+#include "tsf_test.h"
+
+#define SAMPLE_RATE 48000
+#define BLOCK_SIZE 64
+#define RENDER_BLOCKS 200
+#define GUARD_SAMPLES 46 // zeros after the last sample, as a SF2 guarantees after each one
+#define MIN_ADPCM_SNR 20.0 // dB of the ADPCM font output against the SF2 one
+
+static double signal_energy, error_energy;
+
+static uint32_t align4(uint32_t pos)
+{
+	return (pos + 3) & ~3u;
+}
+
+static void put(FILE* fp, const void* ptr, uint32_t size, uint32_t* pos)
+{
+	static const uint8_t zeros[4] = { 0 };
+	fwrite(ptr, 1, size, fp);
+	*pos += size;
+	fwrite(zeros, 1, align4(*pos) - *pos, fp);
+	*pos = align4(*pos);
+}
+
+static int compile(const char* font, const char* out, int adpcm)
+{
+	tsf* f = tsf_load_filename(font);
+	struct tsf_native_header h;
+	struct tsf_native_preset* entries;
+	struct tsf_native_instrument* instruments;
+	struct tsf_region_ref* refs = NULL;
+	struct tsf_region* regions = NULL;
+	uint16_t* keyIndex = NULL;
+	int16_t* samples;
+	uint8_t* pool = NULL;
+	uint32_t pos = 0, samplesSize;
+	int32_t i;
+	FILE* fp;
+
+	if (!f) return printf("could not load %s\n", font);
+	memset(&h, 0, sizeof(h));
+	memcpy(h.id, "TSFN", 4);
+	h.version = TSF_NATIVE_VERSION << 16 | sizeof(struct tsf_region);
+	h.presetNum = (uint32_t)f->presetNum;
+	h.presetHashMask = f->presetHashMask;
+	h.instrumentNum = (uint32_t)f->instrumentNum;
+	h.sampleCount = f->fontSampleCount;
+	entries = (struct tsf_native_preset*)calloc(f->presetNum, sizeof(*entries));
+	instruments = (struct tsf_native_instrument*)calloc(f->instrumentNum + 1, sizeof(*instruments));
+
+	// every preset is resolved through the arena one at a time, its tables appended to the font's
+	for (i = 0; i < f->presetNum; i++)
+	{
+		struct tsf_preset* p = &f->presets[i];
+		int32_t r;
+		tsf_load_preset(f, i);
+		if (!p->loaded) return printf("preset %d did not load\n", i);
+		memcpy(entries[i].presetName, p->presetName, sizeof(entries[i].presetName));
+		entries[i].preset = p->preset;
+		entries[i].bank = p->bank;
+		entries[i].regionNum = (uint32_t)p->regionNum;
+		entries[i].privateNum = (uint32_t)p->privateNum;
+		entries[i].firstRef = h.refNum;
+		entries[i].firstRegion = h.regionNum;
+		refs = (struct tsf_region_ref*)realloc(refs, (h.refNum + p->regionNum) * sizeof(struct tsf_region_ref));
+		memcpy(refs + h.refNum, p->refs, p->regionNum * sizeof(struct tsf_region_ref));
+		h.refNum += (uint32_t)p->regionNum;
+		regions = (struct tsf_region*)realloc(regions, (h.regionNum + p->privateNum) * sizeof(struct tsf_region));
+		memcpy(regions + h.regionNum, p->regions, p->privateNum * sizeof(struct tsf_region));
+		h.regionNum += (uint32_t)p->privateNum;
+		// the shared tables are written once, for the instruments some preset plays from them
+		for (r = 0; r < p->regionNum; r++)
+			if (p->refs[r].table != TSF_REF_PRIVATE) instruments[p->refs[r].table].regionNum = f->instruments[p->refs[r].table].regionNum;
+		entries[i].keyIndex = TSF_NATIVE_NOINDEX;
+		if (p->keyIndex)
+		{
+			uint32_t n = TSF_KEY_INDEX + p->keyIndex[TSF_KEY_INDEX - 1];
+			entries[i].keyIndex = h.keyIndexNum;
+			keyIndex = (uint16_t*)realloc(keyIndex, (h.keyIndexNum + n) * sizeof(uint16_t));
+			memcpy(keyIndex + h.keyIndexNum, p->keyIndex, n * sizeof(uint16_t));
+			h.keyIndexNum += n;
+		}
+		tsf_unload_preset(f, i);
+		tsf_arena_compact(f);
+	}
+	for (i = 0; i < f->instrumentNum; i++)
+	{
+		struct tsf_instrument* instrument;
+		if (!instruments[i].regionNum) continue;
+		instrument = tsf_instrument_acquire(f, i);
+		if (!instrument) return printf("instrument %d did not load\n", i);
+		instruments[i].firstRegion = h.regionNum;
+		regions = (struct tsf_region*)realloc(regions, (h.regionNum + instrument->regionNum) * sizeof(struct tsf_region));
+		memcpy(regions + h.regionNum, instrument->regions, instrument->regionNum * sizeof(struct tsf_region));
+		h.regionNum += instrument->regionNum;
+		tsf_instrument_release(f, i);
+	}
+
+	h.presetsPos = align4(sizeof(h));
+	h.instrumentsPos = align4(h.presetsPos + h.presetNum * sizeof(*entries));
+	h.hashPos = align4(h.instrumentsPos + h.instrumentNum * sizeof(*instruments));
+	h.refsPos = align4(h.hashPos + (h.presetHashMask + 1) * sizeof(uint16_t));
+	h.regionsPos = align4(h.refsPos + h.refNum * sizeof(struct tsf_region_ref));
+	h.keyIndexPos = align4(h.regionsPos + h.regionNum * sizeof(struct tsf_region));
+	h.samplesPos = align4(h.keyIndexPos + h.keyIndexNum * sizeof(uint16_t));
+	samplesSize = (h.sampleCount + GUARD_SAMPLES) * sizeof(int16_t);
+
+	samples = (int16_t*)calloc(h.sampleCount + GUARD_SAMPLES, sizeof(int16_t));
+	memcpy(samples, f->fontSamples + f->fontSamplesOffset, h.sampleCount * sizeof(int16_t));
+	if (adpcm)
+	{
+		h.flags = TSF_NATIVE_ADPCM;
+		samplesSize = (uint32_t)tsf_adpcm_encode(samples, h.sampleCount, NULL);
+		pool = (uint8_t*)malloc(samplesSize);
+		tsf_adpcm_encode(samples, h.sampleCount, pool);
+	}
+	h.size = align4(h.samplesPos + samplesSize);
+
+	fp = fopen(out, "wb");
+	if (!fp) return printf("could not create %s\n", out);
+	put(fp, &h, sizeof(h), &pos);
+	put(fp, entries, h.presetNum * sizeof(*entries), &pos);
+	put(fp, instruments, h.instrumentNum * sizeof(*instruments), &pos);
+	put(fp, f->presetHash, (h.presetHashMask + 1) * sizeof(uint16_t), &pos);
+	put(fp, refs, h.refNum * sizeof(struct tsf_region_ref), &pos);
+	put(fp, regions, h.regionNum * sizeof(struct tsf_region), &pos);
+	put(fp, keyIndex, h.keyIndexNum * sizeof(uint16_t), &pos);
+	put(fp, adpcm ? (void*)pool : (void*)samples, samplesSize, &pos);
+	fclose(fp);
+
+	printf("%s: %u bytes, %u presets, %u refs, %u regions (%u bytes), %u key index entries, %u samples (%u bytes%s)\n", out, pos, h.presetNum,
+		h.refNum, h.regionNum, h.regionNum * (uint32_t)sizeof(struct tsf_region), h.keyIndexNum, h.sampleCount, samplesSize, adpcm ? " ADPCM" : "");
+	free(entries);
+	free(instruments);
+	free(refs);
+	free(regions);
+	free(keyIndex);
+	free(samples);
+	free(pool);
+	tsf_close(f);
+	return (pos != h.size ? printf("wrote %u bytes instead of %u\n", pos, h.size) : 0);
+}
+
+// a few notes of the preset on both, the output has to be the same sample for sample, or with lossy
+// samples is summed up for the SNR
+static int render_same(tsf* a, tsf* b, int32_t preset, int exact)
+{
+	static int16_t bufa[BLOCK_SIZE * 2], bufb[BLOCK_SIZE * 2];
+	tsf* f[2] = { a, b };
+	int i, k, blk;
+
+	for (i = 0; i < 2; i++)
+	{
+		tsf_set_output(f[i], TSF_STEREO_INTERLEAVED, SAMPLE_RATE, 0.0f);
+		tsf_channel_set_presetindex(f[i], 0, preset);
+		for (k = 36; k < 96; k += 11) tsf_channel_note_on(f[i], 0, k, 0.8f);
+	}
+	for (blk = 0; blk < RENDER_BLOCKS; blk++)
+	{
+		if (blk == RENDER_BLOCKS / 2) for (i = 0; i < 2; i++) tsf_channel_note_off_all(f[i], 0);
+		tsf_render_short(a, bufa, BLOCK_SIZE, 0);
+		tsf_render_short(b, bufb, BLOCK_SIZE, 0);
+		if (exact && memcmp(bufa, bufb, sizeof(bufa))) return printf("preset %d renders differently at block %d\n", preset, blk);
+		for (i = 0; i < BLOCK_SIZE * 2; i++)
+			signal_energy += (double)bufa[i] * bufa[i], error_energy += (double)(bufa[i] - bufb[i]) * (bufa[i] - bufb[i]);
+	}
+	for (i = 0; i < 2; i++) tsf_channel_sounds_off_all(f[i], 0);
+	return 0;
+}
+
+// a region playing past the samples, a ref out of its table and a key index entry out of the refs have to be rejected
+static int corrupt(uint8_t* buf, long size)
+{
+	struct tsf_native_header h;
+	struct tsf_native_preset e;
+	struct tsf_region* region;
+	struct tsf_region_ref* ref;
+	uint16_t *index = NULL, saved;
+	uint32_t i, end;
+	tsf* native;
+	int fail = 0;
+
+	memcpy(&h, buf, sizeof(h));
+	region = (struct tsf_region*)(buf + h.regionsPos);
+	ref = (struct tsf_region_ref*)(buf + h.refsPos);
+	for (i = 0; i < h.presetNum && !index; i++)
+	{
+		memcpy(&e, buf + h.presetsPos + i * sizeof(e), sizeof(e));
+		if (e.keyIndex != TSF_NATIVE_NOINDEX && ((uint16_t*)(buf + h.keyIndexPos))[e.keyIndex + TSF_KEY_INDEX - 1])
+			index = (uint16_t*)(buf + h.keyIndexPos) + e.keyIndex + TSF_KEY_INDEX;
+	}
+
+	end = region->end, region->end = h.sampleCount + 1;
+	if ((native = tsf_load_native(buf, (int32_t)size))) fail = printf("region past the samples accepted\n");
+	tsf_close(native);
+	region->end = end;
+	saved = ref->region, ref->region = 0xFFFF;
+	if ((native = tsf_load_native(buf, (int32_t)size))) fail = printf("ref out of its table accepted\n");
+	tsf_close(native);
+	ref->region = saved;
+	if (index)
+	{
+		saved = *index, *index = 0xFFFF;
+		if ((native = tsf_load_native(buf, (int32_t)size))) fail = printf("key index out of the refs accepted\n");
+		tsf_close(native);
+		*index = saved;
+	}
+	if (!(native = tsf_load_native(buf, (int32_t)size))) fail = printf("restored native font rejected\n");
+	tsf_close(native);
+	return fail;
+}
+
+// the native font has to give the same directory, lookups, tables and output as parsing the font
+static int verify(const char* font, const char* in)
+{
+	tsf *plain, *native;
+	uint8_t* buf;
+	long size;
+	double t0, t1, t2;
+	int fail = 0, i, b, p, exact;
+	FILE* fp = fopen(in, "rb");
+
+	if (!fp) return printf("could not open %s\n", in);
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	buf = (uint8_t*)malloc(size);
+	if (fread(buf, 1, size, fp) != (size_t)size) size = 0;
+	fclose(fp);
+
+	t0 = now_ms();
+	plain = tsf_load_filename(font);
+	t1 = now_ms();
+	native = tsf_load_native(buf, (int32_t)size);
+	t2 = now_ms();
+	if (!plain) return printf("could not load %s\n", font);
+	if (!native) return printf("native font rejected\n");
+	printf("load: parse %.2f ms, native %.3f ms\n", t1 - t0, t2 - t1);
+	exact = (native->fontAdpcm == NULL);
+
+	for (b = 0; b < 256; b++)
+		for (p = 0; p < 128; p++)
+			if (tsf_get_presetindex(plain, b, p) != tsf_get_presetindex(native, b, p))
+				fail = printf("bank %d program %d: preset %d != %d\n", b, p, tsf_get_presetindex(plain, b, p), tsf_get_presetindex(native, b, p));
+
+	for (i = 0; i < tsf_get_presetcount(plain) && !fail; i++)
+	{
+		struct tsf_preset *a = &plain->presets[i], *c = &native->presets[i];
+		if (a->bank != c->bank || a->preset != c->preset || a->regionNum != c->regionNum || a->privateNum != c->privateNum || strcmp(a->presetName, c->presetName))
+			fail = printf("preset %d differs\n", i);
+		tsf_load_preset(plain, i);
+		if (!fail && (!a->loaded || !c->loaded)) fail = printf("preset %d is not ready\n", i);
+		if (!fail && !same_regions(plain, a, native, c)) fail = printf("preset %d regions differ\n", i);
+		if (!fail && (!a->keyIndex != !c->keyIndex || (a->keyIndex && memcmp(a->keyIndex, c->keyIndex, (TSF_KEY_INDEX + a->keyIndex[TSF_KEY_INDEX - 1]) * sizeof(uint16_t)))))
+			fail = printf("preset %d key index differs\n", i);
+		tsf_unload_preset(plain, i);
+		tsf_arena_compact(plain);
+		if (!fail) fail = render_same(plain, native, i, exact);
+	}
+	if (!exact && !fail)
+	{
+		double snr = 10.0 * log10(signal_energy / (error_energy ? error_energy : 1.0));
+		printf("ADPCM output SNR %.1f dB\n", snr);
+		if (snr < MIN_ADPCM_SNR) fail = printf("ADPCM output under %.0f dB\n", MIN_ADPCM_SNR);
+	}
+
+	// a truncated font has to be rejected
+	tsf_close(native);
+	native = tsf_load_native(buf, (int32_t)size - 4);
+	if (native) fail = printf("truncated native font accepted\n");
+	if (corrupt(buf, size)) fail = 1;
+
+	printf("%s\n", fail ? "FAIL" : "ok");
+	tsf_close(plain);
+	tsf_close(native);
+	free(buf);
+	return fail;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc == 4 && !strcmp(argv[1], "-v")) return verify(argv[2], argv[3]) != 0;
+	if (argc == 4 && !strcmp(argv[1], "-a")) return compile(argv[2], argv[3], 1) != 0 || verify(argv[2], argv[3]) != 0;
+	if (argc == 3) return compile(argv[1], argv[2], 0) != 0 || verify(argv[1], argv[2]) != 0;
+	printf("Usage:\n sf2native file.sf2 font.tsfn     compile the native font and verify it\n sf2native -a file.sf2 font.tsfn  same with ADPCM samples\n"
+		" sf2native -v file.sf2 font.tsfn  verify an existing native font\n");
+	return 1;
+}
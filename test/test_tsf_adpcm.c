@@ -0,0 +1,118 @@
+/* ADPCM sample pool: decode cost and SNR against the source samples, and the voices decoding it block by block
+   have to render exactly what the fully decoded pool renders */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define TSF_RENDER_EFFECTSAMPLEBLOCK 512
+#define TSF_IMPLEMENTATION
+#include "tsf.h"
+#include "tsf_test.h"
+
+#define SAMPLE_RATE 48000
+#define BLOCK_SIZE 64
+#define RENDER_BLOCKS 3000
+#define NOTE_BLOCKS 16
+#define DECODE_PASSES 20
+// the target is roughly a quarter of the int16 flash reads: 4 bits per sample plus block headers and partial
+// blocks, and a decode that costs less than the 4x bandwidth it saves (ADPCM render time over the int16 one,
+// samples in host RAM). The SNR has to beat spending the same bits without prediction.
+#define MAX_BITS 4.8
+#define MAX_RENDER_COST 4.0
+
+// the same bandwidth spent without prediction: 4 bit samples scaled by a shift per block
+static double block_float_snr(const int16_t* source, uint32_t count)
+{
+	double signal = 0, error = 0;
+	uint32_t i, j, n;
+	for (i = 0; i < count; i += TSF_ADPCM_BLOCK)
+	{
+		int32_t peak = 0, shift = 0, q, r;
+		n = (count - i < TSF_ADPCM_BLOCK ? count - i : TSF_ADPCM_BLOCK);
+		for (j = 0; j < n; j++) peak |= (source[i + j] < 0 ? ~source[i + j] : source[i + j]);
+		while ((peak >> shift) > 7) shift++;
+		for (j = 0; j < n; j++)
+		{
+			q = (source[i + j] + (shift ? 1 << (shift - 1) : 0)) >> shift;
+			r = (q > 7 ? 7 : q < -8 ? -8 : q) << shift;
+			signal += (double)source[i + j] * source[i + j], error += (double)(source[i + j] - r) * (source[i + j] - r);
+		}
+	}
+	return 10.0 * log10(signal / (error ? error : 1.0));
+}
+
+int main(int argc, char** argv)
+{
+	tsf *plain, *adpcm;
+	struct tsf_adpcm_window w;
+	const int16_t* source;
+	int16_t *decoded, *outPlain, *outAdpcm;
+	uint8_t* pool;
+	uint32_t count, size, i, pass;
+	double signal = 0, error = 0, snr, snrRef, t0, decodeMs, plainMs, adpcmMs;
+	int fail = 0;
+
+	if (argc < 2) {
+		printf("Usage:\n test_tsf_adpcm file.sf2\n");
+		return 1;
+	}
+	plain = tsf_load_filename(argv[1]);
+	adpcm = tsf_load_filename(argv[1]);
+	if (!plain || !adpcm) {
+		fprintf(stderr, "Could not create synth\n");
+		return 1;
+	}
+
+	source = plain->fontSamples + plain->fontSamplesOffset;
+	count = plain->fontSampleCount;
+	size = (uint32_t)tsf_adpcm_encode(source, count, NULL);
+	pool = (uint8_t*)malloc(size);
+	tsf_adpcm_encode(source, count, pool);
+
+	// the whole pool through the window as the voices decode it
+	decoded = (int16_t*)malloc((count + TSF_ADPCM_BLOCK) * sizeof(int16_t));
+	t0 = now_ms();
+	for (pass = 0; pass < DECODE_PASSES; pass++)
+		for (i = 0; i < count; i += TSF_ADPCM_BLOCK)
+		{
+			tsf_adpcm_decode(pool, &w, i);
+			memcpy(decoded + i, w.samples, TSF_ADPCM_BLOCK * sizeof(int16_t));
+		}
+	decodeMs = (now_ms() - t0) / DECODE_PASSES;
+	for (i = 0; i < count; i++)
+		signal += (double)source[i] * source[i], error += (double)(source[i] - decoded[i]) * (source[i] - decoded[i]);
+	snr = 10.0 * log10(signal / (error ? error : 1.0));
+	snrRef = block_float_snr(source, count);
+	printf("%u samples in %u bytes (%.2f bits per sample, %.1fx smaller), decode %.2f ns per sample, SNR %.1f dB "
+		"(%.1f dB for 4 bit block floating point)\n",
+		count, size, size * 8.0 / count, count * 2.0 / size, decodeMs * 1e6 / count, snr, snrRef);
+	if (size * 8.0 / count > MAX_BITS) fail = printf("over %.1f bits per sample\n", MAX_BITS);
+	if (snr < snrRef) fail = printf("SNR under the block floating point one at the same size\n");
+
+	// the same font played from the decoded pool as int16 and from the ADPCM blocks
+	plain->fontSamples = decoded, plain->fontSamplesOffset = 0;
+	adpcm->fontAdpcm = pool;
+	adpcm->windows = (struct tsf_adpcm_window*)malloc((adpcm->voicesMax + TSF_STEAL_FADES) * sizeof(struct tsf_adpcm_window));
+	outPlain = (int16_t*)malloc(RENDER_BLOCKS * BLOCK_SIZE * 2 * sizeof(int16_t));
+	outAdpcm = (int16_t*)malloc(RENDER_BLOCKS * BLOCK_SIZE * 2 * sizeof(int16_t));
+	tsf_set_output(plain, TSF_STEREO_INTERLEAVED, SAMPLE_RATE, 0.0f);
+	tsf_set_output(adpcm, TSF_STEREO_INTERLEAVED, SAMPLE_RATE, 0.0f);
+	plainMs = render_notes(plain, outPlain, RENDER_BLOCKS, BLOCK_SIZE, NOTE_BLOCKS);
+	adpcmMs = render_notes(adpcm, outAdpcm, RENDER_BLOCKS, BLOCK_SIZE, NOTE_BLOCKS);
+	// decoding is paid on every voice, what it saves is flash reads on the target, which the host does not show
+	printf("render: int16 %.2f ms, ADPCM %.2f ms (%.2fx the int16 render cost)\n", plainMs, adpcmMs, adpcmMs / plainMs);
+	if (adpcmMs > plainMs * MAX_RENDER_COST) fail = printf("ADPCM render over %.1fx the int16 one\n", MAX_RENDER_COST);
+	for (i = 0; i < RENDER_BLOCKS * BLOCK_SIZE * 2 && !fail; i++)
+		if (outPlain[i] != outAdpcm[i]) fail = printf("ADPCM voices differ from the decoded pool at frame %u\n", i / 2);
+
+	printf("%s\n", fail ? "FAIL" : "ok");
+	tsf_close(plain);
+	tsf_close(adpcm);
+	free(pool);
+	free(decoded);
+	free(outPlain);
+	free(outAdpcm);
+	return fail != 0;
+}
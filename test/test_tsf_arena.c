@@ -0,0 +1,344 @@
+/* long session of program changes against the tsf region arena, preset cache and sample cache */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static long heap_calls;
+static void* count_malloc(size_t size) { heap_calls++; return malloc(size); }
+static void* count_realloc(void* p, size_t size) { heap_calls++; return realloc(p, size); }
+static void count_free(void* p) { if (p) heap_calls++; free(p); }
+static void critical_enter(void);
+static void critical_exit(void);
+
+#define TSF_MALLOC count_malloc
+#define TSF_REALLOC count_realloc
+#define TSF_FREE count_free
+#define TSF_CRITICAL_ENTER critical_enter
+#define TSF_CRITICAL_EXIT critical_exit
+#define TSF_SAMPLE_CACHE (32 * 1024) // spans take part in the evictions and compactions
+#define TSF_SAMPLE_CACHE_STATS
+#define TSF_RENDER_EFFECTSAMPLEBLOCK 512
+#define TSF_NO_PRESET_NAME
+#define TSF_IMPLEMENTATION
+#include "tsf.h"
+
+#define SAMPLE_RATE 48000
+#define BLOCK_SIZE 64
+#define CHANGES 2000 // program changes, one every EVENT_BLOCKS renders
+#define EVENT_BLOCKS 48
+#define FULL_ARENA (TSF_REGION_ARENA + TSF_SAMPLE_CACHE)
+#define TIGHT_ARENA (24 * 1024)
+
+// the region a voice plays is in the own table of its preset or in a shared one it refs, its spans are the ones of that region
+static int plays_own_region(tsf* f, struct tsf_voice* v)
+{
+	struct tsf_preset* p = &f->presets[v->playingPreset];
+	struct tsf_instrument* inst;
+	int32_t i;
+	if (!p->loaded) return 0;
+	if (v->region >= p->regions && v->region < p->regions + p->privateNum)
+		return v->spans == (p->spans ? p->spans + (v->region - p->regions) * 2 : TSF_NULL);
+	for (i = 0; i < p->regionNum; i++)
+	{
+		if (p->refs[i].table == TSF_REF_PRIVATE) continue;
+		inst = &f->instruments[p->refs[i].table];
+		if (v->region == &inst->regions[p->refs[i].region]) return v->spans == (inst->spans ? inst->spans + p->refs[i].region * 2 : TSF_NULL);
+	}
+	return 0;
+}
+
+// the tables the arena holds must be exactly the ones of the loaded presets and of the instruments they share,
+// each shared table held by as many refs as point into it, and voices must point into tables of their preset
+static int check(tsf* f)
+{
+	uint32_t live = 0, spans = 0, src;
+	int32_t i, j, fail = 0;
+	int32_t* refs = (int32_t*)calloc(f->instrumentNum + 1, sizeof(int32_t));
+
+	for (src = 0; src < f->arenaUsed; src += ((struct tsf_arena_block*)(f->arena + src))->size)
+	{
+		struct tsf_arena_block* b = (struct tsf_arena_block*)(f->arena + src);
+		struct tsf_preset* p = &f->presets[b->preset];
+		void* table;
+		if (b->kind == TSF_ARENA_FREE) continue;
+		live += b->size;
+		if (b->kind == TSF_ARENA_SPANS || b->kind == TSF_ARENA_INSTRUMENT_SPANS) spans += b->size;
+		if (b->kind == TSF_ARENA_INSTRUMENT || b->kind == TSF_ARENA_INSTRUMENT_SPANS)
+		{
+			table = (b->kind == TSF_ARENA_INSTRUMENT ? (void*)f->instruments[b->preset].regions : (void*)f->instruments[b->preset].spans);
+			if ((void*)(b + 1) != table || !f->instruments[b->preset].refCount)
+				fail = printf("table at %u does not belong to instrument %d\n", src, b->preset);
+			continue;
+		}
+		table = (b->kind == TSF_ARENA_REGIONS ? (void*)p->regions : b->kind == TSF_ARENA_KEYINDEX ? (void*)p->keyIndex : b->kind == TSF_ARENA_SPANS ? (void*)p->spans : (void*)p->refs);
+		if (!p->loaded || (void*)(b + 1) != table) fail = printf("table at %u does not belong to preset %d\n", src, b->preset);
+	}
+	if (live + f->arenaHoles != f->arenaUsed) fail = printf("%u live + %u holes != %u used\n", live, f->arenaHoles, f->arenaUsed);
+	if (f->arenaUsed > f->arenaSize) fail = printf("%u used over %u\n", f->arenaUsed, f->arenaSize);
+	if (spans != f->sampleCacheUsed || spans > f->sampleCacheBudget) fail = printf("%u bytes of spans, %u counted, %u budget\n", spans, f->sampleCacheUsed, f->sampleCacheBudget);
+
+	for (i = 0; i < f->presetNum; i++)
+		for (j = 0; f->presets[i].loaded && j < f->presets[i].regionNum; j++)
+			if (f->presets[i].refs[j].table != TSF_REF_PRIVATE) refs[f->presets[i].refs[j].table]++;
+	for (i = 0; i < f->instrumentNum && !fail; i++)
+		if (refs[i] != f->instruments[i].refCount || !refs[i] != !f->instruments[i].regions)
+			fail = printf("instrument %d held %d times by %d refs\n", i, f->instruments[i].refCount, refs[i]);
+	free(refs);
+
+	for (i = 0; i < f->voiceActiveNum && !fail; i++)
+		if (!plays_own_region(f, &f->voices[f->voiceActive[i]]))
+			fail = printf("voice %d plays a region outside preset %d\n", f->voiceActive[i], f->voices[f->voiceActive[i]].playingPreset);
+	return fail;
+}
+
+// the region layout before generators were packed into int16: float envelopes, attenuation, pan and LFO delays
+struct float_region
+{
+	int16_t loop_mode;
+	uint32_t sample_rate;
+	uint8_t lokey, hikey, lovel, hivel;
+	uint32_t group, offset, end, loop_start, loop_end;
+	int16_t transpose, tune, pitch_keycenter, pitch_keytrack;
+	float attenuation, pan;
+	float ampenv[8], modenv[8];
+	int16_t initialFilterQ, initialFilterFc;
+	int16_t modEnvToPitch, modEnvToFilterFc, modLfoToFilterFc, modLfoToVolume;
+	float delayModLFO;
+	int16_t freqModLFO, modLfoToPitch;
+	float delayVibLFO;
+	int16_t freqVibLFO, vibLfoToPitch;
+};
+
+// arena bytes of every preset that fits at once, against float regions and against their regions resolved one table per preset
+static void resident(const char* font)
+{
+	tsf* f = tsf_load_filename(font);
+	uint32_t flat = 0, regions = 0, unpacked;
+	int32_t i, j, n = 0, zones = 0, shared = 0;
+
+	if (!f) return;
+	f->cacheBudget = f->arenaSize;
+	tsf_set_sample_cache(f, 0);
+	for (i = 0; i < tsf_get_presetcount(f); i++)
+	{
+		tsf_load_preset(f, i);
+		if (!f->presets[i].loaded) break;
+		flat += f->presets[i].regionNum * sizeof(struct tsf_region) + sizeof(struct tsf_arena_block);
+		if (f->presets[i].keyIndex) flat += (((struct tsf_arena_block*)f->presets[i].keyIndex) - 1)->size;
+		regions += f->presets[i].privateNum;
+		for (j = 0; j < f->presets[i].regionNum; j++) shared += (f->presets[i].refs[j].table != TSF_REF_PRIVATE);
+		zones += f->presets[i].regionNum;
+		n++;
+	}
+	for (i = 0; i < f->instrumentNum; i++)
+		if (f->instruments[i].refCount) regions += f->instruments[i].regionNum;
+	unpacked = f->arenaUsed + regions * (uint32_t)(sizeof(struct float_region) - sizeof(struct tsf_region));
+	printf("region %u bytes, %u with floats\n", (uint32_t)sizeof(struct tsf_region), (uint32_t)sizeof(struct float_region));
+	printf("%d presets resident in %u bytes, %u bytes with float regions, %u bytes with a table per preset\n", n, f->arenaUsed, unpacked, flat);
+	// only zones under a preset zone without generators share the table of their instrument
+	printf("%d of %d zones (%.1f%%) play shared instrument tables, the others are under preset zones with generators\n",
+		shared, zones, 100.0 * shared / (zones ? zones : 1));
+	tsf_close(f);
+}
+
+static int run(tsf* f, uint32_t arena_size, const char* name)
+{
+	static int16_t buf[BLOCK_SIZE * 2];
+	uint32_t peak[2] = { 0, 0 };
+	long heap;
+	int fail = 0, c, hits, misses, evictions, spanHits, spanMisses, spanBytes;
+
+	srand(1);
+	f->arenaSize = arena_size;
+	for (c = 0; c < 16; c++) tsf_channel_set_presetindex(f, c, 0);
+	heap = heap_calls;
+
+	for (c = 0; c < CHANGES && !fail; c++)
+	{
+		int chan = rand() % 16;
+		tsf_channel_set_presetindex(f, chan, rand() % tsf_get_presetcount(f));
+		for (int n = 0; n < 4; n++) tsf_channel_note_on(f, rand() % 16, 36 + rand() % 48, 0.8f);
+		if (c % 8 == 7) tsf_channel_note_off_all(f, rand() % 16);
+		for (int b = 0; b < EVENT_BLOCKS && !fail; b++)
+		{
+			tsf_render_short(f, buf, BLOCK_SIZE, 0);
+			fail = check(f);
+			if (!fail && f->arenaHoles) fail = printf("holes survived the collection\n");
+			if (!fail && arena_size == FULL_ARENA && f->arenaUsed - f->sampleCacheUsed > f->cacheBudget) fail = printf("%u bytes cached over the budget\n", f->arenaUsed);
+			if (f->arenaUsed > peak[c >= CHANGES / 2]) peak[c >= CHANGES / 2] = f->arenaUsed;
+		}
+	}
+
+	tsf_preset_cache_stats(f, &hits, &misses, &evictions);
+	tsf_sample_cache_stats(f, &spanHits, &spanMisses, &spanBytes);
+	printf("%s arena %u: peak %u / %u bytes (first / second half), %d failed loads, %ld heap calls, cache %d hits %d misses %d evictions\n",
+		name, arena_size, peak[0], peak[1], tsf_region_arena_failures(f), heap_calls - heap, hits, misses, evictions);
+	printf("%s arena %u: %u bytes of sample spans, %.1f%% of the samples read from them\n",
+		name, arena_size, spanBytes, 100.0 * spanHits / (spanHits + spanMisses ? spanHits + spanMisses : 1));
+	if (heap_calls != heap) fail = printf("presets were loaded from the heap\n");
+	return fail;
+}
+
+// a preset the channel switched away from stays cached over idle time, coming back to it is a hit
+static int cache_reuse(tsf* f)
+{
+	static int16_t buf[BLOCK_SIZE * 2];
+	int misses, again, b;
+
+	tsf_channel_set_presetindex(f, 0, 0);
+	tsf_channel_note_on(f, 0, 60, 0.8f);
+	tsf_channel_set_presetindex(f, 0, 1);
+	for (b = 0; b < 4096; b++) tsf_render_short(f, buf, BLOCK_SIZE, 0);
+	tsf_preset_cache_stats(f, TSF_NULL, &misses, TSF_NULL);
+	tsf_channel_set_presetindex(f, 0, 0);
+	tsf_channel_note_on(f, 0, 62, 0.8f);
+	tsf_preset_cache_stats(f, TSF_NULL, &again, TSF_NULL);
+	tsf_channel_sounds_off_all(f, 0);
+	if (again != misses) return printf("idle preset was reloaded\n");
+	return 0;
+}
+
+// the loader critical sections stand for masking the audio and MIDI interrupts: one raised meanwhile is taken when
+// the last section exits, and the loader must not evict outside of them. The render takes one around each voice,
+// a MIDI interrupt is taken between them.
+static tsf* irq_synth;
+static int critical_depth, irq_count, irq_fail, irq_running, midi_running, midi_count;
+static uint32_t critical_evictions;
+
+// every voice is once in the active or the free list, and knows its place in the active one
+static int lists_ok(tsf* f)
+{
+	static uint8_t seen[TSF_MAX_VOICES];
+	int32_t i;
+	if (f->voiceActiveNum + f->voiceFreeNum != f->voiceNum) return 0;
+	memset(seen, 0, sizeof(seen));
+	for (i = 0; i < f->voiceActiveNum; i++)
+		if (seen[f->voiceActive[i]]++ || f->voicesCold[f->voiceActive[i]].activeIdx != i || f->voices[f->voiceActive[i]].playingPreset == -1) return 0;
+	for (i = 0; i < f->voiceFreeNum; i++)
+		if (seen[f->voiceFree[i]]++) return 0;
+	return 1;
+}
+
+// a MIDI interrupt preempting the render between two voices
+static void midi(void)
+{
+	tsf* f = irq_synth;
+	int32_t chan = rand() % 16;
+	midi_running = 1;
+	if (rand() % 4) tsf_channel_note_on(f, chan, 36 + rand() % 48, 0.8f);
+	else tsf_channel_note_off_all(f, chan);
+	midi_count++;
+	midi_running = 0;
+}
+
+// a MIDI interrupt switching a channel to the preset the eviction picks next (the least recently used one no channel
+// selects) or any other and playing it, then an audio interrupt rendering
+static void irq(void)
+{
+	static int16_t buf[BLOCK_SIZE * 2];
+	tsf* f = irq_synth;
+	int32_t i, c, victim = -1, chan = rand() % 16;
+
+	irq_running = 1;
+	for (i = 0; i < f->presetNum; i++)
+	{
+		for (c = 0; c < f->channels->channelNum && f->channels->channels[c].presetIndex != i; c++);
+		if (c == f->channels->channelNum && f->presets[i].loaded && (victim < 0 || f->presets[i].lastUse < f->presets[victim].lastUse)) victim = i;
+	}
+	tsf_channel_set_presetindex(f, chan, (victim >= 0 && rand() % 2 ? victim : rand() % f->presetNum));
+	tsf_channel_note_on(f, chan, 36 + rand() % 48, 0.8f);
+	if (rand() % 8 == 0) tsf_channel_sounds_off_all(f, rand() % 16);
+	tsf_render_short(f, buf, BLOCK_SIZE, 0);
+	if (!lists_ok(f)) irq_fail = printf("voice lists broken by a note-on taken during the render\n");
+	for (i = 0; i < f->voiceActiveNum; i++)
+		if (!plays_own_region(f, &f->voices[f->voiceActive[i]]))
+			irq_fail = printf("voice %d plays a region outside preset %d\n", f->voiceActive[i], f->voices[f->voiceActive[i]].playingPreset);
+	irq_count++;
+	irq_running = 0;
+}
+
+static void critical_enter(void)
+{
+	if (irq_synth && critical_depth++ == 0 && irq_synth->cacheEvictions != critical_evictions)
+		irq_fail = printf("evicted outside a critical section\n");
+}
+
+static void critical_exit(void)
+{
+	if (!irq_synth || --critical_depth || midi_running) return;
+	if (irq_running)
+	{
+		// the render must only let it in between voices, with the lists complete
+		if (!lists_ok(irq_synth)) irq_fail = printf("MIDI interrupt taken with the voice lists half updated\n");
+		else if (rand() % 2) midi();
+		return;
+	}
+	critical_evictions = irq_synth->cacheEvictions;
+	irq();
+}
+
+// deferred loader over a small cache budget with note-ons taken between each of its critical sections,
+// a voice must never start on a preset being evicted
+static int preempted(const char* font)
+{
+	tsf* f = tsf_load_filename(font);
+	int fail = 0, loaded = 0, c, evictions;
+
+	if (!f) return printf("Could not create synth\n");
+	tsf_set_output(f, TSF_STEREO_INTERLEAVED, SAMPLE_RATE, 0.0f);
+	tsf_set_max_voices(f, 64);
+	tsf_set_preset_loader(f, 1);
+	tsf_set_preset_cache(f, TIGHT_ARENA);
+	for (c = 0; c < 16; c++) tsf_channel_set_presetindex(f, c, c % tsf_get_presetcount(f));
+	srand(1);
+	irq_synth = f;
+	critical_evictions = f->cacheEvictions;
+	for (c = 0; c < CHANGES / 4 && !irq_fail && !fail; c++)
+	{
+		irq();
+		loaded += tsf_load_pending(f);
+		fail = check(f);
+	}
+	irq_synth = TSF_NULL;
+
+	tsf_preset_cache_stats(f, TSF_NULL, TSF_NULL, &evictions);
+	printf("preempted loader: %d interrupts, %d loads, %d evictions, %d MIDI interrupts during the render\n", irq_count, loaded, evictions, midi_count);
+	if (irq_fail) fail = 1;
+	if (!evictions) fail = printf("the loader never evicted\n");
+	tsf_close(f);
+	return fail;
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t sizes[2] = { FULL_ARENA, TIGHT_ARENA };
+	const char* names[2] = { "full", "tight" };
+	int fail = 0;
+
+	if (argc < 2) {
+		printf("Usage:\n test_tsf_arena file.sf2\n");
+		return 1;
+	}
+
+	resident(argv[1]);
+	for (int r = 0; r < 2; r++) {
+		tsf* f = tsf_load_filename(argv[1]);
+		if (!f) {
+			fprintf(stderr, "Could not create synth\n");
+			return 1;
+		}
+		tsf_set_output(f, TSF_STEREO_INTERLEAVED, SAMPLE_RATE, 0.0f);
+		tsf_set_max_voices(f, 64);
+		if (r == 0) fail |= cache_reuse(f);
+		fail |= run(f, sizes[r], names[r]);
+		// the full arena holds every preset channels select, a tight one has to report what does not fit and keep going
+		if (r == 0 && tsf_region_arena_failures(f)) fail = printf("presets did not fit the full arena\n");
+		if (r == 1 && !tsf_region_arena_failures(f)) fail = printf("the tight arena never ran out\n");
+		tsf_close(f);
+	}
+	fail |= preempted(argv[1]);
+
+	printf("%s\n", fail ? "FAIL" : "ok");
+	return fail != 0;
+}
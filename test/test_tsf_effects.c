@@ -0,0 +1,105 @@
+/* effects skipped while nothing is sent to them and their tail is gone: the output has to stay what always
+   processing them renders, and a send coming back has to bring them back */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TSF_RENDER_EFFECTSAMPLEBLOCK 512
+#define TSF_NO_PRESET_NAME
+#define TSF_IMPLEMENTATION
+#include "tsf.h"
+#include "tsf_test.h"
+
+#define SAMPLE_RATE 48000
+#define BLOCK_SIZE 64
+#define NOTE_BLOCKS 400
+#define TAIL_BLOCKS 3000 // 4 seconds for the reverb to ring out
+#define MAX_DIFF (TSF_REVERB_FLOOR + 1) // LSB the skipped reverb tail under its floor may leave out
+#define CROSSING_BLOCKS 16 // blocks around the one the effects stop at, where a bypass coming too early would show
+
+static tsf* create(const char* font, int sends)
+{
+	tsf* f = tsf_load_filename(font);
+	int c;
+	if (!f) return TSF_NULL;
+	tsf_set_output(f, TSF_STEREO_INTERLEAVED, SAMPLE_RATE, 0.0f);
+	tsf_set_max_voices(f, 32);
+	tsf_chorus_setup(f, 50.0f, 0.5f, 0.4f, 6.3f);
+	for (c = 0; c < 16; c++)
+	{
+		tsf_channel_set_presetindex(f, c, c % tsf_get_presetcount(f));
+		tsf_channel_midi_control(f, c, 91, sends ? 64 : 0);
+		tsf_channel_midi_control(f, c, 93, sends ? 48 : 0);
+	}
+	return f;
+}
+
+// chords then silence, twice, the reference processes every effect on every block
+static int run(const char* font, int sends, const char* name)
+{
+	static int16_t out[BLOCK_SIZE * 2], ref[BLOCK_SIZE * 2];
+	tsf *f = create(font, sends), *r = create(font, sends);
+	int fail = 0, round, b, i, diff = 0, active[2] = { 0, 0 }, sent[2] = { 0, 0 }, stop[2] = { -1, -1 }, crossDiff = 0, blockDiff, recent[CROSSING_BLOCKS] = { 0 };
+	double t0, skipMs = 0, refMs = 0;
+
+	if (!f || !r) return printf("Could not create synth\n");
+	for (round = 0; round < 2; round++)
+	{
+		for (i = 0; i < 4; i++)
+		{
+			tsf_channel_note_on(f, i, 48 + i * 7, 0.8f);
+			tsf_channel_note_on(r, i, 48 + i * 7, 0.8f);
+		}
+		for (b = 0; b < NOTE_BLOCKS + TAIL_BLOCKS; b++)
+		{
+			if (b == NOTE_BLOCKS)
+				for (i = 0; i < 4; i++) tsf_channel_sounds_off_all(f, i), tsf_channel_sounds_off_all(r, i);
+			r->chorusQuiet = r->reverbQuiet = 0;
+			t0 = now_ms();
+			tsf_render_short(f, out, BLOCK_SIZE, 0);
+			skipMs += now_ms() - t0;
+			t0 = now_ms();
+			tsf_render_short(r, ref, BLOCK_SIZE, 0);
+			refMs += now_ms() - t0;
+			for (i = 0, blockDiff = 0; i < BLOCK_SIZE * 2; i++)
+				if (abs(out[i] - ref[i]) > blockDiff) blockDiff = abs(out[i] - ref[i]);
+			if (blockDiff > diff) diff = blockDiff;
+			if (b < NOTE_BLOCKS && tsf_effects_active(f) == (TSF_EFFECT_CHORUS | TSF_EFFECT_REVERB)) sent[round] = 1;
+			if (b >= NOTE_BLOCKS) active[round] += (tsf_effects_active(f) != 0);
+			// the blocks before and after the one the tail falls under the floor at
+			recent[b % CROSSING_BLOCKS] = blockDiff;
+			if (b >= NOTE_BLOCKS && stop[round] < 0 && !tsf_effects_active(f))
+				for (stop[round] = b, i = 0; i < CROSSING_BLOCKS; i++)
+					if (recent[i] > crossDiff) crossDiff = recent[i];
+			if (stop[round] >= 0 && b < stop[round] + CROSSING_BLOCKS && blockDiff > crossDiff) crossDiff = blockDiff;
+		}
+		if (tsf_effects_active(f)) fail = printf("%s: effects still run after the tail\n", name);
+	}
+
+	printf("%s: tail blocks with effects running: %d in round 1, %d in round 2\n", name, active[0], active[1]);
+	printf("%s: max diff against always processing: %d LSB over the whole render, %d LSB around the stop, %d LSB allowed\n",
+		name, diff, crossDiff, sends ? MAX_DIFF : 0);
+	printf("%s: render time: %.2f ms with the bypass, %.2f ms always processing\n", name, skipMs, refMs);
+	if (diff > (sends ? MAX_DIFF : 0)) fail = printf("%s: output differs by %d LSB\n", name, diff);
+	if (sends && (stop[0] < 0 || stop[1] < 0)) fail = printf("%s: the effects never stopped\n", name);
+	if (crossDiff > (sends ? MAX_DIFF : 0)) fail = printf("%s: output differs by %d LSB where the effects stop\n", name, crossDiff);
+	if (sends && !(sent[0] && sent[1])) fail = printf("%s: effects did not resume on new sends\n", name);
+	tsf_close(f);
+	tsf_close(r);
+	return fail;
+}
+
+int main(int argc, char** argv)
+{
+	int fail = 0;
+
+	if (argc < 2) {
+		printf("Usage:\n test_tsf_effects file.sf2\n");
+		return 1;
+	}
+	fail |= run(argv[1], 1, "sends");
+	fail |= run(argv[1], 0, "no sends");
+	printf("%s\n", fail ? "FAIL" : "ok");
+	return fail != 0;
+}
@@ -0,0 +1,95 @@
+/* replay the tsf CPU load governor against a scripted cycle counter */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TSF_RENDER_EFFECTSAMPLEBLOCK 512
+#define TSF_NO_PRESET_NAME
+#define TSF_IMPLEMENTATION
+#include "tsf.h"
+
+#define SAMPLE_RATE 48000
+#define BLOCK_SIZE 480
+#define CYCLES_PER_SAMPLE 100 // budget of 48000 cycles per block
+#define FX_CYCLES 12000
+#define VOICE_CYCLES 1500
+#define BLOCKS 600
+
+static tsf* synth;
+static uint32_t clock_now;
+static int clock_calls;
+
+// the render reads the counter before and after, the second read adds what this block would cost
+static uint32_t scripted_cycles(void)
+{
+	if (clock_calls++ & 1) {
+		int level = tsf_governor_level(synth);
+		uint32_t voice = (level >= TSF_GOVERNOR_NO_INTERPOLATION ? VOICE_CYCLES * 3 / 4 : VOICE_CYCLES);
+		clock_now += tsf_active_voice_count(synth) * voice + (level >= TSF_GOVERNOR_NO_EFFECTS ? 0 : FX_CYCLES);
+	}
+	return clock_now;
+}
+
+// light load, then a burst of notes over the budget while more keep coming, then silence
+static int run(int* levels)
+{
+	static int16_t buf[BLOCK_SIZE * 2];
+	int fail = 0, cap = -1, calm = 0;
+
+	clock_now = 0, clock_calls = 0;
+	tsf_set_max_voices(synth, 128);
+	tsf_set_governor(synth, scripted_cycles, CYCLES_PER_SAMPLE);
+	for (int i = 0; i < 4; i++) tsf_channel_note_on(synth, 0, 48 + i, 0.8f);
+
+	for (int b = 0; b < BLOCKS; b++) {
+		int prev = tsf_governor_level(synth);
+		if (b == 100) for (int i = 0; i < 40; i++) tsf_channel_note_on(synth, 0, 36 + i, 0.8f);
+		if (b > 100 && b < 200) tsf_channel_note_on(synth, 0, 76 + (b % 40), 0.8f);
+		if (b == 200) tsf_channel_sounds_off_all(synth, 0);
+		tsf_render_short(synth, buf, BLOCK_SIZE, 0);
+		levels[b] = tsf_governor_level(synth);
+
+		if (levels[b] > prev + 1 || levels[b] < prev - 1) fail = printf("block %d: level jumped %d -> %d\n", b, prev, levels[b]);
+		if (levels[b] < prev && calm < TSF_GOVERNOR_HOLD - 1) fail = printf("block %d: recovered after %d calm blocks\n", b, calm);
+		calm = (tsf_governor_load(synth) < TSF_GOVERNOR_LOW ? calm + 1 : 0);
+		if (levels[b] < prev) calm = 0;
+
+		if (levels[b] == TSF_GOVERNOR_FULL) cap = -1;
+		else if (cap < 0) cap = tsf_active_voice_count(synth);
+		else if (tsf_active_voice_count(synth) > cap) fail = printf("block %d: %d voices over the cap of %d\n", b, tsf_active_voice_count(synth), cap);
+
+		if (levels[b] != prev) printf("block %3d: load %3d%% voices %3d level %d\n", b, tsf_governor_load(synth), tsf_active_voice_count(synth), levels[b]);
+	}
+	if (levels[99] != TSF_GOVERNOR_FULL) fail = printf("light load was degraded\n");
+	if (levels[199] != TSF_GOVERNOR_NO_EFFECTS) fail = printf("overload did not reach the last step\n");
+	if (levels[BLOCKS - 1] != TSF_GOVERNOR_FULL) fail = printf("did not recover\n");
+	return fail;
+}
+
+int main(int argc, char** argv)
+{
+	static int first[BLOCKS], second[BLOCKS];
+	int fail;
+
+	if (argc < 2) {
+		printf("Usage:\n test_tsf_governor file.sf2 [preset_number]\n");
+		return 1;
+	}
+
+	synth = tsf_load_filename(argv[1]);
+	if (!synth) {
+		fprintf(stderr, "Could not create synth\n");
+		return 1;
+	}
+	tsf_set_output(synth, TSF_STEREO_INTERLEAVED, SAMPLE_RATE, 0.0f);
+	tsf_channel_set_presetnumber(synth, 0, argc > 2 ? atoi(argv[2]) : 0, 0);
+
+	fail = run(first);
+	fail |= run(second);
+	if (memcmp(first, second, sizeof(first))) fail = printf("replay took different decisions\n");
+
+	printf("%s\n", fail ? "FAIL" : "ok");
+	tsf_close(synth);
+	return fail != 0;
+}
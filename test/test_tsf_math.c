@@ -0,0 +1,50 @@
+/* compare the tsf exp2/tan tables against libm */
+
+#include <stdio.h>
+#include <math.h>
+
+#define TSF_NO_PRESET_NAME
+#define TSF_IMPLEMENTATION
+#include "tsf.h"
+
+#define STEPS 1000000
+
+struct range { const char* name; double lo, hi, bound; double (*ref)(double); float (*tab)(float); };
+
+static double ref_timecents2Secs(double x) { return pow(2.0, x / 1200.0); }
+static double ref_cents2Hertz(double x) { return 8.176 * pow(2.0, x / 1200.0); }
+static double ref_decibelsToGain(double x) { return pow(10.0, x / 20.0); }
+static double ref_envelope(double x) { return exp(x); } // exponential segment over one block
+static double ref_tanpi(double x) { return tan(M_PI * x); }
+
+static float tab_envelope(float x) { return tsf_exp2f(x * TSF_LOG2E); }
+
+static const struct range ranges[] = {
+	// timecents of envelope times and keynum scaling
+	{ "timecents2Secs", -12000, 8000, 5e-6, ref_timecents2Secs, tsf_timecents2Secsf },
+	// filter cutoff and pitch cents
+	{ "cents2Hertz", 1500, 13500, 5e-6, ref_cents2Hertz, tsf_cents2Hertz },
+	{ "decibelsToGain", -99.9, 12, 5e-6, ref_decibelsToGain, tsf_decibelsToGain },
+	{ "envelope exp", -20, 0, 5e-6, ref_envelope, tab_envelope },
+	// lowpass Fc / samplerate, the filter is bypassed above 0.499
+	{ "tan(pi*x)", 1e-4, 0.499, 4e-5, ref_tanpi, tsf_tanpif },
+};
+
+int main(int argc, char** argv)
+{
+	int fail = 0;
+	for (unsigned int r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++)
+	{
+		const struct range* g = &ranges[r];
+		double maxErr = 0, maxAt = 0;
+		for (int i = 0; i <= STEPS; i++)
+		{
+			float x = (float)(g->lo + (g->hi - g->lo) * i / STEPS);
+			double want = g->ref(x), err = fabs(g->tab(x) - want) / want;
+			if (err > maxErr) maxErr = err, maxAt = x;
+		}
+		printf("%-16s max relative error %.2e at %g (bound %.0e) %s\n", g->name, maxErr, maxAt, g->bound, maxErr <= g->bound ? "ok" : "FAIL");
+		if (maxErr > g->bound) fail = 1;
+	}
+	return fail;
+}
@@ -0,0 +1,131 @@
+/* reverb comb bank: the packed comb pairs with per run wraps against the per sample reference,
+   cycles per block through the intrinsic shims and the output within 1 LSB */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define TSF_IMPLEMENTATION
+#include "tsf.h"
+#include "tsf_test.h"
+
+#define BLOCK_SIZE 512
+#define BLOCKS 4000
+#define MAX_DIFF 1 // LSB of the 16-bit output
+
+// the reverb as it ran before: one comb buffer each, every position wrapped and every parameter reloaded per sample
+typedef struct {
+	int16_t lpo;
+	int16_t a0, b1, gl, gh, d1, d2;
+	uint32_t tap[NUM_COMBS], ap_tap[NUM_APS];
+	int16_t comp_gain[NUM_COMBS], ap_gain;
+	uint32_t comb_pos, ap_pos;
+	int16_t comb[NUM_COMBS][COMB_SIZE];
+	int16_t ap[NUM_APS][AP_SIZE];
+} reference_t;
+
+static void reference_process(reference_t *rev, int32_t *in, int32_t *out, unsigned int samples)
+{
+	uint32_t pos, comb_pos = rev->comb_pos, ap_pos = rev->ap_pos;
+	int32_t *input = in, *output = out;
+	int32_t in_s, in_s1, temp, out_m, out_l, out_r;
+	int c;
+
+	for (pos = 0; pos < samples; pos++) {
+		temp = 0;
+		in_s = __SSAT(((input[pos]) >> 15)/4, 16);
+		rev->lpo = ((int32_t)rev->a0 * (int32_t)in_s + (int32_t)rev->b1 * (int32_t)rev->lpo) >> 15;
+		in_s1 = (in_s << 15) + (int32_t)rev->gl * (int32_t)rev->lpo + (int32_t)rev->gh * (int32_t)(in_s - rev->lpo);
+		for (c = 0; c < NUM_COMBS; c++) {
+			int32_t v = (int32_t)rev->comb[c][comb_pos];
+			rev->comb[c][(comb_pos + rev->tap[c]) & COMB_MASK] = __SSAT((in_s1 + (int32_t)rev->comp_gain[c] * v) >> 15, 16);
+			temp = __SSAT(temp + v, 16);
+		}
+		for (c = 0; c < NUM_APS; c++) {
+			int32_t v = (int32_t)rev->ap[c][ap_pos];
+			rev->ap[c][(ap_pos + rev->ap_tap[c]) & AP_MASK] = __SSAT(((temp << 15) + ((int32_t)rev->ap_gain * (int32_t)v)) >> 15, 16);
+			temp = __SSAT((((int32_t)rev->d1 * temp) >> 15) + v, 16);
+		}
+		out_m = ((int32_t)rev->d2 * temp) >> 15;
+		out_l = *output++ >> 15;
+		out_r = *output++ >> 15;
+		output -= 2;
+		*output++ = (out_m + out_l * 3/4) << 15;
+		*output++ = (out_m + out_r * 3/4) << 15;
+		comb_pos = (comb_pos + 1) & COMB_MASK;
+		ap_pos = (ap_pos + 1) & AP_MASK;
+	}
+	rev->comb_pos = comb_pos;
+	rev->ap_pos = ap_pos;
+}
+
+static void reference_init(reference_t *ref, const reverb_t *rev)
+{
+	memset(ref, 0, sizeof(*ref));
+	ref->a0 = rev->a0, ref->b1 = rev->b1, ref->gl = rev->gl, ref->gh = rev->gh, ref->d1 = rev->d1, ref->d2 = rev->d2;
+	memcpy(ref->tap, rev->tap, sizeof(ref->tap));
+	memcpy(ref->ap_tap, rev->ap_tap, sizeof(ref->ap_tap));
+	memcpy(ref->comp_gain, rev->comp_gain, sizeof(ref->comp_gain));
+	ref->ap_gain = rev->ap_gain;
+	// reverb_init() clears the buffers but keeps the filter state and the positions
+	ref->lpo = rev->lpo, ref->comb_pos = rev->comb_pos, ref->ap_pos = rev->ap_pos;
+}
+
+// reverb send of a few voices: decaying notes with noise, some of them hot enough to clip the comb bank
+static void send(int32_t* in, int blk)
+{
+	static double phase;
+	double level = (blk % 64 < 48 ? 0.6 * exp(-(blk % 64) / 16.0) : 0.0) * (blk % 256 < 32 ? 4.0 : 1.0);
+	int i;
+	for (i = 0; i < BLOCK_SIZE; i++, phase += 0.031) {
+		double x = level * (sin(phase) + 0.5 * sin(phase * 2.73) + 0.2 * (rand() / (double)RAND_MAX - 0.5));
+		in[i] = (int32_t)(x * 32767.0) << 15;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	static reverb_t rev;
+	static reference_t ref;
+	static int32_t in[BLOCK_SIZE], dry[BLOCK_SIZE * 2], out[BLOCK_SIZE * 2], outRef[BLOCK_SIZE * 2];
+	double t, packedNs = 0, refNs = 0;
+	int32_t maxDiff = 0;
+	int blk, i, s, fail = 0;
+
+	for (s = 0; s < 3; s++)
+	{
+		// room settings from the firmware default to a large dark room
+		static const float settings[3][3] = { { 0.0f, 0.5f, 0.5f }, { 3.0f, 1.0f, 0.9f }, { -6.0f, 0.1f, 1.0f } };
+		reverb_init(&rev);
+		reverb_set_colour(&rev, settings[s][0]);
+		reverb_set_size(&rev, settings[s][1]);
+		reverb_set_decay(&rev, settings[s][2]);
+		reference_init(&ref, &rev);
+		srand(1);
+		for (blk = 0; blk < BLOCKS; blk++)
+		{
+			send(in, blk);
+			for (i = 0; i < BLOCK_SIZE * 2; i++) dry[i] = ((rand() % 2001) - 1000) << 15;
+			memcpy(out, dry, sizeof(dry));
+			memcpy(outRef, dry, sizeof(dry));
+			t = now_ns();
+			reverb_process(&rev, in, out, BLOCK_SIZE);
+			packedNs += now_ns() - t;
+			t = now_ns();
+			reference_process(&ref, in, outRef, BLOCK_SIZE);
+			refNs += now_ns() - t;
+			for (i = 0; i < BLOCK_SIZE * 2; i++)
+			{
+				int32_t d = abs((out[i] >> 15) - (outRef[i] >> 15));
+				if (d > maxDiff) maxDiff = d;
+			}
+		}
+	}
+
+	printf("reverb per %d samples block: reference %.0f ns, packed %.0f ns (%.2fx), max difference %d LSB\n",
+		BLOCK_SIZE, refNs / (3 * BLOCKS), packedNs / (3 * BLOCKS), refNs / packedNs, maxDiff);
+	if (maxDiff > MAX_DIFF) fail = printf("output off by more than %d LSB\n", MAX_DIFF);
+	printf("%s\n", fail ? "FAIL" : "ok");
+	return fail != 0;
+}
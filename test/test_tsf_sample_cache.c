@@ -0,0 +1,67 @@
+/* SRAM sample cache: voices reading the attack and loop spans have to render exactly what they render from the
+   font, also when evictions compact the spans under playing voices; reports the hit ratio and the resident bytes */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TSF_RENDER_EFFECTSAMPLEBLOCK 512
+#define TSF_SAMPLE_CACHE (32 * 1024)
+#define TSF_SAMPLE_CACHE_STATS
+#define TSF_IMPLEMENTATION
+#include "tsf.h"
+#include "tsf_test.h"
+
+#define SAMPLE_RATE 48000
+#define BLOCK_SIZE 64
+#define RENDER_BLOCKS 6000
+#define NOTE_BLOCKS 8
+#define PRESET_CACHE (8 * 1024) // small enough for presets to be evicted and the arena compacted while notes play
+
+int main(int argc, char** argv)
+{
+	tsf *plain, *cached;
+	int16_t *outPlain, *outCached;
+	int32_t hits, misses, resident, plainHits;
+	double plainMs, cachedMs;
+	int fail = 0, i;
+
+	if (argc < 2) {
+		printf("Usage:\n test_tsf_sample_cache file.sf2\n");
+		return 1;
+	}
+	plain = tsf_load_filename(argv[1]);
+	cached = tsf_load_filename(argv[1]);
+	if (!plain || !cached) {
+		fprintf(stderr, "Could not create synth\n");
+		return 1;
+	}
+
+	tsf_set_sample_cache(plain, 0);
+	tsf_set_output(plain, TSF_STEREO_INTERLEAVED, SAMPLE_RATE, 0.0f);
+	tsf_set_output(cached, TSF_STEREO_INTERLEAVED, SAMPLE_RATE, 0.0f);
+	tsf_set_preset_cache(plain, PRESET_CACHE);
+	tsf_set_preset_cache(cached, PRESET_CACHE);
+	outPlain = (int16_t*)malloc(RENDER_BLOCKS * BLOCK_SIZE * 2 * sizeof(int16_t));
+	outCached = (int16_t*)malloc(RENDER_BLOCKS * BLOCK_SIZE * 2 * sizeof(int16_t));
+	plainMs = render_notes(plain, outPlain, RENDER_BLOCKS, BLOCK_SIZE, NOTE_BLOCKS);
+	cachedMs = render_notes(cached, outCached, RENDER_BLOCKS, BLOCK_SIZE, NOTE_BLOCKS);
+
+	tsf_sample_cache_stats(plain, &plainHits, TSF_NULL, TSF_NULL);
+	tsf_sample_cache_stats(cached, &hits, &misses, &resident);
+	// the font is in host RAM here, so the spans save nothing and these times are no target numbers
+	printf("%d samples read, %.1f%% from %d resident bytes of spans (budget %d), host render: font %.2f ms, cached %.2f ms\n",
+		hits + misses, 100.0 * hits / (hits + misses ? hits + misses : 1), resident, TSF_SAMPLE_CACHE, plainMs, cachedMs);
+	if (plainHits) fail = printf("the disabled cache was read\n");
+	if (!hits) fail = printf("nothing was read from the cache\n");
+	if (resident > TSF_SAMPLE_CACHE) fail = printf("spans over the budget\n");
+	for (i = 0; i < RENDER_BLOCKS * BLOCK_SIZE * 2 && !fail; i++)
+		if (outPlain[i] != outCached[i]) fail = printf("cached voices differ from the font at frame %d\n", i / 2);
+
+	printf("%s\n", fail ? "FAIL" : "ok");
+	tsf_close(plain);
+	tsf_close(cached);
+	free(outPlain);
+	free(outCached);
+	return fail != 0;
+}
@@ -0,0 +1,120 @@
+/* compile the tsf image of a soundfont and check it against a plain parse */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TSF_RENDER_EFFECTSAMPLEBLOCK 512
+#define TSF_IMPLEMENTATION
+#include "tsf.h"
+#include "tsf_test.h"
+
+static int32_t file_write(void* data, const void* ptr, uint32_t size)
+{
+	return (int32_t)fwrite(ptr, 1, size, (FILE*)data);
+}
+
+static int compile(const char* font, const char* out)
+{
+	tsf* f = tsf_load_filename(font);
+	FILE* fp;
+	int32_t size;
+
+	if (!f) return printf("could not load %s\n", font);
+	fp = fopen(out, "wb");
+	if (!fp) return printf("could not create %s\n", out);
+	size = tsf_image_write(f, file_write, fp, 1);
+	fclose(fp);
+	tsf_close(f);
+	if (!size) return printf("writing the image failed\n");
+	printf("%s: %d bytes\n", out, size);
+	return 0;
+}
+
+// copy of the font with one byte changed at pos, next to the image
+static int edited_font(const char* font, uint32_t pos, char* out, size_t out_size)
+{
+	FILE *in = fopen(font, "rb"), *fp;
+	int c, n = 0;
+	snprintf(out, out_size, "%s.edited.sf2", font);
+	fp = fopen(out, "wb");
+	if (!in || !fp) return 0;
+	while ((c = fgetc(in)) != EOF) fputc(n++ == (int)pos ? c ^ 1 : c, fp);
+	fclose(in);
+	fclose(fp);
+	return 1;
+}
+
+// the image has to give the same directory, lookups and region tables as parsing the font
+static int verify(const char* font, const char* in)
+{
+	tsf *plain, *image;
+	uint8_t* buf;
+	long size;
+	double t0, t1, t2;
+	int fail = 0, i, b, p;
+	char tmp[1024];
+	FILE* fp = fopen(in, "rb");
+
+	if (!fp) return printf("could not open %s\n", in);
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	buf = (uint8_t*)malloc(size);
+	if (fread(buf, 1, size, fp) != (size_t)size) size = 0;
+	fclose(fp);
+
+	t0 = now_ms();
+	plain = tsf_load_filename(font);
+	t1 = now_ms();
+	image = tsf_load_filename_image(font, buf, (int32_t)size);
+	t2 = now_ms();
+	if (!plain || !image) return printf("could not load %s\n", font);
+	printf("load: parse %.2f ms, image %.2f ms\n", t1 - t0, t2 - t1);
+	if (!tsf_image_loaded(image)) return printf("image rejected\n");
+
+	for (b = 0; b < 256; b++)
+		for (p = 0; p < 128; p++)
+			if (tsf_get_presetindex(plain, b, p) != tsf_get_presetindex(image, b, p))
+				fail = printf("bank %d program %d: preset %d != %d\n", b, p, tsf_get_presetindex(plain, b, p), tsf_get_presetindex(image, b, p));
+
+	for (i = 0; i < tsf_get_presetcount(plain) && !fail; i++)
+	{
+		struct tsf_preset *a = &plain->presets[i], *c = &image->presets[i];
+		if (a->bank != c->bank || a->preset != c->preset || a->regionNum != c->regionNum || a->privateNum != c->privateNum || strcmp(a->presetName, c->presetName))
+			fail = printf("preset %d differs\n", i);
+		tsf_load_preset(plain, i);
+		tsf_load_preset(image, i);
+		if (!fail && (!a->loaded || !c->loaded)) fail = printf("preset %d did not load\n", i);
+		if (!fail && !same_regions(plain, a, image, c)) fail = printf("preset %d regions differ\n", i);
+		if (!fail && (!a->keyIndex != !c->keyIndex || (a->keyIndex && memcmp(a->keyIndex, c->keyIndex, (TSF_KEY_INDEX + a->keyIndex[128]) * sizeof(uint16_t)))))
+			fail = printf("preset %d key index differs\n", i);
+		tsf_unload_preset(plain, i);
+		tsf_unload_preset(image, i);
+	}
+
+	// the same font with a renamed preset, and a torn write, have to be rejected
+	tsf_close(image);
+	if (!edited_font(font, plain->hydra.phdrPos, tmp, sizeof(tmp))) return printf("could not write the edited font\n");
+	image = tsf_load_filename_image(tmp, buf, (int32_t)size);
+	if (tsf_image_loaded(image)) fail = printf("image of another font accepted\n");
+	remove(tmp);
+	tsf_close(image);
+	buf[size - 1] ^= 1;
+	image = tsf_load_filename_image(font, buf, (int32_t)size);
+	if (tsf_image_loaded(image)) fail = printf("torn image accepted\n");
+
+	printf("%s\n", fail ? "FAIL" : "ok");
+	tsf_close(plain);
+	tsf_close(image);
+	free(buf);
+	return fail;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc == 4 && !strcmp(argv[1], "-v")) return verify(argv[2], argv[3]) != 0;
+	if (argc == 3) return compile(argv[1], argv[2]) != 0 || verify(argv[1], argv[2]) != 0;
+	printf("Usage:\n tsf_image file.sf2 image.bin     compile the image and verify it\n tsf_image -v file.sf2 image.bin  verify an existing image\n");
+	return 1;
+}
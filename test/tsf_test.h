@@ -0,0 +1,61 @@
+/* helpers shared by the tsf host tests and tools, included after tsf.h */
+
+#ifndef TSF_TEST_H
+#define TSF_TEST_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static inline double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline double now_ms(void)
+{
+	return now_ns() / 1e6;
+}
+
+// same refs, and each playing the same region
+static inline int same_regions(tsf* f, struct tsf_preset* a, tsf* g, struct tsf_preset* c)
+{
+	int32_t i;
+	if (memcmp(a->refs, c->refs, a->regionNum * sizeof(struct tsf_region_ref))) return 0;
+	for (i = 0; i < a->regionNum; i++)
+	{
+		const struct tsf_region_ref* ref = &a->refs[i];
+		const struct tsf_region* ra = (ref->table == TSF_REF_PRIVATE ? &a->regions[ref->region] : &f->instruments[ref->table].regions[ref->region]);
+		const struct tsf_region* rc = (ref->table == TSF_REF_PRIVATE ? &c->regions[ref->region] : &g->instruments[ref->table].regions[ref->region]);
+		if (memcmp(ra, rc, sizeof(struct tsf_region))) return 0;
+	}
+	return 1;
+}
+
+// program changes and notes all over the presets with pitch bends, one every note_blocks blocks, more of them
+// than voices so some are stolen; renders blocks of block_size frames into out at the rate f is set to, in ms
+static inline double render_notes(tsf* f, int16_t* out, int blocks, int block_size, int note_blocks)
+{
+	double t0 = now_ms();
+	int blk;
+
+	srand(1);
+	tsf_set_max_voices(f, 24);
+	for (blk = 0; blk < blocks; blk++)
+	{
+		if (blk % note_blocks == 0)
+		{
+			int chan = rand() % 16;
+			tsf_channel_set_presetindex(f, chan, rand() % tsf_get_presetcount(f));
+			tsf_channel_set_pitchwheel(f, chan, rand() % 16384);
+			tsf_channel_note_on(f, chan, 24 + rand() % 84, 0.8f);
+		}
+		if (blk % 96 == 95) tsf_channel_note_off_all(f, rand() % 16);
+		tsf_render_short(f, out + blk * block_size * 2, block_size, 0);
+	}
+	return now_ms() - t0;
+}
+
+#endif